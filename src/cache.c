@@ -0,0 +1,457 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cache.h"
+#include "ingest.h"
+#include "tileindex.h"
+#include "water.h"
+
+int initRenderCache(rendercache_t **cache, char *dir, int num_jobs, int projection) {
+    if(mkdir(dir, 0755) && errno != EEXIST)
+        return ANAX_ERR_COULD_NOT_WRITE;
+
+    *cache = calloc(1, sizeof(rendercache_t));
+    if(!*cache)
+        return ANAX_ERR_NO_MEMORY;
+    (*cache)->dir = calloc(strlen(dir) + 1, sizeof(char));
+    (*cache)->scratch_keys = calloc(num_jobs ? num_jobs : 1, sizeof(uint64_t));
+    (*cache)->render_keys = calloc(num_jobs ? num_jobs : 1, sizeof(uint64_t));
+    if(!(*cache)->dir || !(*cache)->scratch_keys || !(*cache)->render_keys) {
+        freeRenderCache(*cache);
+        *cache = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+    strcpy((*cache)->dir, dir);
+    (*cache)->num_jobs = num_jobs;
+
+    // Everything besides the source that goes into a scratch file
+    int32_t layout[5] = {CACHE_VERSION, SCRATCH_VERSION, MAPFRAME, projection, getIngestDecimation()};
+    uint64_t seed = hashBytes(CACHE_HASH_SEED, layout, sizeof(layout));
+    region_t *region = getIngestRegion();
+    if(region)
+        seed = hashBytes(seed, region, sizeof(region_t));
+    (*cache)->scratch_seed = seed;
+
+    return 0;
+}
+
+// Set the options a rendered tile depends on. This has to wait until the
+// color scheme is final, which for a relative scheme is once every tile's
+// elevation extremes are known.
+int setRenderCacheParams(rendercache_t *cache, colorscheme_t *colorscheme, int relief, double azimuth, double altitude, int water_min_area, double scale, int kernel, region_t *region) {
+    if(!colorscheme->lut) {
+        int err = compileColorScheme(colorscheme);
+        if(err)
+            return err;
+    }
+
+    // The compiled colors stand for the color scheme, whatever it was loaded
+    // from and however it was scaled
+    uint64_t seed = hashBytes(cache->scratch_seed, colorscheme->lut, COLORSCHEME_LUT_SIZE * sizeof(rgba_t));
+    int32_t flags[4] = {relief, colorscheme->showWater, colorscheme->showWater ? water_min_area : 0, kernel};
+    seed = hashBytes(seed, flags, sizeof(flags));
+    if(colorscheme->showWater)
+        seed = hashBytes(seed, &(colorscheme->water_rgba), sizeof(rgba_t));
+    if(relief) {
+        seed = hashBytes(seed, &azimuth, sizeof(double));
+        seed = hashBytes(seed, &altitude, sizeof(double));
+    }
+    seed = hashBytes(seed, &scale, sizeof(double));
+    if(region)
+        seed = hashBytes(seed, region, sizeof(region_t));
+    cache->render_seed = seed;
+
+    return 0;
+}
+
+void freeRenderCache(rendercache_t *cache) {
+    if(!cache)
+        return;
+    free(cache->dir);
+    free(cache->scratch_keys);
+    free(cache->render_keys);
+    free(cache);
+}
+
+// 64-bit hash over data, continuing from hash. Whole words are mixed in at a
+// time; splitting the same bytes differently between calls gives a
+// different hash.
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *p = data;
+    for(; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        word *= 0x87c37b91114253d5ULL;
+        word = (word << 31) | (word >> 33);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+    for(; size > 0; p++, size--)
+        hash = (hash ^ *p) * 0x100000001b3ULL;
+
+    return hash;
+}
+
+char *getCachePath(rendercache_t *cache, uint64_t key, const char *suffix) {
+    char *path = malloc(strlen(cache->dir) + strlen(suffix) + 18);
+    if(path)
+        sprintf(path, "%s/%016llx%s", cache->dir, (unsigned long long)key, suffix);
+    return path;
+}
+
+// Files are written under a temporary name beside their final one and moved
+// into place once complete, so that no run ever reads a partial file
+static int openTempFile(char *path, char **tmp) {
+    *tmp = malloc(strlen(path) + 8);
+    if(!*tmp)
+        return -1;
+    sprintf(*tmp, "%s.XXXXXX", path);
+    int fd = mkstemp(*tmp);
+    if(fd < 0) {
+        free(*tmp);
+        *tmp = NULL;
+    }
+    return fd;
+}
+
+static int closeTempFile(int fd, char *tmp, char *path, int err) {
+    if(close(fd) && !err)
+        err = ANAX_ERR_COULD_NOT_WRITE;
+    if(!err && rename(tmp, path))
+        err = ANAX_ERR_COULD_NOT_WRITE;
+    if(err)
+        unlink(tmp);
+    free(tmp);
+    return err;
+}
+
+static int writeFully(int fd, const void *data, size_t size, off_t offset) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t res = pwrite(fd, (const uint8_t *)data + done, size - done, offset + done);
+        if(res <= 0)
+            return ANAX_ERR_COULD_NOT_WRITE;
+        done += res;
+    }
+    return 0;
+}
+
+// Fill buf from offset, short only at the end of the file
+static ssize_t readFully(int fd, void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while(done < size) {
+        ssize_t res = pread(fd, (uint8_t *)buf + done, size - done, offset + done);
+        if(res < 0)
+            return -1;
+        if(res == 0)
+            break;
+        done += res;
+    }
+    return done;
+}
+
+static int writeSmallFile(char *path, const void *data, size_t size) {
+    char *tmp;
+    int fd = openTempFile(path, &tmp);
+    if(fd < 0)
+        return ANAX_ERR_COULD_NOT_WRITE;
+    return closeTempFile(fd, tmp, path, writeFully(fd, data, size, 0));
+}
+
+// Get the hash of a source file's contents. A file is only read when it has
+// changed on disk since it was last hashed.
+int hashSourceFile(rendercache_t *cache, char *filename, uint64_t *hash) {
+    struct stat st;
+    if(stat(filename, &st))
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+
+    uint64_t id[2] = {st.st_dev, st.st_ino};
+    char *memo = getCachePath(cache, hashBytes(CACHE_HASH_SEED, id, sizeof(id)), ".src");
+    if(!memo)
+        return ANAX_ERR_NO_MEMORY;
+    cachesource_t source;
+    int fd = open(memo, O_RDONLY);
+    if(fd >= 0) {
+        int found = readFully(fd, &source, sizeof(cachesource_t), 0) == sizeof(cachesource_t) &&
+                    source.magic == CACHE_MAGIC && source.version == CACHE_VERSION &&
+                    source.size == (uint64_t)st.st_size &&
+                    source.mtime_sec == st.st_mtim.tv_sec && source.mtime_nsec == st.st_mtim.tv_nsec &&
+                    source.ctime_sec == st.st_ctim.tv_sec && source.ctime_nsec == st.st_ctim.tv_nsec;
+        close(fd);
+        if(found) {
+            *hash = source.hash;
+            free(memo);
+            return 0;
+        }
+    }
+
+    fd = open(filename, O_RDONLY);
+    uint8_t *buf = malloc(CACHE_CHUNK);
+    if(fd < 0 || !buf) {
+        if(fd >= 0)
+            close(fd);
+        free(buf);
+        free(memo);
+        return (fd < 0) ? ANAX_ERR_FILE_DOES_NOT_EXIST : ANAX_ERR_NO_MEMORY;
+    }
+    uint64_t h = CACHE_HASH_SEED;
+    uint64_t size = 0;
+    ssize_t res;
+    while((res = readFully(fd, buf, CACHE_CHUNK, size)) > 0) {
+        h = hashBytes(h, buf, res);
+        size += res;
+    }
+    close(fd);
+    free(buf);
+    if(res < 0) {
+        free(memo);
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    }
+    h = hashBytes(h, &size, sizeof(uint64_t));
+
+    memset(&source, 0, sizeof(cachesource_t));
+    source.magic = CACHE_MAGIC;
+    source.version = CACHE_VERSION;
+    source.size = st.st_size;
+    source.mtime_sec = st.st_mtim.tv_sec;
+    source.mtime_nsec = st.st_mtim.tv_nsec;
+    source.ctime_sec = st.st_ctim.tv_sec;
+    source.ctime_nsec = st.st_ctim.tv_nsec;
+    source.hash = h;
+    writeSmallFile(memo, &source, sizeof(cachesource_t));
+    free(memo);
+
+    *hash = h;
+    return 0;
+}
+
+// Copy the whole of fd to dst, replacing dst only once the copy is complete
+int copyToFile(int fd, char *dst) {
+    char *tmp;
+    int out = openTempFile(dst, &tmp);
+    if(out < 0)
+        return ANAX_ERR_COULD_NOT_WRITE;
+    uint8_t *buf = malloc(CACHE_CHUNK);
+    if(!buf)
+        return closeTempFile(out, tmp, dst, ANAX_ERR_NO_MEMORY);
+
+    int err = 0;
+    off_t offset = 0;
+    ssize_t res;
+    while(!err && (res = readFully(fd, buf, CACHE_CHUNK, offset)) > 0) {
+        err = writeFully(out, buf, res, offset);
+        offset += res;
+    }
+    if(!err && res < 0)
+        err = ANAX_ERR_FILE_DOES_NOT_EXIST;
+    free(buf);
+
+    return closeTempFile(out, tmp, dst, err);
+}
+
+// Copy src into the cache, then add its record
+int storeCacheEntry(rendercache_t *cache, uint64_t key, const char *suffix, char *src, cacherecord_t *record) {
+    int fd = open(src, O_RDONLY);
+    if(fd < 0)
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    char *path = getCachePath(cache, key, suffix);
+    int err = path ? copyToFile(fd, path) : ANAX_ERR_NO_MEMORY;
+    close(fd);
+    free(path);
+    if(err)
+        return err;
+
+    char rec_suffix[16];
+    snprintf(rec_suffix, sizeof(rec_suffix), "%s.rec", suffix);
+    path = getCachePath(cache, key, rec_suffix);
+    if(!path)
+        return ANAX_ERR_NO_MEMORY;
+    record->magic = CACHE_MAGIC;
+    record->version = CACHE_VERSION;
+    err = writeSmallFile(path, record, sizeof(cacherecord_t));
+    free(path);
+
+    return err;
+}
+
+int loadCacheRecord(rendercache_t *cache, uint64_t key, const char *suffix, cacherecord_t *record) {
+    char rec_suffix[16];
+    snprintf(rec_suffix, sizeof(rec_suffix), "%s.rec", suffix);
+    char *path = getCachePath(cache, key, rec_suffix);
+    if(!path)
+        return ANAX_ERR_NO_MEMORY;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+        return ANAX_ERR_NO_MAP;
+    int found = readFully(fd, record, sizeof(cacherecord_t), 0) == sizeof(cacherecord_t) &&
+                record->magic == CACHE_MAGIC && record->version == CACHE_VERSION;
+    close(fd);
+
+    return found ? 0 : ANAX_ERR_NO_MAP;
+}
+
+// Restore a job's scratch file, as it was before its halo was filled in, from
+// an earlier run over the same source. Returns ANAX_ERR_NO_MAP if there is
+// none, in which case the job is ingested and then stored with
+// storeCachedScratch.
+int lookupCachedScratch(rendercache_t *cache, anaxjob_t *job, int index, int *max_elevation, int *min_elevation) {
+    uint64_t hash;
+    int err = hashSourceFile(cache, job->name, &hash);
+    if(err)
+        return err;
+    uint64_t key = hashBytes(cache->scratch_seed, &hash, sizeof(uint64_t));
+    cache->scratch_keys[index] = key;
+
+    cacherecord_t record;
+    err = loadCacheRecord(cache, key, ".tmp", &record);
+    if(err)
+        return err;
+    char *path = getCachePath(cache, key, ".tmp");
+    if(!path)
+        return ANAX_ERR_NO_MEMORY;
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if(fd < 0)
+        return ANAX_ERR_NO_MAP;
+    err = copyToFile(fd, job->tmpfile);
+    close(fd);
+    if(err)
+        return err;
+
+    job->top_lat = record.top_lat;
+    job->bottom_lat = record.bottom_lat;
+    job->right_lon = record.right_lon;
+    job->left_lon = record.left_lon;
+    job->frame_coordinates = record.frame_coordinates;
+    *max_elevation = record.max_elevation;
+    *min_elevation = record.min_elevation;
+
+    return 0;
+}
+
+int storeCachedScratch(rendercache_t *cache, anaxjob_t *job, int index, geotiffmap_t *map) {
+    if(!cache->scratch_keys[index])
+        return ANAX_ERR_NO_MAP;
+
+    cacherecord_t record;
+    memset(&record, 0, sizeof(cacherecord_t));
+    record.max_elevation = map->max_elevation;
+    record.min_elevation = map->min_elevation;
+    record.top_lat = job->top_lat;
+    record.bottom_lat = job->bottom_lat;
+    record.right_lon = job->right_lon;
+    record.left_lon = job->left_lon;
+    record.frame_coordinates = job->frame_coordinates;
+
+    return storeCacheEntry(cache, cache->scratch_keys[index], ".tmp", job->tmpfile, &record);
+}
+
+// Hash which pixels along a tile's edges are in the same flat region, and each
+// region's elevation and area. Regions are numbered in the order they are met
+// along the edges, since labeling numbers them in whatever order its threads
+// finish.
+static int hashWaterBoundary(waterboundary_t *boundary, uint64_t *key) {
+    int32_t *order = malloc((boundary->num_regions ? boundary->num_regions : 1) * sizeof(int32_t));
+    if(!order)
+        return ANAX_ERR_NO_MEMORY;
+    for(int r = 0; r < boundary->num_regions; r++)
+        order[r] = -1;
+
+    int32_t dims[2] = {boundary->height, boundary->width};
+    uint64_t hash = hashBytes(*key, dims, sizeof(dims));
+    int32_t next = 0;
+    for(int e = 0; e < 4; e++) {
+        int length = (e < WATER_EDGE_W) ? boundary->width : boundary->height;
+        for(int k = 0; k < length; k++) {
+            int32_t region = boundary->edges[e][k];
+            if(region < 0 || region >= boundary->num_regions) {
+                hash = hashBytes(hash, &region, sizeof(int32_t));
+                continue;
+            }
+            if(order[region] < 0) {
+                order[region] = next++;
+                int64_t desc[2] = {boundary->regions[region].elevation, boundary->regions[region].area};
+                hash = hashBytes(hash, desc, sizeof(desc));
+            }
+            hash = hashBytes(hash, &(order[region]), sizeof(int32_t));
+        }
+    }
+    free(order);
+    *key = hash;
+
+    return 0;
+}
+
+// Look for a rendered tile from an earlier run with the same inputs: the same
+// scratch file, the same halo (which covers every neighboring tile it could
+// have been affected by) and the same water along its edges. On a hit the
+// job's output is pointed at the cached tile and its size and corners are
+// set, and it need not be rendered; otherwise ANAX_ERR_NO_MAP is returned.
+int lookupCachedRender(rendercache_t *cache, anaxjob_t *job, int index, geotiffmap_t *map) {
+    if(!cache->scratch_keys[index])
+        return ANAX_ERR_NO_MAP;
+    uint64_t key = hashBytes(cache->render_seed, &(cache->scratch_keys[index]), sizeof(uint64_t));
+
+    // Only the halo can differ between scratch files with the same key. The
+    // parts not filled in from a neighbor are never written, and are left out.
+    for(int direction = ANAX_MAP_NORTH; direction <= ANAX_MAP_SOUTHEAST; direction++) {
+        int32_t set = *getFrameFlag(&(job->frame_coordinates), direction);
+        key = hashBytes(key, &set, sizeof(int32_t));
+        if(!set)
+            continue;
+        int row, col, nrows, ncols;
+        getHaloRegion(map, direction, &row, &col, &nrows, &ncols);
+        for(int r = row; r < row + nrows; r++)
+            key = hashBytes(key, MAPBUF_ROW(map->elevation, int16_t, r) + col, ncols * sizeof(int16_t));
+    }
+    if(job->water_boundary) {
+        int err = hashWaterBoundary(job->water_boundary, &key);
+        if(err)
+            return err;
+    }
+    cache->render_keys[index] = key;
+
+    cacherecord_t record;
+    int err = loadCacheRecord(cache, key, ".rgba", &record);
+    if(err)
+        return err;
+    char *path = getCachePath(cache, key, ".rgba");
+    if(!path)
+        return ANAX_ERR_NO_MEMORY;
+    if(access(path, R_OK)) {
+        free(path);
+        return ANAX_ERR_NO_MAP;
+    }
+
+    free(job->outfile);
+    job->outfile = path;
+    job->img_height = record.img_height;
+    job->img_width = record.img_width;
+    job->top_lat = record.top_lat;
+    job->bottom_lat = record.bottom_lat;
+    job->right_lon = record.right_lon;
+    job->left_lon = record.left_lon;
+
+    return 0;
+}
+
+int storeCachedRender(rendercache_t *cache, anaxjob_t *job, int index) {
+    if(!cache->render_keys[index])
+        return ANAX_ERR_NO_MAP;
+
+    cacherecord_t record;
+    memset(&record, 0, sizeof(cacherecord_t));
+    record.img_height = job->img_height;
+    record.img_width = job->img_width;
+    record.top_lat = job->top_lat;
+    record.bottom_lat = job->bottom_lat;
+    record.right_lon = job->right_lon;
+    record.left_lon = job->left_lon;
+
+    return storeCacheEntry(cache, cache->render_keys[index], ".rgba", job->outfile, &record);
+}
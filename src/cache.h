@@ -0,0 +1,74 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include "globals.h"
+#include "libanax.h"
+
+#define CACHE_MAGIC                                 0x48434e41  // "ANCH"
+#define CACHE_VERSION                               1
+#define CACHE_CHUNK                                 (1 << 20)
+#define CACHE_HASH_SEED                             0xcbf29ce484222325ULL
+
+// Everything about a cache entry besides its data file. It is written once the
+// data file is in place, so an entry without one is ignored.
+struct cache_record {
+    uint32_t magic;
+    uint32_t version;
+    int32_t img_height;
+    int32_t img_width;
+    int32_t max_elevation;
+    int32_t min_elevation;
+    double top_lat;
+    double bottom_lat;
+    double right_lon;
+    double left_lon;
+    frame_coords_t frame_coordinates;
+};
+typedef struct cache_record cacherecord_t;
+
+// The content hash of a source file, kept until the file changes on disk so
+// that unchanged files are not read again
+struct cache_source {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t hash;
+};
+typedef struct cache_source cachesource_t;
+
+// A directory of scratch files and rendered tiles from earlier runs, named by
+// the hash of everything they were made from. A scratch file is keyed by its
+// source's content and the ingest options; a rendered tile by its scratch
+// file's key, the halo filled in from its neighbors, its share of the water
+// found across tiles and the render options, so a changed tile also misses
+// in every tile whose halo reaches into it.
+struct render_cache {
+    char *dir;
+    int num_jobs;
+    uint64_t scratch_seed;
+    uint64_t render_seed;
+    uint64_t *scratch_keys;     // Indexed by job
+    uint64_t *render_keys;
+};
+typedef struct render_cache rendercache_t;
+
+int initRenderCache(rendercache_t **cache, char *dir, int num_jobs, int projection);
+int setRenderCacheParams(rendercache_t *cache, colorscheme_t *colorscheme, int relief, double azimuth, double altitude, int water_min_area, double scale, int kernel, region_t *region);
+void freeRenderCache(rendercache_t *cache);
+uint64_t hashBytes(uint64_t hash, const void *data, size_t size);
+int hashSourceFile(rendercache_t *cache, char *filename, uint64_t *hash);
+char *getCachePath(rendercache_t *cache, uint64_t key, const char *suffix);
+int copyToFile(int fd, char *dst);
+int storeCacheEntry(rendercache_t *cache, uint64_t key, const char *suffix, char *src, cacherecord_t *record);
+int loadCacheRecord(rendercache_t *cache, uint64_t key, const char *suffix, cacherecord_t *record);
+int lookupCachedScratch(rendercache_t *cache, anaxjob_t *job, int index, int *max_elevation, int *min_elevation);
+int storeCachedScratch(rendercache_t *cache, anaxjob_t *job, int index, geotiffmap_t *map);
+int lookupCachedRender(rendercache_t *cache, anaxjob_t *job, int index, geotiffmap_t *map);
+int storeCachedRender(rendercache_t *cache, anaxjob_t *job, int index);
+
+#endif
@@ -1,17 +1,33 @@
+#include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <curl/curl.h>
 #include "distranax.h"
 #include "globals.h"
 #include "anaxcurses.h"
+#include "water.h"
 
 int reqcount = 0;
 int reccount = 0;
 int gotreqcount = 0;
 
+// Guards the water boundaries of remote jobs, which arrive on share threads
+static pthread_mutex_t water_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set once some tile's boundary cannot be had, here or on another node, so
+// that every node gives up on settling water across tiles
+static int water_failed = 0;
+
+static void failWaterBoundaries(void) {
+    pthread_mutex_lock(&water_lock);
+    water_failed = 1;
+    pthread_mutex_unlock(&water_lock);
+}
+
 /* DEBUGGING FUNCTIONS */
 
 void SHOW_DESTINATION_LIST(destinationlist_t *destinationlist) {
@@ -106,7 +122,7 @@ int connectToRemoteHost(destination_t *dest, char *port) {
 	return 0;
 }
 
-int initRemoteHosts(destinationlist_t *destinationlist, tilelist_t *tilelist, colorscheme_t *colorscheme, double scale, int relief, int projection, uilist_t *uilist) {
+int initRemoteHosts(destinationlist_t *destinationlist, tilelist_t *tilelist, colorscheme_t *colorscheme, double scale, int relief, double azimuth, double altitude, int water_min_area, int projection, int kernel, int decimation, region_t *region, uilist_t *uilist) {
     // Allocate and pack an initialization header
     int packetsize = sizeof(init_hdr_t) + (sizeof(compressed_color_t) * colorscheme->num_stops) + ((colorscheme->showWater) ? sizeof(compressed_color_t) : 0);
     uint8_t *packet = calloc(packetsize, sizeof(uint8_t));
@@ -118,7 +134,19 @@ int initRemoteHosts(destinationlist_t *destinationlist, tilelist_t *tilelist, co
     hdr->num_colors = (uint8_t)(colorscheme->num_stops);
     hdr->scale = scale;
     hdr->relief = relief;
+    hdr->azimuth = azimuth;
+    hdr->altitude = altitude;
+    hdr->water_min_area = (uint32_t)water_min_area;
     hdr->projection = projection;
+    hdr->kernel = (uint8_t)kernel;
+    hdr->decimation = (uint32_t)decimation;
+    if(region) {
+        hdr->has_region = 1;
+        hdr->region_north = region->north;
+        hdr->region_south = region->south;
+        hdr->region_east = region->east;
+        hdr->region_west = region->west;
+    }
     
     // If showWater is set, pack the water color scheme first
     int offset = 0;
@@ -468,6 +496,7 @@ void *runRemoteNode(void *argt) {
                 newtile->img_height = hdr->img_height;
                 newtile->img_width = hdr->img_width;
                 newtile->is_open = 0;
+                newtile->raw = 0;
                 newtile->north = hdr->top;
                 newtile->south = hdr->bottom;
                 newtile->east = hdr->right;
@@ -543,7 +572,7 @@ int initRemoteListener(int *socketfd, char *port) {
     return 0;
 }
 
-int getInitHeaderData(int outsocket, int *whoami, colorscheme_t **colorscheme, double *scale, int *relief, int *projection) {
+int getInitHeaderData(int outsocket, int *whoami, colorscheme_t **colorscheme, double *scale, int *relief, double *azimuth, double *altitude, int *water_min_area, int *projection, int *kernel, int *decimation, region_t **region) {
     int bytes_rcvd = 0;
     uint32_t packet_size;
     
@@ -565,10 +594,27 @@ int getInitHeaderData(int outsocket, int *whoami, colorscheme_t **colorscheme, d
     if(hdr->type == HDR_INITIALIZATION) {
         *scale = hdr->scale;
         *relief = hdr->relief;
+        *azimuth = hdr->azimuth;
+        *altitude = hdr->altitude;
+        *water_min_area = (int)hdr->water_min_area;
         *projection = hdr->projection;
+        *kernel = hdr->kernel;
+        *decimation = (int)hdr->decimation;
         *whoami = (int)hdr->index;
+        *region = NULL;
+        if(hdr->has_region) {
+            *region = malloc(sizeof(region_t));
+            if(!*region)
+                return ANAX_ERR_NO_MEMORY;
+            (*region)->north = hdr->region_north;
+            (*region)->south = hdr->region_south;
+            (*region)->east = hdr->region_east;
+            (*region)->west = hdr->region_west;
+        }
         
-        *colorscheme = malloc(sizeof(colorscheme_t));
+        *colorscheme = calloc(1, sizeof(colorscheme_t));
+        if(!*colorscheme)
+            return ANAX_ERR_NO_MEMORY;
         (*colorscheme)->isAbsolute = (int)(hdr->is_abs);
         (*colorscheme)->showWater = (int)(hdr->show_water);
         (*colorscheme)->num_stops = (int)(hdr->num_colors);
@@ -605,6 +651,9 @@ int getInitHeaderData(int outsocket, int *whoami, colorscheme_t **colorscheme, d
 */
         memcpy(&((*colorscheme)->colors[0]), &((*colorscheme)->colors[1]), sizeof(colorstop_t));
         memcpy(&((*colorscheme)->colors[(*colorscheme)->num_stops + 1]), &((*colorscheme)->colors[(*colorscheme)->num_stops]), sizeof(colorstop_t));
+        int err = compileColorScheme(*colorscheme);
+        if(err)
+            return err;
     }
     
     return 0;
@@ -681,6 +730,7 @@ int getGeoTIFF(int outsocket, joblist_t *localjobs) {
         strncpy(current_job->name, (char *)(buf + sizeof(tiff_hdr_t)), hdr->string_length);
         current_job->index = hdr->index;
         current_job->status = ANAX_STATE_PENDING;
+        current_job->water_boundary = NULL;
         pthread_mutex_init(&(current_job->file_mutex), NULL);
 
         // Get and store what will be the file's local location
@@ -835,186 +885,28 @@ int sendUIUpdate(int outsocket, anaxjob_t *current_job, uint8_t status) {
     return 0;
 }
 
-int queryForMapFrameLocal(anaxjob_t *current_job, joblist_t *localjobs) {
+int queryForMapFrameLocal(anaxjob_t *current_job, tileindex_t *index, int find_water) {
     geotiffmap_t *current_map = NULL;
-    geotiffmap_t *other_map = NULL;
     pthread_mutex_lock(&(current_job->file_mutex));
     readMapData(current_job, &current_map);
+    pthread_mutex_unlock(&(current_job->file_mutex));
     
-    // North
-    if(!current_job->frame_coordinates.N_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.north_lat > localjobs->jobs[i].bottom_lat && 
-               current_job->frame_coordinates.north_lat < localjobs->jobs[i].top_lat &&
-               current_job->frame_coordinates.mid_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.mid_lon < localjobs->jobs[i].right_lon) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = 0; j < MAPFRAME; j++) {
-                    for(int k = MAPFRAME; k < current_map->width + MAPFRAME; k++) {
-                        current_map->data[j][k].elevation = other_map->data[other_map->height + j][k].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.N_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // South
-    if(!current_job->frame_coordinates.S_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.south_lat < localjobs->jobs[i].top_lat &&
-               current_job->frame_coordinates.south_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.mid_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.mid_lon < localjobs->jobs[i].right_lon) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = current_map->height + MAPFRAME; j < current_map->height + (2 * MAPFRAME); j++) {
-                    for(int k = MAPFRAME; k < current_map->width + MAPFRAME; k++) {
-                        current_map->data[j][k].elevation = other_map->data[j - other_map->height][k].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.S_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // East
-    if(!current_job->frame_coordinates.E_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.east_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.east_lon < localjobs->jobs[i].right_lon &&
-               current_job->frame_coordinates.mid_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.mid_lat < localjobs->jobs[i].top_lat) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = MAPFRAME; j < current_map->height + MAPFRAME; j++) {
-                    for(int k = current_map->width + MAPFRAME; k < current_map->width + (2 * MAPFRAME); k++) {
-                        current_map->data[j][k].elevation = other_map->data[j][k - other_map->width].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.E_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // West
-    if(!current_job->frame_coordinates.W_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.west_lon < localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.west_lon > localjobs->jobs[i].right_lon &&
-               current_job->frame_coordinates.mid_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.mid_lat < localjobs->jobs[i].top_lat) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = MAPFRAME; j < current_map->height + MAPFRAME; j++) {
-                    for(int k = 0; k < MAPFRAME; k++) {
-                        current_map->data[j][k].elevation = other_map->data[j][other_map->width + k].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.W_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // Northeast
-    if(!current_job->frame_coordinates.NE_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.east_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.east_lon < localjobs->jobs[i].right_lon &&
-               current_job->frame_coordinates.north_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.north_lat < localjobs->jobs[i].top_lat) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = 0; j < MAPFRAME; j++) {
-                    for(int k = current_map->width + MAPFRAME; k < current_map->width + (2 * MAPFRAME); k++) {
-                        current_map->data[j][k].elevation = other_map->data[other_map->height + j][k - other_map->width].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.NE_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // Southeast
-    if(!current_job->frame_coordinates.SE_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.east_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.east_lon < localjobs->jobs[i].right_lon &&
-               current_job->frame_coordinates.south_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.south_lat < localjobs->jobs[i].top_lat) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = current_map->height + MAPFRAME; j < current_map->height + (2 * MAPFRAME); j++) {
-                    for(int k = current_map->width + MAPFRAME; k < current_map->width + (2 * MAPFRAME); k++) {
-                        current_map->data[j][k].elevation = other_map->data[j - other_map->height][k - other_map->width].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.SE_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // Southwest
-    if(!current_job->frame_coordinates.SW_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.west_lon < localjobs->jobs[i].right_lon &&
-               current_job->frame_coordinates.west_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.south_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.south_lat < localjobs->jobs[i].top_lat) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = current_map->height + MAPFRAME; j < current_map->height + (2 * MAPFRAME); j++) {
-                    for(int k = 0; k < MAPFRAME; k++) {
-                        current_map->data[j][k].elevation = other_map->data[j - other_map->height][other_map->width + k].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.SW_set = 1;
-                break;
-            }
-        }
-    }
-    
-    // Northwest
-    if(!current_job->frame_coordinates.NW_set) {
-        for(int i = 0; i < localjobs->num_jobs; i++) {
-            if(current_job->frame_coordinates.west_lon < localjobs->jobs[i].right_lon &&
-               current_job->frame_coordinates.west_lon > localjobs->jobs[i].left_lon &&
-               current_job->frame_coordinates.north_lat > localjobs->jobs[i].bottom_lat &&
-               current_job->frame_coordinates.north_lat < localjobs->jobs[i].top_lat) {
-                pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                readMapData(&(localjobs->jobs[i]), &other_map);
-                pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
-                for(int j = 0; j < MAPFRAME; j++) {
-                    for(int k = 0; k < MAPFRAME; k++) {
-                        current_map->data[j][k].elevation = other_map->data[other_map->height + j][other_map->width + k].elevation;
-                    }
-                }
-                freeMap(other_map);
-                current_job->frame_coordinates.NW_set = 1;
-                break;
-            }
-        }
+    // Fill each missing halo region from the opposite edge of the local tile
+    // that covers it. The tile's own lock is not held meanwhile, so that two
+    // neighbors filling their halos at once cannot wait on each other.
+    tileindex_entry_t *neighbors[8];
+    findNeighbors(index, current_job, 1, neighbors);
+    for(int direction = ANAX_MAP_NORTH; direction <= ANAX_MAP_SOUTHEAST; direction++) {
+        int *set = getFrameFlag(&(current_job->frame_coordinates), direction);
+        if(*set || !neighbors[direction - 1])
+            continue;
+        anaxjob_t *other_job = neighbors[direction - 1]->job;
+        int row, col, nrows, ncols;
+        getHaloRegion(current_map, direction, &row, &col, &nrows, &ncols);
+        pthread_mutex_lock(&(other_job->file_mutex));
+        readMapEdge(other_job, getOppositeDirection(direction), MAPBUF_ROW(current_map->elevation, int16_t, row) + col, current_map->elevation->stride, nrows, ncols, NULL, NULL);
+        pthread_mutex_unlock(&(other_job->file_mutex));
+        *set = 1;
     }
     
     // Check if map is now complete
@@ -1029,6 +921,12 @@ int queryForMapFrameLocal(anaxjob_t *current_job, joblist_t *localjobs) {
         current_job->status = ANAX_STATE_RENDERING;
     }
     
+    // Describe the flat regions along the tile's edges, so that whether they
+    // are water can be settled together with the neighboring tiles
+    pthread_mutex_lock(&(current_job->file_mutex));
+    if(find_water && !current_job->water_boundary)
+        exportWaterBoundary(current_map, &(current_job->water_boundary));
+    
     // Write the map
     writeMapData(current_job, current_map);
     pthread_mutex_unlock(&(current_job->file_mutex));
@@ -1040,125 +938,17 @@ int queryForMapFrameLocal(anaxjob_t *current_job, joblist_t *localjobs) {
     return 0;
 }
 
-int queryForMapFrame(anaxjob_t *current_job, destinationlist_t *remotenodes) {
-    // North
-    if(!current_job->frame_coordinates.N_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.north_lat > remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.north_lat < remotenodes->destinations[i].jobs[j]->top_lat &&
-                   current_job->frame_coordinates.mid_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.mid_lon < remotenodes->destinations[i].jobs[j]->right_lon) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_SOUTH);
-                    current_job->frame_coordinates.N_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-    
-    // South
-    if(!current_job->frame_coordinates.S_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.south_lat < remotenodes->destinations[i].jobs[j]->top_lat &&
-                   current_job->frame_coordinates.south_lat > remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.mid_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.mid_lon < remotenodes->destinations[i].jobs[j]->right_lon) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_NORTH);
-                    current_job->frame_coordinates.S_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-
-    // East
-    if(!current_job->frame_coordinates.E_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.east_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.east_lon < remotenodes->destinations[i].jobs[j]->right_lon &&
-                   current_job->frame_coordinates.mid_lat > remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.mid_lat < remotenodes->destinations[i].jobs[j]->top_lat) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_WEST);
-                    current_job->frame_coordinates.E_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-    
-    // West
-    if(!current_job->frame_coordinates.W_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.west_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.west_lon < remotenodes->destinations[i].jobs[j]->right_lon &&
-                   current_job->frame_coordinates.mid_lat > remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.mid_lat < remotenodes->destinations[i].jobs[j]->top_lat) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_EAST);
-                    current_job->frame_coordinates.W_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-    
-    // Northeast
-    if(!current_job->frame_coordinates.NE_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.east_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.east_lon < remotenodes->destinations[i].jobs[j]->right_lon &&
-                   current_job->frame_coordinates.north_lat > remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.north_lat < remotenodes->destinations[i].jobs[j]->top_lat) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_SOUTHWEST);
-                    current_job->frame_coordinates.NE_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-
-    // Southeast
-    if(!current_job->frame_coordinates.SE_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.east_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.east_lon < remotenodes->destinations[i].jobs[j]->right_lon &&
-                   current_job->frame_coordinates.south_lat < remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.south_lat > remotenodes->destinations[i].jobs[j]->top_lat) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_NORTHWEST);
-                    current_job->frame_coordinates.SE_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-
-    // Southwest
-    if(!current_job->frame_coordinates.SW_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.west_lon < remotenodes->destinations[i].jobs[j]->right_lon &&
-                   current_job->frame_coordinates.west_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.south_lat < remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.south_lat > remotenodes->destinations[i].jobs[j]->top_lat) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_NORTHEAST);
-                    current_job->frame_coordinates.SW_set = 2; // Requested; do not re-request
-                }
-            }
-        }
-    }
-
-    // Northwest
-    if(!current_job->frame_coordinates.NW_set) {
-        for(int i = 0; i < remotenodes->num_destinations; i++) {
-            for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++) {
-                if(current_job->frame_coordinates.west_lon < remotenodes->destinations[i].jobs[j]->right_lon &&
-                   current_job->frame_coordinates.west_lon > remotenodes->destinations[i].jobs[j]->left_lon &&
-                   current_job->frame_coordinates.north_lat > remotenodes->destinations[i].jobs[j]->bottom_lat &&
-                   current_job->frame_coordinates.north_lat < remotenodes->destinations[i].jobs[j]->top_lat) {
-                    requestMapFrame(current_job, &(remotenodes->destinations[i]), j, ANAX_MAP_SOUTHEAST);
-                    current_job->frame_coordinates.NW_set = 2; // Requested; do not re-request
-                }
-            }
-        }
+int queryForMapFrame(anaxjob_t *current_job, destinationlist_t *remotenodes, tileindex_t *index) {
+    // Request each missing halo region from the remote tile that covers it
+    tileindex_entry_t *neighbors[8];
+    findNeighbors(index, current_job, 0, neighbors);
+    for(int direction = ANAX_MAP_NORTH; direction <= ANAX_MAP_SOUTHEAST; direction++) {
+        int *set = getFrameFlag(&(current_job->frame_coordinates), direction);
+        if(*set || !neighbors[direction - 1])
+            continue;
+        tileindex_entry_t *other = neighbors[direction - 1];
+        requestMapFrame(current_job, &(remotenodes->destinations[other->node]), other->slot, getOppositeDirection(direction));
+        *set = 2; // Requested; do not re-request
     }
     
     return 0;
@@ -1220,6 +1010,143 @@ int sendMinMax(destinationlist_t *remotenodes, int local_min, int local_max, int
     return 0;
 }
 
+int sendWaterBoundary(destinationlist_t *remotenodes, anaxjob_t *current_job, int whoami) {
+    // Pack the boundary after a header. A tile without a boundary (its map
+    // could not be read, or there was no memory to describe it) is announced
+    // as failed all the same, so that no node waits for it.
+    uint8_t *data = NULL;
+    size_t datasize = 0;
+    int err = ANAX_ERR_NO_MAP;
+    if(current_job->water_boundary)
+        err = packWaterBoundary(current_job->water_boundary, &data, &datasize);
+    water_hdr_t failed;
+    uint8_t *packet = NULL;
+    if(!err) {
+        packet = calloc(sizeof(water_hdr_t) + datasize, sizeof(uint8_t));
+        if(!packet)
+            err = ANAX_ERR_NO_MEMORY;
+    }
+    if(err) {
+        free(data);
+        data = NULL;
+        datasize = 0;
+        memset(&failed, 0, sizeof(water_hdr_t));
+        packet = (uint8_t *)&failed;
+        failWaterBoundaries();
+    }
+    uint32_t packetsize = (uint32_t)(sizeof(water_hdr_t) + datasize);
+    water_hdr_t *hdr = (water_hdr_t *)packet;
+    hdr->packet_size = packetsize;
+    hdr->type = HDR_WATER_BOUNDARY;
+    hdr->status = err ? WATER_STATUS_FAILED : WATER_STATUS_OK;
+    hdr->job_id = (uint16_t)(current_job->index);
+    hdr->sender_id = (uint16_t)whoami;
+    if(data) {
+        memcpy(packet + sizeof(water_hdr_t), data, datasize);
+        free(data);
+    }
+    
+    // Send to all nodes. A node this one cannot reach gives up waiting after
+    // WATER_BOUNDARY_TIMEOUT, so this one gives up on the merge too, to come
+    // out the same.
+    for(int i = 0; i < remotenodes->num_destinations; i++) {
+        if(i != whoami) {
+            if(remotenodes->destinations[i].socketfd == -1) {
+                connectToRemoteHost(&(remotenodes->destinations[i]), COMM_PORT);
+            }
+            
+            uint32_t bytes_sent = 0;
+            while(bytes_sent < packetsize) {
+                ssize_t sent = send(remotenodes->destinations[i].socketfd, packet + bytes_sent, packetsize - bytes_sent, 0);
+                if(sent <= 0)
+                    break;
+                bytes_sent += sent;
+            }
+            if(bytes_sent < packetsize) {
+                fprintf(stderr, "Error: Could not send a water boundary to %s\n", remotenodes->destinations[i].addr);
+                failWaterBoundaries();
+                if(!err)
+                    err = ANAX_ERR_COULD_NOT_CONNECT;
+            }
+        }
+    }
+    
+    if(packet != (uint8_t *)&failed)
+        free(packet);
+    
+    return err;
+}
+
+// Settle water across the tiles of all nodes, once every other node's
+// boundaries have arrived. If some boundary cannot be had (a node failed to
+// describe or send one, or none has arrived for WATER_BOUNDARY_TIMEOUT
+// seconds), every boundary is dropped and each tile finds its water from what
+// it sees through its halo, as without a merge.
+int mergeRemoteWaterBoundaries(tileindex_t *index, destinationlist_t *remotenodes, joblist_t *localjobs, int whoami) {
+    int num_jobs = localjobs->num_jobs;
+    for(int i = 0; i < remotenodes->num_destinations; i++) {
+        if(i != whoami)
+            num_jobs += remotenodes->destinations[i].num_jobs;
+    }
+    anaxjob_t **jobs = malloc((num_jobs > 0 ? num_jobs : 1) * sizeof(anaxjob_t *));
+    if(!jobs)
+        return ANAX_ERR_NO_MEMORY;
+    int n = 0;
+    for(int i = 0; i < localjobs->num_jobs; i++)
+        jobs[n++] = &(localjobs->jobs[i]);
+    for(int i = 0; i < remotenodes->num_destinations; i++) {
+        if(i == whoami)
+            continue;
+        for(int j = 0; j < remotenodes->destinations[i].num_jobs; j++)
+            jobs[n++] = remotenodes->destinations[i].jobs[j];
+    }
+    
+    // Wait for the boundaries of every tile on every other node
+    int err = 0;
+    int last_received = -1;
+    time_t last_progress = time(NULL);
+    while(1) {
+        int received = 0;
+        pthread_mutex_lock(&water_lock);
+        for(int i = localjobs->num_jobs; i < num_jobs; i++) {
+            if(jobs[i]->water_boundary)
+                received++;
+        }
+        int failed = water_failed;
+        pthread_mutex_unlock(&water_lock);
+        if(failed) {
+            err = ANAX_ERR_NO_MAP;
+            break;
+        }
+        if(received == num_jobs - localjobs->num_jobs)
+            break;
+        if(received != last_received) {
+            last_received = received;
+            last_progress = time(NULL);
+        } else if(time(NULL) - last_progress > WATER_BOUNDARY_TIMEOUT) {
+            err = ANAX_ERR_NO_MAP;
+            break;
+        }
+        sleep(1);
+    }
+    
+    // Merge over all tiles, so that every node reaches the same result
+    if(!err)
+        err = mergeWaterBoundaries(index, jobs, num_jobs);
+    
+    // Only the local tiles' boundaries are needed from here on, and none of
+    // them if the merge could not be done
+    pthread_mutex_lock(&water_lock);
+    for(int i = err ? 0 : localjobs->num_jobs; i < num_jobs; i++) {
+        freeWaterBoundary(jobs[i]->water_boundary);
+        jobs[i]->water_boundary = NULL;
+    }
+    pthread_mutex_unlock(&water_lock);
+    free(jobs);
+    
+    return err;
+}
+
 void *spawnShareThread(void *argt) {
     int sharesocketfd, shareoutsocketfd;
     initRemoteListener(&sharesocketfd, COMM_PORT);
@@ -1239,6 +1166,7 @@ void *handleSharing(void *argt) {
     // Unpack thread argument struct
     destinationlist_t *remotenodes = ((threadshare_t *)argt)->remotenodes;
     joblist_t *localjobs = ((threadshare_t *)argt)->localjobs;
+    tileindex_t *tileindex = ((threadshare_t *)argt)->tileindex;
     int *global_max = ((threadshare_t *)argt)->global_max;
     int *global_min = ((threadshare_t *)argt)->global_min;
     //int whoami = ((threadshare_t *)argt)->whoami;
@@ -1270,11 +1198,13 @@ void *handleSharing(void *argt) {
                 status_change_hdr_t *hdr = (status_change_hdr_t *)buf;
                 if(hdr->job_id != (uint16_t)-1) {
                     int job_id = getJobIndex(&(remotenodes->destinations[hdr->sender_id]), hdr->job_id);
+                    int new_job = 0;
                     if(job_id == -1) {
                         remotenodes->destinations[hdr->sender_id].num_jobs++;
                         remotenodes->destinations[hdr->sender_id].jobs = realloc(remotenodes->destinations[hdr->sender_id].jobs, remotenodes->destinations[hdr->sender_id].num_jobs * sizeof(anaxjob_t *));
                         job_id = remotenodes->destinations[hdr->sender_id].num_jobs - 1;
-                        remotenodes->destinations[hdr->sender_id].jobs[job_id] = malloc(sizeof(anaxjob_t));
+                        remotenodes->destinations[hdr->sender_id].jobs[job_id] = calloc(1, sizeof(anaxjob_t));
+                        new_job = 1;
                     }
                     remotenodes->destinations[hdr->sender_id].jobs[job_id]->index = hdr->job_id;
                     remotenodes->destinations[hdr->sender_id].jobs[job_id]->status = hdr->status;
@@ -1282,6 +1212,10 @@ void *handleSharing(void *argt) {
                     remotenodes->destinations[hdr->sender_id].jobs[job_id]->bottom_lat = hdr->bottom;
                     remotenodes->destinations[hdr->sender_id].jobs[job_id]->left_lon = hdr->left;
                     remotenodes->destinations[hdr->sender_id].jobs[job_id]->right_lon = hdr->right;
+                    
+                    // Make the tile visible to halo resolution the first time it is seen
+                    if(new_job)
+                        insertTileIndex(tileindex, remotenodes->destinations[hdr->sender_id].jobs[job_id], hdr->sender_id, job_id);
                 } else {
                     // Global status change (apply to whole node, not just one job)
                     remotenodes->destinations[hdr->sender_id].status = hdr->status;
@@ -1294,114 +1228,41 @@ void *handleSharing(void *argt) {
                 
                 printf("*** Got Req: %i\n", ++gotreqcount);
                 
-                // Load requested map from memory
-                geotiffmap_t *map;
+                // Read just the requested edge from the map's scratch file
+                int nrows = 0;
+                int ncols = 0;
+                int16_t *databuf = NULL;
+                int status = EDGE_STATUS_FAILED;
                 for(int i = 0; i < localjobs->num_jobs; i++) {
                     if(localjobs->jobs[i].index == hdr->requested_job_id) {
                         pthread_mutex_lock(&(localjobs->jobs[i].file_mutex));
-                        readMapData(&(localjobs->jobs[i]), &map);
+                        readMapEdge(&(localjobs->jobs[i]), hdr->part, NULL, 0, INT_MAX, INT_MAX, &nrows, &ncols);
+                        if(nrows > 0 && ncols > 0)
+                            databuf = calloc(nrows * ncols, sizeof(int16_t));
+                        if(databuf && !readMapEdge(&(localjobs->jobs[i]), hdr->part, databuf, ncols, nrows, ncols, NULL, NULL))
+                            status = EDGE_STATUS_OK;
                         pthread_mutex_unlock(&(localjobs->jobs[i].file_mutex));
                         break;
                     }
                 }
                 
-                // Identify and pack the desired data
-                int nrows, ncols;
-                int16_t *databuf;
-                int pos = 0;
-                switch(hdr->part) {
-                    case ANAX_MAP_NORTH:
-                        nrows = MAPFRAME;
-                        ncols = map->width;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = MAPFRAME; i < MAPFRAME + nrows; i++) {
-                            for(int j = MAPFRAME; j < ncols + MAPFRAME; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_SOUTH:
-                        nrows = MAPFRAME;
-                        ncols = map->width;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = map->height; i < map->height + nrows; i++) {
-                            for(int j = MAPFRAME; j < ncols + MAPFRAME; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_EAST:
-                        nrows = map->height;
-                        ncols = MAPFRAME;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = MAPFRAME; i < MAPFRAME + nrows; i++) {
-                            for(int j = map->width; j < map->width + ncols; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_WEST:
-                        nrows = map->height;
-                        ncols = MAPFRAME;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = MAPFRAME; i < MAPFRAME + nrows; i++) {
-                            for(int j = MAPFRAME; j < MAPFRAME + ncols; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_NORTHEAST:
-                        nrows = MAPFRAME;
-                        ncols = MAPFRAME;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = MAPFRAME; i < MAPFRAME + nrows; i++) {
-                            for(int j = map->width; j < map->width + ncols; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_SOUTHEAST:
-                        nrows = MAPFRAME;
-                        ncols = MAPFRAME;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = map->height; i < map->height + nrows; i++) {
-                            for(int j = map->width; j < map->width + ncols; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_SOUTHWEST:
-                        nrows = MAPFRAME;
-                        ncols = MAPFRAME;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = map->height; i < map->height + nrows; i++) {
-                            for(int j = MAPFRAME; j < MAPFRAME + ncols; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
-                    case ANAX_MAP_NORTHWEST:
-                        nrows = MAPFRAME;
-                        ncols = MAPFRAME;
-                        databuf = calloc(nrows * ncols, sizeof(int16_t));
-                        for(int i = MAPFRAME; i < MAPFRAME + nrows; i++) {
-                            for(int j = MAPFRAME; j < MAPFRAME + ncols; j++) {
-                                databuf[pos] = map->data[i][j].elevation;
-                                pos++;
-                            }
-                        }
-                        break;
+                // Anything short of the whole edge is answered with a failure,
+                // so the requester stops waiting for it
+                if(status != EDGE_STATUS_OK) {
+                    fprintf(stderr, "Error: Could not read edge %i of job %i for job %i\n", hdr->part, hdr->requested_job_id, hdr->requesting_job_id);
+                    free(databuf);
+                    databuf = NULL;
+                    nrows = 0;
+                    ncols = 0;
                 }
                 
                 // Allocate a response header
                 send_edge_hdr_t *outhdr = malloc(sizeof(send_edge_hdr_t));
+                if(!outhdr) {
+                    fprintf(stderr, "Error: Could not answer the request for edge %i of job %i\n", hdr->part, hdr->requested_job_id);
+                    free(databuf);
+                    break;
+                }
                 
                 // Pack the response header
                 outhdr->packet_size = (uint32_t)sizeof(send_edge_hdr_t);
@@ -1410,6 +1271,8 @@ void *handleSharing(void *argt) {
                 outhdr->requesting_job_id = hdr->requesting_job_id;
                 outhdr->requested_job_id = hdr->requested_job_id;
                 outhdr->datasize = (uint32_t)(nrows * ncols);
+                outhdr->status = status;
+                outhdr->fill = 0;
 
                 // Identify the sender
                 int sender = -1;
@@ -1434,7 +1297,6 @@ void *handleSharing(void *argt) {
                 pthread_t framethread;
                 pthread_create(&framethread, NULL, sendMapFrame, argt);
                 
-                freeMap(map);
                 break;
 
 /*
@@ -1485,6 +1347,20 @@ void *handleSharing(void *argt) {
                     if(localjobs->jobs[i].index == hdr->requesting_job_id)
                         current_job = &(localjobs->jobs[i]);
                 }
+                
+                // An edge the neighbor could not read is given up on; the
+                // halo keeps its own fill, as at the edge of the data
+                if(hdr->status != EDGE_STATUS_OK) {
+                    fprintf(stderr, "Error: No edge %i from job %i for job %i\n", hdr->part, hdr->requested_job_id, hdr->requesting_job_id);
+                    pthread_mutex_lock(&(current_job->file_mutex));
+                    int *set = getFrameFlag(&(current_job->frame_coordinates), getOppositeDirection(hdr->part));
+                    if(set && *set == 2)
+                        *set = 1;
+                    pthread_mutex_unlock(&(current_job->file_mutex));
+                    free(databuf);
+                    break;
+                }
+                
                 pthread_mutex_lock(&(current_job->file_mutex));
                 while(readMapData(current_job, &map) == ANAX_ERR_NO_MEMORY) {
                     printf("Memory allocation failure\n");
@@ -1501,7 +1377,7 @@ void *handleSharing(void *argt) {
                             // North side of original map -> add to south of current map
                             for(int i = MAPFRAME + map->height; i < (2 * MAPFRAME) + map->height; i++) {
                                 for(int j = MAPFRAME; j < MAPFRAME + map->width; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1513,7 +1389,7 @@ void *handleSharing(void *argt) {
                             // South side of original map -> add to north of current map
                             for(int i = 0; i < MAPFRAME; i++) {
                                 for(int j = MAPFRAME; j < MAPFRAME + map->width; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1525,7 +1401,7 @@ void *handleSharing(void *argt) {
                             // East side of original map -> add to west of current map
                             for(int i = MAPFRAME; i < MAPFRAME + map->height; i++) {
                                 for(int j = 0; j < MAPFRAME; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1537,7 +1413,7 @@ void *handleSharing(void *argt) {
                             // West side of original map -> add to east of current map
                             for(int i = MAPFRAME; i < MAPFRAME + map->height; i++) {
                                 for(int j = MAPFRAME + map->width; j < (2 * MAPFRAME) + map->width; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1549,7 +1425,7 @@ void *handleSharing(void *argt) {
                             // Northeast side of original map -> add to southwest of current map
                             for(int i = MAPFRAME + map->height; i < (2 * MAPFRAME) + map->height; i++) {
                                 for(int j = 0; j < MAPFRAME; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1561,7 +1437,7 @@ void *handleSharing(void *argt) {
                             // Southeast side of original map -> add to northwest of current map
                             for(int i = 0; i < MAPFRAME; i++) {
                                 for(int j = 0; j < MAPFRAME; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1573,7 +1449,7 @@ void *handleSharing(void *argt) {
                             // Southwest side of original map -> add to northeast of current map
                             for(int i = 0; i < MAPFRAME; i++) {
                                 for(int j = MAPFRAME + map->width; j < (2 * MAPFRAME) + map->width; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1585,7 +1461,7 @@ void *handleSharing(void *argt) {
                             // Northwest side of original map -> add to southeast of current map
                             for(int i = MAPFRAME + map->height; i < (2 * MAPFRAME) + map->height; i++) {
                                 for(int j = MAPFRAME + map->width; j < (2 * MAPFRAME) + map->width; j++) {
-                                    map->data[i][j].elevation = databuf[pos++];
+                                    MAPBUF_ROW(map->elevation, int16_t, i)[j] = databuf[pos++];
                                 }
                             }
                             // Set flags
@@ -1616,6 +1492,33 @@ void *handleSharing(void *argt) {
                 }
                 break;
             }
+            case HDR_WATER_BOUNDARY:
+            {
+                // A boundary that cannot be placed or read means water cannot
+                // be settled across tiles, rather than that it is still coming
+                water_hdr_t *hdr = (water_hdr_t *)buf;
+                if(hdr->status != WATER_STATUS_OK) {
+                    printf("No water boundary for job %i\n", hdr->job_id);
+                    failWaterBoundaries();
+                    break;
+                }
+                int job_id = getJobIndex(&(remotenodes->destinations[hdr->sender_id]), hdr->job_id);
+                if(job_id == -1) {
+                    printf("Water boundary for unknown job %i\n", hdr->job_id);
+                    failWaterBoundaries();
+                    break;
+                }
+                waterboundary_t *boundary;
+                if(unpackWaterBoundary(buf + sizeof(water_hdr_t), packet_size - sizeof(water_hdr_t), &boundary) != 0) {
+                    printf("Unreadable water boundary for job %i\n", hdr->job_id);
+                    failWaterBoundaries();
+                    break;
+                }
+                pthread_mutex_lock(&water_lock);
+                remotenodes->destinations[hdr->sender_id].jobs[job_id]->water_boundary = boundary;
+                pthread_mutex_unlock(&water_lock);
+                break;
+            }
             case HDR_SEND_MIN_MAX:
             {
                 min_max_hdr_t *hdr = (min_max_hdr_t *)buf;
@@ -11,6 +11,7 @@
 #include "globals.h"
 #include "libanax.h"
 #include "anaxcurses.h"
+#include "tileindex.h"
 
 #define HDR_INITIALIZATION      0x01
 #define HDR_NODES               0x02
@@ -22,6 +23,7 @@
 #define HDR_PNG                 0x08
 #define HDR_END                 0x09
 #define HDR_UI_UPDATE           0x10
+#define HDR_WATER_BOUNDARY      0x11
 
 #define PACKET_HAS_DATA         0x01
 #define PACKET_HAS_URL          0x02
@@ -30,6 +32,14 @@
 #define ROLE_SENDER             1
 #define ROLE_RECEIVER           2
 
+#define EDGE_STATUS_OK          0
+#define EDGE_STATUS_FAILED      1   // The sender could not read the edge
+
+#define WATER_STATUS_OK         0
+#define WATER_STATUS_FAILED     1   // The sender has no boundary to share
+
+#define WATER_BOUNDARY_TIMEOUT  600 // Seconds without a new boundary before giving up
+
 
 
 /////
@@ -45,8 +55,17 @@ struct header_initialization {
     uint8_t index;
     uint8_t relief;
     uint8_t projection;
-    uint8_t fill[5];
+    uint8_t kernel;
+    uint32_t water_min_area;
+    uint32_t decimation;
+    uint32_t has_region;
     double scale;
+    double azimuth;
+    double altitude;
+    double region_north;    // Region of interest, if has_region is set
+    double region_south;
+    double region_east;
+    double region_west;
     // Followed by an array of compressed_color_t
 };
 typedef struct header_initialization init_hdr_t;
@@ -122,8 +141,9 @@ struct header_send_edge {
     uint16_t requesting_job_id;
     uint16_t requested_job_id;
     uint32_t datasize;
-    uint8_t fill[2];
-    // Followed by data array
+    uint8_t status; // EDGE_STATUS_*
+    uint8_t fill;
+    // Followed by data array, unless the status is EDGE_STATUS_FAILED
 };
 typedef struct header_send_edge send_edge_hdr_t;
 
@@ -151,6 +171,19 @@ struct header_png {
 };
 typedef struct header_png png_hdr_t;
 
+struct header_water_boundary {
+    uint32_t packet_size;
+    uint8_t type; // HDR_WATER_BOUNDARY
+    uint8_t status; // WATER_STATUS_*
+    uint16_t job_id;
+    uint16_t sender_id;
+    uint8_t fill2[6];
+    // Followed by a packed water boundary (see water.h), unless the status is
+    // WATER_STATUS_FAILED
+
+};
+typedef struct header_water_boundary water_hdr_t;
+
 struct header_end {
     uint32_t packet_size;
     uint8_t type; // HDR_END
@@ -177,6 +210,7 @@ typedef struct thread_arguments threadarg_t;
 struct share_arguments {
     destinationlist_t *remotenodes;
     joblist_t *localjobs;
+    tileindex_t *tileindex;
     int *global_max;
     int *global_min;
     int whoami;
@@ -209,22 +243,24 @@ typedef struct png_thread_arguments png_threadarg_t;
 void *get_in_addr(struct sockaddr *sa);
 int loadDestinationList(char *destfile, destinationlist_t **destinations);
 int connectToRemoteHost(destination_t *dest, char *port);
-int initRemoteHosts(destinationlist_t *destinationlist, tilelist_t *tilelist, colorscheme_t *colorscheme, double scale, int relief, int projection, uilist_t *uilist);
+int initRemoteHosts(destinationlist_t *destinationlist, tilelist_t *tilelist, colorscheme_t *colorscheme, double scale, int relief, double azimuth, double altitude, int water_min_area, int projection, int kernel, int decimation, region_t *region, uilist_t *uilist);
 int distributeJobs(destinationlist_t *destinationlist, joblist_t *joblist);
 void *runRemoteNode(void *argt);
 void *runRemoteJob(void *argt);
 int initRemoteListener(int *socketfd, char *port);
-int getInitHeaderData(int outsocket, int *whoami, colorscheme_t **colorscheme, double *scale, int *relief, int *projection);
+int getInitHeaderData(int outsocket, int *whoami, colorscheme_t **colorscheme, double *scale, int *relief, double *azimuth, double *altitude, int *water_min_area, int *projection, int *kernel, int *decimation, region_t **region);
 int getNodesHeaderData(int outsocket, destinationlist_t **remotenodes);
 int getGeoTIFF(int outsocket, joblist_t *localjobs);
 int getImageFromPrimary(int outsocket, char *filename, char *outfile, uint32_t filesize);
 int downloadImage(char *filename, char *outfile);
 int sendStatusUpdate(int outsocket, destinationlist_t *remotenodes, anaxjob_t *current_job, int whoami);
 int sendUIUpdate(int outsocket, anaxjob_t *current_job, uint8_t status);
-int queryForMapFrameLocal(anaxjob_t *current_job, joblist_t *localjobs);
-int queryForMapFrame(anaxjob_t *current_job, destinationlist_t *remotenodes);
+int queryForMapFrameLocal(anaxjob_t *current_job, tileindex_t *index, int find_water);
+int queryForMapFrame(anaxjob_t *current_job, destinationlist_t *remotenodes, tileindex_t *index);
 int requestMapFrame(anaxjob_t *current_job, destination_t *remote, int index, int request);
 int sendMinMax(destinationlist_t *remotenodes, int local_min, int local_max, int whoami);
+int sendWaterBoundary(destinationlist_t *remotenodes, anaxjob_t *current_job, int whoami);
+int mergeRemoteWaterBoundaries(tileindex_t *index, destinationlist_t *remotenodes, joblist_t *localjobs, int whoami);
 void *spawnShareThread(void *argt);
 void *handleSharing(void *argt);
 void *sendMapFrame(void *argt);
@@ -13,6 +13,7 @@
 #define ANAX_ERR_COULD_NOT_CONNECT					-8
 #define ANAX_ERR_NO_MAP                             -9
 #define ANAX_ERR_INVALID_HEADER                     -10
+#define ANAX_ERR_COULD_NOT_WRITE                    -11
 
 #define ANAX_RELATIVE_COLORS						0
 #define ANAX_ABSOLUTE_COLORS						1
@@ -89,6 +90,7 @@ struct anaxjob {
 	int img_height;
 	int img_width;
 	frame_coords_t frame_coordinates;
+	struct water_boundary *water_boundary;
 };
 typedef struct anaxjob anaxjob_t;
 
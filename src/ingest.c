@@ -0,0 +1,1523 @@
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <xtiffio.h>
+#include "globals.h"
+#include "distranax.h"
+#include "ingest.h"
+#include "water.h"
+
+// Number of decoder threads per raster (0 means one per online core)
+static int ingest_threads = 0;
+
+// Full-resolution pixels per map pixel when reading rasters (1 reads them as
+// they are)
+static int ingest_decimation = 1;
+
+// Region of interest to read, in degrees (see windowIngestPlan)
+static region_t ingest_region;
+static int ingest_region_set = 0;
+
+// Upper bound on the raster memory held by concurrent tile ingests (0 means
+// half of physical memory)
+static size_t ingest_memory_budget = 0;
+
+// Cache of scratch files from earlier runs (NULL for none)
+static rendercache_t *ingest_cache = NULL;
+
+// The GDAL metadata tag is not one libtiff knows, so it is registered through
+// a tag extender for every file opened after registerIngestTags
+static const TIFFFieldInfo ingest_field_info[] = {
+    {INGEST_TAG_GDAL_METADATA, TIFF_VARIABLE, TIFF_VARIABLE, TIFF_ASCII, FIELD_CUSTOM, 1, 0, "GDALMetadata"},
+};
+static TIFFExtendProc ingest_parent_extender = NULL;
+static pthread_once_t ingest_tags_once = PTHREAD_ONCE_INIT;
+
+void setIngestThreads(int num_threads) {
+    ingest_threads = (num_threads < 0) ? 0 : num_threads;
+}
+
+int getIngestThreads(void) {
+    if(ingest_threads > 0)
+        return ingest_threads;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return (cores > 0) ? (int)cores : 1;
+}
+
+void setIngestMemoryBudget(size_t bytes) {
+    ingest_memory_budget = bytes;
+}
+
+size_t getIngestMemoryBudget(void) {
+    if(ingest_memory_budget > 0)
+        return ingest_memory_budget;
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pagesize = sysconf(_SC_PAGESIZE);
+    if(pages <= 0 || pagesize <= 0)
+        return SIZE_MAX;
+    return ((size_t)pages * (size_t)pagesize) / 2;
+}
+
+void setIngestDecimation(int factor) {
+    ingest_decimation = (factor < 1) ? 1 : factor;
+}
+
+int getIngestDecimation(void) {
+    return ingest_decimation;
+}
+
+void setIngestRegion(region_t *region) {
+    ingest_region_set = (region != NULL);
+    if(region)
+        ingest_region = *region;
+}
+
+region_t *getIngestRegion(void) {
+    return ingest_region_set ? &ingest_region : NULL;
+}
+
+void setIngestCache(rendercache_t *cache) {
+    ingest_cache = cache;
+}
+
+rendercache_t *getIngestCache(void) {
+    return ingest_cache;
+}
+
+static void extendIngestTags(TIFF *tiff) {
+    TIFFMergeFieldInfo(tiff, ingest_field_info, sizeof(ingest_field_info) / sizeof(ingest_field_info[0]));
+    if(ingest_parent_extender)
+        ingest_parent_extender(tiff);
+}
+
+static void registerIngestTags(void) {
+    ingest_parent_extender = TIFFSetTagExtender(extendIngestTags);
+}
+
+// Decide how to read a raster at the current decimation factor. The largest
+// internal overview (a reduced-resolution directory) whose reduction divides
+// the factor is read in place of the full image, and the rest of the way is
+// covered by reduceElevationBlock. The factor is lowered if needed to keep the
+// map at least MAPFRAME pixels across, since its edges fill its neighbors'
+// halos.
+int planIngest(TIFF *tiff, ingestplan_t *plan) {
+    uint32_t width, height;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    tdir_t base = TIFFCurrentDirectory(tiff);
+
+    // Find the overviews
+    int num_overviews = 0;
+    int reductions[INGEST_MAX_OVERVIEWS];
+    tdir_t directories[INGEST_MAX_OVERVIEWS];
+    uint32_t widths[INGEST_MAX_OVERVIEWS];
+    uint32_t heights[INGEST_MAX_OVERVIEWS];
+    if(getIngestDecimation() > 1) {
+        tdir_t num_directories = TIFFNumberOfDirectories(tiff);
+        for(tdir_t d = 0; d < num_directories && num_overviews < INGEST_MAX_OVERVIEWS; d++) {
+            uint32_t subfile = 0;
+            uint32_t ow = 0;
+            uint32_t oh = 0;
+            if(d == base || !TIFFSetDirectory(tiff, d))
+                continue;
+            TIFFGetFieldDefaulted(tiff, TIFFTAG_SUBFILETYPE, &subfile);
+            TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &ow);
+            TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &oh);
+            if(!(subfile & FILETYPE_REDUCEDIMAGE) || ow == 0 || oh == 0)
+                continue;
+
+            // Only overviews that reduce both axes by the same whole factor
+            // line up with the full image
+            int reduction = (int)((width + (ow / 2)) / ow);
+            if(reduction < 2 || (width + reduction - 1) / reduction != ow || (height + reduction - 1) / reduction != oh)
+                continue;
+            reductions[num_overviews] = reduction;
+            directories[num_overviews] = d;
+            widths[num_overviews] = ow;
+            heights[num_overviews] = oh;
+            num_overviews++;
+        }
+        if(!TIFFSetDirectory(tiff, base))
+            return ANAX_ERR_TIFF_SCANLINE;
+    }
+
+    for(int factor = getIngestDecimation(); factor >= 1; factor--) {
+        plan->factor = factor;
+        plan->overview = 1;
+        plan->directory = base;
+        plan->src_width = width;
+        plan->src_height = height;
+        for(int i = 0; i < num_overviews; i++) {
+            if(reductions[i] > plan->overview && factor % reductions[i] == 0) {
+                plan->overview = reductions[i];
+                plan->directory = directories[i];
+                plan->src_width = widths[i];
+                plan->src_height = heights[i];
+            }
+        }
+        plan->step = factor / plan->overview;
+        plan->width = ((plan->src_width - 1) / plan->step) + 1;
+        plan->height = ((plan->src_height - 1) / plan->step) + 1;
+        plan->row0 = 0;
+        plan->col0 = 0;
+
+        // An overview pixel covers a block of the full image, so its center
+        // lies between full-resolution pixel centers
+        plan->offset = (plan->overview - 1) / 2.0;
+
+        if(plan->width >= MAPFRAME && plan->height >= MAPFRAME)
+            break;
+    }
+
+    return 0;
+}
+
+// Narrow a plan to the map pixels inside the region of interest, plus a
+// MAPFRAME margin around them so that relief shading and water are the same
+// at the region's edges as anywhere else. gt is the georeferencing of the
+// whole plan, and is moved to the first pixel of the window. The window is
+// kept at least MAPFRAME pixels across, since its edges fill its neighbors'
+// halos.
+void windowIngestPlan(ingestplan_t *plan, geotransform_t *gt) {
+    region_t *region = getIngestRegion();
+    if(!region)
+        return;
+
+    int top = (int)ceil(gtLatitudeToRow(gt, region->north) - 1e-6) - MAPFRAME;
+    int bottom = (int)floor(gtLatitudeToRow(gt, region->south) + 1e-6) + MAPFRAME;
+    int left = (int)ceil(gtLongitudeToCol(gt, region->west) - 1e-6) - MAPFRAME;
+    int right = (int)floor(gtLongitudeToCol(gt, region->east) + 1e-6) + MAPFRAME;
+    top = (top < 0) ? 0 : top;
+    left = (left < 0) ? 0 : left;
+    bottom = (bottom > plan->height - 1) ? plan->height - 1 : bottom;
+    right = (right > plan->width - 1) ? plan->width - 1 : right;
+    if(bottom < top || right < left)
+        return;
+    if(bottom - top + 1 < MAPFRAME) {
+        bottom = (top + MAPFRAME - 1 < plan->height) ? top + MAPFRAME - 1 : plan->height - 1;
+        top = (bottom - MAPFRAME + 1 > 0) ? bottom - MAPFRAME + 1 : 0;
+    }
+    if(right - left + 1 < MAPFRAME) {
+        right = (left + MAPFRAME - 1 < plan->width) ? left + MAPFRAME - 1 : plan->width - 1;
+        left = (right - MAPFRAME + 1 > 0) ? right - MAPFRAME + 1 : 0;
+    }
+
+    plan->row0 = top;
+    plan->col0 = left;
+    plan->height = bottom - top + 1;
+    plan->width = right - left + 1;
+    gt->origin_x += left * gt->step_x;
+    gt->origin_y += top * gt->step_y;
+}
+
+// Copy one row of elevations while folding it into a running min/max
+void copyElevationRow(int16_t *dst, const int16_t *src, int n, int16_t *min, int16_t *max) {
+    int c = 0;
+#ifdef __SSE2__
+    if(n >= 8) {
+        __m128i vmin = _mm_set1_epi16(*min);
+        __m128i vmax = _mm_set1_epi16(*max);
+        for(; c + 8 <= n; c += 8) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + c));
+            _mm_storeu_si128((__m128i *)(dst + c), v);
+            vmin = _mm_min_epi16(vmin, v);
+            vmax = _mm_max_epi16(vmax, v);
+        }
+        int16_t lanes_min[8];
+        int16_t lanes_max[8];
+        _mm_storeu_si128((__m128i *)lanes_min, vmin);
+        _mm_storeu_si128((__m128i *)lanes_max, vmax);
+        for(int i = 0; i < 8; i++) {
+            if(lanes_min[i] < *min)
+                *min = lanes_min[i];
+            if(lanes_max[i] > *max)
+                *max = lanes_max[i];
+        }
+    }
+#endif
+    for(; c < n; c++) {
+        dst[c] = src[c];
+        if(src[c] < *min)
+            *min = src[c];
+        if(src[c] > *max)
+            *max = src[c];
+    }
+}
+
+// Find the map pixels whose boxes take in source pixel x. Every step-th
+// source pixel is the center of a box step pixels wide; when step is even the
+// pixels on the edges of a box are shared with the next box at half weight.
+static int getReductionTaps(int x, int step, int size, int *index, float *weight) {
+    int half = step / 2;
+    int i = (x + half) / step;
+    int n = 0;
+    if((step % 2) == 0 && x - (i * step) == -half) {
+        if(i > 0) {
+            index[n] = i - 1;
+            weight[n++] = 0.5f;
+        }
+        if(i < size) {
+            index[n] = i;
+            weight[n++] = 0.5f;
+        }
+    } else if(i < size) {
+        index[n] = i;
+        weight[n++] = 1.0f;
+    }
+    return n;
+}
+
+// Add a block of source pixels into the box sums of the map pixels they fall
+// in. The block is summed privately and then added in under the lock, so
+// blocks decoded by different threads may share map pixels. Pixels with no
+// data (-9999) are left out.
+void reduceElevationBlock(ingest_t *state, const int16_t *src, size_t stride, int row0, int col0, int rows, int cols) {
+    geotiffmap_t *map = state->map;
+    int step = state->step;
+    int index[2];
+    float weight[2];
+
+    // Map pixels the block touches (source pixels past the last box, which
+    // only the next tile's map takes in, touch none)
+    int half = step / 2;
+    int first_row = (row0 <= half) ? 0 : (row0 - half + step - 1) / step;
+    int last_row = (row0 + rows - 1 + half) / step;
+    int first_col = (col0 <= half) ? 0 : (col0 - half + step - 1) / step;
+    int last_col = (col0 + cols - 1 + half) / step;
+    if(last_row >= map->height)
+        last_row = map->height - 1;
+    if(last_col >= map->width)
+        last_col = map->width - 1;
+    if(first_row > last_row || first_col > last_col)
+        return;
+    int prows = last_row - first_row + 1;
+    int pcols = last_col - first_col + 1;
+
+    float *psum = calloc((size_t)2 * prows * pcols, sizeof(float));
+    int *col_index = malloc((size_t)2 * cols * sizeof(int));
+    float *col_weight = malloc((size_t)2 * cols * sizeof(float));
+    int *col_taps = malloc((size_t)cols * sizeof(int));
+    if(!psum || !col_index || !col_weight || !col_taps) {
+        free(psum);
+        free(col_index);
+        free(col_weight);
+        free(col_taps);
+        pthread_mutex_lock(&(state->lock));
+        state->err = ANAX_ERR_NO_MEMORY;
+        pthread_mutex_unlock(&(state->lock));
+        return;
+    }
+    float *pweight = psum + ((size_t)prows * pcols);
+    for(int c = 0; c < cols; c++) {
+        col_taps[c] = getReductionTaps(col0 + c, step, map->width, col_index + (2 * c), col_weight + (2 * c));
+        for(int t = 0; t < col_taps[c]; t++)
+            col_index[(2 * c) + t] -= first_col;
+    }
+
+    for(int r = 0; r < rows; r++) {
+        int n = getReductionTaps(row0 + r, step, map->height, index, weight);
+        const int16_t *row = src + ((size_t)r * stride);
+        for(int t = 0; t < n; t++) {
+            float *sum = psum + ((size_t)(index[t] - first_row) * pcols);
+            float *total = pweight + ((size_t)(index[t] - first_row) * pcols);
+            for(int c = 0; c < cols; c++) {
+                if(row[c] == -9999)
+                    continue;
+                for(int u = 0; u < col_taps[c]; u++) {
+                    float w = weight[t] * col_weight[(2 * c) + u];
+                    sum[col_index[(2 * c) + u]] += w * row[c];
+                    total[col_index[(2 * c) + u]] += w;
+                }
+            }
+        }
+    }
+
+    pthread_mutex_lock(&(state->lock));
+    for(int r = 0; r < prows; r++) {
+        float *sum = state->sum + ((size_t)(first_row + r) * map->width) + first_col;
+        float *total = state->weight + ((size_t)(first_row + r) * map->width) + first_col;
+        for(int c = 0; c < pcols; c++) {
+            sum[c] += psum[((size_t)r * pcols) + c];
+            total[c] += pweight[((size_t)r * pcols) + c];
+        }
+    }
+    pthread_mutex_unlock(&(state->lock));
+
+    free(psum);
+    free(col_index);
+    free(col_weight);
+    free(col_taps);
+}
+
+// Write the averages of the box sums into the elevation plane
+void finishReduction(ingest_t *state) {
+    geotiffmap_t *map = state->map;
+    int16_t max = INT16_MIN;
+    int16_t min = INT16_MAX;
+    for(int r = 0; r < map->height; r++) {
+        const float *sum = state->sum + ((size_t)r * map->width);
+        const float *total = state->weight + ((size_t)r * map->width);
+        int16_t *dst = MAPBUF_ROW(map->elevation, int16_t, r + MAPFRAME) + MAPFRAME;
+        for(int c = 0; c < map->width; c++) {
+            dst[c] = (total[c] > 0.0f) ? (int16_t)lrintf(sum[c] / total[c]) : -9999;
+            if(dst[c] < min)
+                min = dst[c];
+            if(dst[c] > max)
+                max = dst[c];
+        }
+    }
+    map->max_elevation = max;
+    map->min_elevation = min;
+}
+
+// Read an uncompressed, native-endian, single-band int16 striped raster by
+// mapping the file and copying the strips straight out of the page cache.
+// libtiff is only used for the strip offsets. Returns ANAX_ERR_TIFF_SCANLINE
+// if the file is not laid out in a way this can handle, in which case the
+// caller should fall back to decoding it.
+int mapElevationData(ingest_t *state) {
+    geotiffmap_t *map = state->map;
+    TIFF *tiff = state->tiff;
+    uint16_t compression, planar_config;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_COMPRESSION, &compression);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_PLANARCONFIG, &planar_config);
+    if(TIFFIsTiled(tiff) || TIFFIsByteSwapped(tiff) || compression != COMPRESSION_NONE || planar_config != PLANARCONFIG_CONTIG)
+        return ANAX_ERR_TIFF_SCANLINE;
+
+    uint32_t rows_per_strip;
+    toff_t *offsets;
+    toff_t *bytecounts;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+    if(!TIFFGetField(tiff, TIFFTAG_STRIPOFFSETS, &offsets) || !TIFFGetField(tiff, TIFFTAG_STRIPBYTECOUNTS, &bytecounts))
+        return ANAX_ERR_TIFF_SCANLINE;
+    if(rows_per_strip > (uint32_t)state->src_height)
+        rows_per_strip = state->src_height;
+
+    int fd = open(TIFFFileName(tiff), O_RDONLY);
+    if(fd < 0)
+        return ANAX_ERR_TIFF_SCANLINE;
+    struct stat st;
+    if(fstat(fd, &st) || st.st_size == 0) {
+        close(fd);
+        return ANAX_ERR_TIFF_SCANLINE;
+    }
+
+    // Make sure every strip lies inside the file and is suitably aligned before
+    // touching any of them
+    size_t row_size = (size_t)state->src_width * sizeof(int16_t);
+    uint32_t num_strips = TIFFNumberOfStrips(tiff);
+    for(uint32_t s = 0; s < num_strips; s++) {
+        int rows = rows_per_strip;
+        if((s * rows_per_strip) + rows > (uint32_t)state->src_height)
+            rows = state->src_height - (s * rows_per_strip);
+        if(offsets[s] % sizeof(int16_t) || bytecounts[s] < rows * row_size || offsets[s] + (rows * row_size) > (toff_t)st.st_size) {
+            close(fd);
+            return ANAX_ERR_TIFF_SCANLINE;
+        }
+    }
+
+    uint8_t *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED)
+        return ANAX_ERR_TIFF_SCANLINE;
+    madvise(file, st.st_size, MADV_SEQUENTIAL);
+
+    // When decimating, the strips (or the parts of them in the window) are
+    // reduced straight out of the mapping
+    if(state->step > 1) {
+        for(uint32_t s = state->win_row / rows_per_strip; s < num_strips && s * rows_per_strip < (uint32_t)(state->win_row + state->win_rows); s++) {
+            int first = s * rows_per_strip;
+            int last = first + rows_per_strip;
+            first = (first < state->win_row) ? state->win_row : first;
+            last = (last > state->win_row + state->win_rows) ? state->win_row + state->win_rows : last;
+            const int16_t *src = (const int16_t *)(file + offsets[s] + ((first - (s * rows_per_strip)) * row_size)) + state->win_col;
+            reduceElevationBlock(state, src, state->src_width, first - state->row_shift, state->win_col - state->col_shift, last - first, state->win_cols);
+        }
+        munmap(file, st.st_size);
+        return state->err;
+    }
+
+    // The plane carries a halo around every row, so the strips still need one
+    // copy into it; min/max are folded into that same pass
+    int16_t max = INT16_MIN;
+    int16_t min = INT16_MAX;
+    for(int row = 0; row < map->height; row++) {
+        uint32_t s = (row + state->row_shift) / rows_per_strip;
+        const int16_t *src = (const int16_t *)(file + offsets[s] + ((row + state->row_shift - (s * rows_per_strip)) * row_size)) + state->col_shift;
+        int16_t *dst = MAPBUF_ROW(map->elevation, int16_t, row + MAPFRAME) + MAPFRAME;
+        copyElevationRow(dst, src, map->width, &min, &max);
+    }
+    munmap(file, st.st_size);
+
+    state->max_elevation = max;
+    state->min_elevation = min;
+
+    return 0;
+}
+
+static int decodeElevationData(ingest_t *state) {
+    // Uncompressed rasters can be read without going through libtiff at all
+    int err = mapElevationData(state);
+    if(err != ANAX_ERR_TIFF_SCANLINE)
+        return err;
+
+    TIFF *tiff = state->tiff;
+    if(state->tiled) {
+        TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &(state->block_width));
+        TIFFGetField(tiff, TIFFTAG_TILELENGTH, &(state->block_height));
+        state->blocks_across = (state->src_width + state->block_width - 1) / state->block_width;
+        state->num_blocks = TIFFNumberOfTiles(tiff);
+        state->block_size = TIFFTileSize(tiff);
+    } else {
+        uint32_t rows_per_strip;
+        TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+        if(rows_per_strip > (uint32_t)state->src_height)
+            rows_per_strip = state->src_height;
+        state->block_width = state->src_width;
+        state->block_height = rows_per_strip;
+        state->blocks_across = 1;
+        state->num_blocks = TIFFNumberOfStrips(tiff);
+        state->block_size = TIFFStripSize(tiff);
+    }
+
+    // Only the blocks crossing the window are decoded
+    state->first_block_row = state->win_row / state->block_height;
+    state->first_block_col = state->win_col / state->block_width;
+    state->window_blocks_across = ((state->win_col + state->win_cols - 1) / state->block_width) - state->first_block_col + 1;
+    state->num_blocks = (((state->win_row + state->win_rows - 1) / state->block_height) - state->first_block_row + 1) * state->window_blocks_across;
+
+    int num_threads = getIngestThreads();
+    if(num_threads > (int)state->num_blocks)
+        num_threads = state->num_blocks;
+    if(num_threads > INGEST_MAX_THREADS)
+        num_threads = INGEST_MAX_THREADS;
+    if(num_threads < 1)
+        num_threads = 1;
+
+    // Spawn helper threads, then let the calling thread decode blocks as well
+    // using the handle it was given
+    pthread_t threads[INGEST_MAX_THREADS];
+    ingest_threadarg_t argts[INGEST_MAX_THREADS];
+    int spawned = 0;
+    for(int i = 1; i < num_threads; i++) {
+        argts[spawned].state = state;
+        argts[spawned].owns_handle = 1;
+        if(pthread_create(&(threads[spawned]), NULL, ingestThread, &(argts[spawned])) == 0)
+            spawned++;
+    }
+    ingest_threadarg_t self;
+    self.state = state;
+    self.owns_handle = 0;
+    ingestThread(&self);
+    for(int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return state->err;
+}
+
+// Decode the elevation raster of a GeoTIFF into the map's elevation plane.
+// Tiled files (e.g. Cloud-Optimized GeoTIFFs) are read tile by tile and striped
+// files strip by strip, with the blocks shared out between several threads.
+// libtiff handles are not thread-safe, so every thread other than the caller's
+// opens its own handle on the same file. The directory and reduction to read
+// with come from plan (see planIngest).
+int readElevationData(geotiffmap_t *map, TIFF *tiff, ingestplan_t *plan) {
+    ingest_t state;
+    memset(&state, 0, sizeof(ingest_t));
+    state.map = map;
+    state.tiff = tiff;
+    state.filename = TIFFFileName(tiff);
+    state.directory = plan->directory;
+    state.src_width = plan->src_width;
+    state.src_height = plan->src_height;
+    state.step = plan->step;
+
+    // The source pixels the window's boxes take in (all of them without a
+    // region of interest)
+    int half = plan->step / 2;
+    int full_width = ((plan->src_width - 1) / plan->step) + 1;
+    int full_height = ((plan->src_height - 1) / plan->step) + 1;
+    state.row_shift = plan->row0 * plan->step;
+    state.col_shift = plan->col0 * plan->step;
+    state.win_row = plan->row0 ? state.row_shift - half : 0;
+    state.win_col = plan->col0 ? state.col_shift - half : 0;
+    state.win_rows = (plan->row0 + map->height < full_height) ? state.row_shift + ((map->height - 1) * plan->step) + half + 1 - state.win_row : plan->src_height - state.win_row;
+    state.win_cols = (plan->col0 + map->width < full_width) ? state.col_shift + ((map->width - 1) * plan->step) + half + 1 - state.win_col : plan->src_width - state.win_col;
+    state.max_elevation = INT16_MIN;
+    state.min_elevation = INT16_MAX;
+
+    tdir_t base = TIFFCurrentDirectory(tiff);
+    if(state.directory != base && !TIFFSetDirectory(tiff, state.directory))
+        return ANAX_ERR_TIFF_SCANLINE;
+    state.tiled = TIFFIsTiled(tiff);
+
+    int err = 0;
+    uint16_t bits_per_sample, samples_per_pixel;
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
+    if(bits_per_sample != 16 || samples_per_pixel != 1)
+        err = ANAX_ERR_TIFF_SCANLINE;
+
+    // Box sums for the map pixels while decimating
+    if(!err && state.step > 1) {
+        state.sum = calloc((size_t)map->height * map->width, sizeof(float));
+        state.weight = calloc((size_t)map->height * map->width, sizeof(float));
+        if(!state.sum || !state.weight)
+            err = ANAX_ERR_NO_MEMORY;
+    }
+
+    if(!err) {
+        pthread_mutex_init(&(state.lock), NULL);
+        err = decodeElevationData(&state);
+        pthread_mutex_destroy(&(state.lock));
+    }
+
+    if(!err) {
+        if(state.step > 1) {
+            finishReduction(&state);
+        } else {
+            map->max_elevation = state.max_elevation;
+            map->min_elevation = state.min_elevation;
+        }
+    }
+
+    free(state.sum);
+    free(state.weight);
+    if(state.directory != base)
+        TIFFSetDirectory(tiff, base);
+    return err;
+}
+
+void *ingestThread(void *argt) {
+    ingest_t *state = ((ingest_threadarg_t *)argt)->state;
+    geotiffmap_t *map = state->map;
+    TIFF *tiff = state->tiff;
+
+    if(((ingest_threadarg_t *)argt)->owns_handle) {
+        tiff = XTIFFOpen(state->filename, "r");
+        // Without a handle of its own this thread cannot help; the remaining
+        // threads pick up its share of the blocks
+        if(!tiff)
+            return NULL;
+        if(TIFFCurrentDirectory(tiff) != state->directory && !TIFFSetDirectory(tiff, state->directory)) {
+            XTIFFClose(tiff);
+            return NULL;
+        }
+    }
+
+    // Blocks are decoded into a private buffer and then copied into the plane,
+    // since the halo means rows of the plane are not contiguous
+    int16_t *buf = malloc(state->block_size);
+    if(!buf) {
+        pthread_mutex_lock(&(state->lock));
+        state->err = ANAX_ERR_NO_MEMORY;
+        pthread_mutex_unlock(&(state->lock));
+        if(tiff != state->tiff)
+            XTIFFClose(tiff);
+        return NULL;
+    }
+
+    int16_t local_max = INT16_MIN;
+    int16_t local_min = INT16_MAX;
+    while(1) {
+        pthread_mutex_lock(&(state->lock));
+        uint32_t block = state->next_block++;
+        int stop = (block >= state->num_blocks) || state->err;
+        pthread_mutex_unlock(&(state->lock));
+        if(stop)
+            break;
+
+        // Find the block among all of the raster's blocks
+        uint32_t block_row = state->first_block_row + (block / state->window_blocks_across);
+        uint32_t block_col = state->first_block_col + (block % state->window_blocks_across);
+        block = (block_row * state->blocks_across) + block_col;
+
+        tmsize_t res;
+        if(state->tiled)
+            res = TIFFReadEncodedTile(tiff, block, buf, state->block_size);
+        else
+            res = TIFFReadEncodedStrip(tiff, block, buf, state->block_size);
+        if(res < 0) {
+            pthread_mutex_lock(&(state->lock));
+            state->err = ANAX_ERR_TIFF_SCANLINE;
+            pthread_mutex_unlock(&(state->lock));
+            break;
+        }
+
+        // Clip the block against the window (edge tiles are padded out to the
+        // full tile size, and the last strip may be short)
+        int row0 = block_row * state->block_height;
+        int col0 = block_col * state->block_width;
+        int rows = state->block_height;
+        int cols = state->block_width;
+        if(row0 + rows > state->win_row + state->win_rows)
+            rows = state->win_row + state->win_rows - row0;
+        if(col0 + cols > state->win_col + state->win_cols)
+            cols = state->win_col + state->win_cols - col0;
+        int16_t *block_buf = buf;
+        if(row0 < state->win_row) {
+            block_buf += (size_t)(state->win_row - row0) * state->block_width;
+            rows -= state->win_row - row0;
+            row0 = state->win_row;
+        }
+        if(col0 < state->win_col) {
+            block_buf += state->win_col - col0;
+            cols -= state->win_col - col0;
+            col0 = state->win_col;
+        }
+
+        if(state->step > 1) {
+            reduceElevationBlock(state, block_buf, state->block_width, row0 - state->row_shift, col0 - state->col_shift, rows, cols);
+            continue;
+        }
+        for(int r = 0; r < rows; r++) {
+            int16_t *src = block_buf + ((size_t)r * state->block_width);
+            int16_t *dst = MAPBUF_ROW(map->elevation, int16_t, row0 - state->row_shift + r + MAPFRAME) + col0 - state->col_shift + MAPFRAME;
+            copyElevationRow(dst, src, cols, &local_min, &local_max);
+        }
+    }
+
+    pthread_mutex_lock(&(state->lock));
+    if(local_max > state->max_elevation)
+        state->max_elevation = local_max;
+    if(local_min < state->min_elevation)
+        state->min_elevation = local_min;
+    pthread_mutex_unlock(&(state->lock));
+
+    free(buf);
+    if(tiff != state->tiff)
+        XTIFFClose(tiff);
+    return NULL;
+}
+
+// Spawn the pool's workers and let the calling thread work through the jobs
+// as well. The pool is sized by the core count, and the cores are shared out
+// between the tiles being decoded at once, unless the number of decoder
+// threads has been set explicitly.
+static int runIngestPool(ingestpool_t *pool) {
+    int cores = getIngestThreads();
+    int num_workers = cores;
+    if(num_workers > pool->joblist->num_jobs)
+        num_workers = pool->joblist->num_jobs;
+    if(num_workers > INGEST_MAX_THREADS)
+        num_workers = INGEST_MAX_THREADS;
+    if(num_workers < 1)
+        num_workers = 1;
+
+    int saved_threads = ingest_threads;
+    if(ingest_threads == 0)
+        ingest_threads = (cores / num_workers > 0) ? cores / num_workers : 1;
+
+    pthread_t threads[INGEST_MAX_THREADS];
+    int spawned = 0;
+    for(int i = 1; i < num_workers; i++) {
+        if(pthread_create(&(threads[spawned]), NULL, ingestWorker, pool) == 0)
+            spawned++;
+    }
+    ingestWorker(pool);
+    for(int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    ingest_threads = saved_threads;
+    return pool->err;
+}
+
+// Run the per-tile ingest pipeline (load, project, spill to the temporary file)
+// for every job in the list on a pool of worker threads. Workers wait for each
+// other whenever starting another tile would take the rasters in memory past
+// the memory budget. The elevation extremes of all tiles are folded into
+// local_max and local_min.
+int ingestJobs(joblist_t *joblist, uilist_t *uilist, int projection, int quiet, int *local_max, int *local_min) {
+    ingestpool_t pool;
+    memset(&pool, 0, sizeof(ingestpool_t));
+    pool.joblist = joblist;
+    pool.uilist = uilist;
+    pool.projection = projection;
+    pool.quiet = quiet;
+    pool.max_elevation = *local_max;
+    pool.min_elevation = *local_min;
+    pool.memory_budget = getIngestMemoryBudget();
+    pthread_mutex_init(&(pool.lock), NULL);
+    pthread_cond_init(&(pool.memory_cond), NULL);
+
+    int err = runIngestPool(&pool);
+
+    pthread_cond_destroy(&(pool.memory_cond));
+    pthread_mutex_destroy(&(pool.lock));
+
+    if(err)
+        return err;
+    *local_max = pool.max_elevation;
+    *local_min = pool.min_elevation;
+
+    return 0;
+}
+
+static int compareSurveysWest(const void *a, const void *b) {
+    const jobsurvey_t *sa = *(jobsurvey_t * const *)a;
+    const jobsurvey_t *sb = *(jobsurvey_t * const *)b;
+    double wa = sa->left - sa->margin_x;
+    double wb = sb->left - sb->margin_x;
+    return (wa > wb) - (wa < wb);
+}
+
+static int surveysOverlap(jobsurvey_t *a, jobsurvey_t *b) {
+    return a->left - a->margin_x <= b->right + b->margin_x &&
+           b->left - b->margin_x <= a->right + a->margin_x &&
+           a->bottom - a->margin_y <= b->top + b->margin_y &&
+           b->bottom - b->margin_y <= a->top + a->margin_y;
+}
+
+// Count a pair of neighbors on the first pass, and list them on the second
+static void linkNeighbors(ingestpool_t *pool, int a, int b, int fill) {
+    if(fill) {
+        pool->neighbors[a][pool->num_neighbors[a]] = b;
+        pool->neighbors[b][pool->num_neighbors[b]] = a;
+    }
+    pool->num_neighbors[a]++;
+    pool->num_neighbors[b]++;
+}
+
+// Work out which tiles' halos reach into which from the surveyed footprints,
+// widened by the halo. Footprints are swept from west to east, so that only
+// those overlapping in longitude are compared. A tile whose footprint could
+// not be read is taken to neighbor every tile.
+static int findStreamNeighbors(ingestpool_t *pool, jobsurvey_t *surveys) {
+    int num_jobs = pool->joblist->num_jobs;
+    pool->waiting = malloc(num_jobs * sizeof(int));
+    pool->neighbors = calloc(num_jobs, sizeof(int *));
+    pool->num_neighbors = calloc(num_jobs, sizeof(int));
+    pool->ready = malloc(num_jobs * sizeof(int));
+    pool->bounds = malloc(num_jobs * sizeof(region_t));
+    jobsurvey_t **order = malloc(num_jobs * sizeof(jobsurvey_t *));
+    if(!pool->waiting || !pool->neighbors || !pool->num_neighbors || !pool->ready || !pool->bounds || !order) {
+        free(order);
+        return ANAX_ERR_NO_MEMORY;
+    }
+
+    int num_sorted = 0;
+    for(int i = 0; i < num_jobs; i++) {
+        if(surveys[i].has_corners)
+            order[num_sorted++] = &(surveys[i]);
+    }
+    qsort(order, num_sorted, sizeof(jobsurvey_t *), compareSurveysWest);
+
+    for(int fill = 0; fill < 2; fill++) {
+        for(int i = 0; i < num_sorted; i++) {
+            for(int j = i + 1; j < num_sorted && order[j]->left - order[j]->margin_x <= order[i]->right + order[i]->margin_x; j++) {
+                if(surveysOverlap(order[i], order[j]))
+                    linkNeighbors(pool, order[i] - surveys, order[j] - surveys, fill);
+            }
+        }
+        for(int a = 0; a < num_jobs; a++) {
+            if(surveys[a].has_corners)
+                continue;
+            for(int b = 0; b < num_jobs; b++) {
+                if(b != a && (surveys[b].has_corners || b > a))
+                    linkNeighbors(pool, a, b, fill);
+            }
+        }
+
+        if(fill)
+            break;
+        for(int i = 0; i < num_jobs; i++) {
+            if(pool->num_neighbors[i] > 0) {
+                pool->neighbors[i] = malloc(pool->num_neighbors[i] * sizeof(int));
+                if(!pool->neighbors[i]) {
+                    free(order);
+                    return ANAX_ERR_NO_MEMORY;
+                }
+            }
+            pool->waiting[i] = 1 + pool->num_neighbors[i];
+            pool->num_neighbors[i] = 0;
+        }
+    }
+
+    free(order);
+    return 0;
+}
+
+// Size the tile index to the surveyed footprints, since tiles are inserted in
+// whatever order they finish loading
+static int sizeStreamIndex(ingestpool_t *pool, jobsurvey_t *surveys) {
+    int num_jobs = pool->joblist->num_jobs;
+    double *widths = malloc((num_jobs > 0 ? num_jobs : 1) * sizeof(double));
+    double *heights = malloc((num_jobs > 0 ? num_jobs : 1) * sizeof(double));
+    int err = ANAX_ERR_NO_MEMORY;
+    if(widths && heights) {
+        int num_tiles = 0;
+        for(int i = 0; i < num_jobs; i++) {
+            if(!surveys[i].has_corners)
+                continue;
+            widths[num_tiles] = surveys[i].right - surveys[i].left;
+            heights[num_tiles] = surveys[i].top - surveys[i].bottom;
+            num_tiles++;
+        }
+        err = sizeTileIndex(pool->tileindex, widths, heights, num_tiles);
+    }
+    free(widths);
+    free(heights);
+
+    return err;
+}
+
+// Load and render every job in the list on a pool of worker threads, rendering
+// each tile as soon as it and the neighbors its halo reaches into are loaded
+// rather than once all of them are. This needs the color scheme settled before
+// anything is loaded, so it is only for absolute color schemes, and water
+// finding is left out since it is settled across all tiles at once. Neighbors
+// come from the footprints read by surveyJobs.
+int streamJobs(joblist_t *joblist, uilist_t *uilist, int projection, int quiet, jobsurvey_t *surveys, renderopts_t *render) {
+    ingestpool_t pool;
+    memset(&pool, 0, sizeof(ingestpool_t));
+    pool.joblist = joblist;
+    pool.uilist = uilist;
+    pool.projection = projection;
+    pool.quiet = quiet;
+    pool.max_elevation = INT16_MIN;
+    pool.min_elevation = INT16_MAX;
+    pool.memory_budget = getIngestMemoryBudget();
+    pool.render = render;
+    pthread_mutex_init(&(pool.lock), NULL);
+    pthread_cond_init(&(pool.memory_cond), NULL);
+    pthread_cond_init(&(pool.ready_cond), NULL);
+
+    int err = initTileIndex(&(pool.tileindex));
+    if(!err)
+        err = sizeStreamIndex(&pool, surveys);
+    if(!err)
+        err = findStreamNeighbors(&pool, surveys);
+    if(!err)
+        err = runIngestPool(&pool);
+
+    // Only now that no tile is looked up by its full bounds any more do the
+    // tiles take on the bounds of their cropped renders
+    if(!err && render->region) {
+        for(int i = 0; i < joblist->num_jobs; i++) {
+            joblist->jobs[i].top_lat = pool.bounds[i].north;
+            joblist->jobs[i].bottom_lat = pool.bounds[i].south;
+            joblist->jobs[i].right_lon = pool.bounds[i].east;
+            joblist->jobs[i].left_lon = pool.bounds[i].west;
+        }
+    }
+
+    if(pool.tileindex)
+        freeTileIndex(pool.tileindex);
+    if(pool.neighbors) {
+        for(int i = 0; i < joblist->num_jobs; i++) {
+            free(pool.neighbors[i]);
+        }
+    }
+    free(pool.neighbors);
+    free(pool.num_neighbors);
+    free(pool.waiting);
+    free(pool.ready);
+    free(pool.bounds);
+    pthread_cond_destroy(&(pool.ready_cond));
+    pthread_cond_destroy(&(pool.memory_cond));
+    pthread_mutex_destroy(&(pool.lock));
+
+    return err;
+}
+
+// Count a loaded tile against itself and its neighbors, and queue any it was
+// the last one missing for
+static int releaseLoadedJob(ingestpool_t *pool, int index) {
+    int err = insertTileIndex(pool->tileindex, &(pool->joblist->jobs[index]), TILEINDEX_LOCAL, index);
+    if(err)
+        return err;
+
+    pthread_mutex_lock(&(pool->lock));
+    if(--(pool->waiting[index]) == 0)
+        pool->ready[pool->num_ready++] = index;
+    for(int i = 0; i < pool->num_neighbors[index]; i++) {
+        int other = pool->neighbors[index][i];
+        if(--(pool->waiting[other]) == 0)
+            pool->ready[pool->num_ready++] = other;
+    }
+    pthread_cond_broadcast(&(pool->ready_cond));
+    pthread_mutex_unlock(&(pool->lock));
+
+    return 0;
+}
+
+void *ingestWorker(void *argt) {
+    ingestpool_t *pool = (ingestpool_t *)argt;
+    int num_jobs = pool->joblist->num_jobs;
+
+    while(1) {
+        // When streaming, tiles ready to render go before loading more, and
+        // once every tile is being loaded, workers wait for the rest to become
+        // ready
+        pthread_mutex_lock(&(pool->lock));
+        while(pool->render && !pool->err && pool->next_ready == pool->num_ready &&
+              pool->next_job >= num_jobs && pool->next_ready < num_jobs)
+            pthread_cond_wait(&(pool->ready_cond), &(pool->lock));
+        int render = -1;
+        int index = -1;
+        if(!pool->err) {
+            if(pool->render && pool->next_ready < pool->num_ready) {
+                render = pool->ready[pool->next_ready++];
+                if(pool->next_ready == num_jobs)
+                    pthread_cond_broadcast(&(pool->ready_cond));
+            } else if(pool->next_job < num_jobs) {
+                index = pool->next_job++;
+            }
+        }
+        pthread_mutex_unlock(&(pool->lock));
+        if(render < 0 && index < 0)
+            break;
+
+        int err;
+        if(render >= 0) {
+            err = streamJob(pool, render);
+        } else {
+            err = ingestJob(pool, index);
+            if(!err && pool->render)
+                err = releaseLoadedJob(pool, index);
+        }
+        if(err) {
+            pthread_mutex_lock(&(pool->lock));
+            if(!pool->err)
+                pool->err = err;
+            pthread_cond_broadcast(&(pool->memory_cond));
+            if(pool->render)
+                pthread_cond_broadcast(&(pool->ready_cond));
+            pthread_mutex_unlock(&(pool->lock));
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+// Hold back until the memory budget has room for bytes more. Something is
+// always admitted when nothing else is in flight, so a single oversized tile
+// cannot deadlock.
+static void reserveIngestMemory(ingestpool_t *pool, size_t bytes) {
+    pthread_mutex_lock(&(pool->lock));
+    while(pool->memory_in_use > 0 && pool->memory_in_use + bytes > pool->memory_budget && !pool->err)
+        pthread_cond_wait(&(pool->memory_cond), &(pool->lock));
+    pool->memory_in_use += bytes;
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+static void releaseIngestMemory(ingestpool_t *pool, size_t bytes) {
+    pthread_mutex_lock(&(pool->lock));
+    pool->memory_in_use -= bytes;
+    pthread_cond_broadcast(&(pool->memory_cond));
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+int ingestJob(ingestpool_t *pool, int index) {
+    anaxjob_t *job = &(pool->joblist->jobs[index]);
+    jobui_t *jobui = pool->quiet ? NULL : &(pool->uilist->jobuis[index]);
+    int err;
+
+    if(jobui) {
+        updateJobUIState(jobui, UI_STATE_RECEIVING);
+        updateJobView(jobui);
+    }
+
+    // Set the new name for the outfile (bare RGBA, see renderRGBA) and
+    // tempfile (TMP)
+    job->outfile = malloc(32);
+    job->tmpfile = malloc(32);
+    sprintf(job->tmpfile, "/tmp/map%i.tmp", index);
+    sprintf(job->outfile, "/tmp/map%i.rgba", index);
+
+    if(jobui) {
+        updateJobUIState(jobui, UI_STATE_PROCESSING);
+        updateJobView(jobui);
+    }
+
+    // An unchanged source is not loaded again, only its scratch file copied
+    // back from the cache
+    int max_elevation, min_elevation;
+    if(ingest_cache && !lookupCachedScratch(ingest_cache, job, index, &max_elevation, &min_elevation)) {
+        pthread_mutex_lock(&(pool->lock));
+        pool->max_elevation = (max_elevation > pool->max_elevation) ? max_elevation : pool->max_elevation;
+        pool->min_elevation = (min_elevation < pool->min_elevation) ? min_elevation : pool->min_elevation;
+        pthread_mutex_unlock(&(pool->lock));
+        return 0;
+    }
+
+    // Open TIFF file
+    TIFF *srctiff = XTIFFOpen(job->name, "r");
+    if(srctiff == NULL) {
+        fprintf(stderr, "Error: No such file: %s\n", job->name);
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    }
+
+    // Reserve memory for the elevation plane (and for the second copy made when
+    // reprojecting) before allocating anything. When decimating, only the
+    // reduced plane and its box sums are held.
+    ingestplan_t plan;
+    err = planIngest(srctiff, &plan);
+    if(err) {
+        XTIFFClose(srctiff);
+        return err;
+    }
+    size_t row_bytes = (size_t)getMapBufferStride(plan.width, MAPFRAME, sizeof(int16_t)) * sizeof(int16_t);
+    size_t reservation = row_bytes * ((size_t)plan.height + (2 * MAPFRAME)) * (pool->projection ? 2 : 1);
+    if(plan.step > 1)
+        reservation += (size_t)plan.width * plan.height * 2 * sizeof(float);
+    reserveIngestMemory(pool, reservation);
+
+    // Load data from GeoTIFF
+    geotiffmap_t *map;
+    frame_coords_t frame;
+    err = initMap(&map, srctiff, job->name, pool->quiet, &frame);
+    XTIFFClose(srctiff);
+    if(!err) {
+        // Store the frame coordinates
+        memcpy(&(job->frame_coordinates), &frame, sizeof(frame_coords_t));
+
+        // Get periphery
+        getCorners(map, &(job->top_lat), &(job->bottom_lat), &(job->left_lon), &(job->right_lon));
+
+        // Change projections
+        if(pool->projection)
+            applyProjection(&map, pool->projection);
+
+        // Update elevation extreme variables
+        pthread_mutex_lock(&(pool->lock));
+        pool->max_elevation = (map->max_elevation > pool->max_elevation) ? map->max_elevation : pool->max_elevation;
+        pool->min_elevation = (map->min_elevation < pool->min_elevation) ? map->min_elevation : pool->min_elevation;
+        pthread_mutex_unlock(&(pool->lock));
+
+        // Write the map data to a temporary file, and keep a copy for later runs
+        writeMapData(job, map);
+        if(ingest_cache)
+            storeCachedScratch(ingest_cache, job, index, map);
+
+        // Free the map
+        freeMap(map);
+    }
+
+    releaseIngestMemory(pool, reservation);
+
+    return err;
+}
+
+// Fill in a loaded tile's halo from its neighbors, all of which are loaded by
+// now, and render it
+int streamJob(ingestpool_t *pool, int index) {
+    anaxjob_t *job = &(pool->joblist->jobs[index]);
+    jobui_t *jobui = pool->quiet ? NULL : &(pool->uilist->jobuis[index]);
+
+    if(jobui) {
+        updateJobUIState(jobui, UI_STATE_LOCALCHK);
+        updateJobView(jobui);
+    }
+    queryForMapFrameLocal(job, pool->tileindex, 0);
+    if(jobui) {
+        updateJobUIState(jobui, UI_STATE_REMOTECHK);
+        updateJobView(jobui);
+        updateJobUIState(jobui, UI_STATE_PREPARING);
+        updateJobView(jobui);
+    }
+
+    // Renders count against the memory budget too, at about twice the loaded
+    // plane for the planes made from it
+    struct stat st;
+    size_t reservation = stat(job->tmpfile, &st) ? 0 : 2 * (size_t)st.st_size;
+    reserveIngestMemory(pool, reservation);
+
+    // Neighbors still look the tile up by its full bounds, so the bounds of
+    // its cropped render are set aside until every tile is done. The rest of
+    // what rendering changes (a cached tile is read from the cache) is taken
+    // over right away.
+    anaxjob_t rendered = *job;
+    int err = renderJob(&rendered, index, pool->render, jobui);
+    job->outfile = rendered.outfile;
+    job->img_height = rendered.img_height;
+    job->img_width = rendered.img_width;
+    pool->bounds[index].north = rendered.top_lat;
+    pool->bounds[index].south = rendered.bottom_lat;
+    pool->bounds[index].east = rendered.right_lon;
+    pool->bounds[index].west = rendered.left_lon;
+
+    releaseIngestMemory(pool, reservation);
+
+    if(jobui && !err) {
+        updateJobUIState(jobui, UI_STATE_SENDING);
+        updateJobView(jobui);
+        updateJobUIState(jobui, UI_STATE_COMPLETE);
+        updateJobView(jobui);
+    }
+
+    return err;
+}
+
+// Render a loaded tile, with its halo filled in, to its RGBA file (see
+// renderRGBA), or take the rendering from the cache if nothing it depends on
+// has changed since an earlier run
+int renderJob(anaxjob_t *job, int index, renderopts_t *render, jobui_t *jobui) {
+    // Load the map
+    geotiffmap_t *map;
+    int err = readMapData(job, &map);
+    if(err)
+        return err;
+
+    if(render->cache && !lookupCachedRender(render->cache, job, index, map)) {
+        freeMap(map);
+        freeWaterBoundary(job->water_boundary);
+        job->water_boundary = NULL;
+        return 0;
+    }
+
+    // Find water
+    if(render->colorscheme->showWater) {
+        findWater(map, render->water_min_area, job->water_boundary);
+        freeWaterBoundary(job->water_boundary);
+        job->water_boundary = NULL;
+    }
+
+    // Apply relief shading
+    if(render->relief)
+        reliefshade(map, render->azimuth, render->altitude);
+
+    // Scale, allowing for any downsampling done while reading
+    if(render->scale * map->decimation != 1.0)
+        err = scaleImage(&map, render->scale * map->decimation, render->kernel);
+
+    // Cut the map down to the region of interest
+    if(!err && render->region) {
+        err = cropMap(&map, render->region);
+        getCorners(map, &(job->top_lat), &(job->bottom_lat), &(job->left_lon), &(job->right_lon));
+    }
+    if(err) {
+        freeMap(map);
+        return err;
+    }
+
+    // Colorize and render
+    if(jobui) {
+        updateJobUIState(jobui, UI_STATE_RENDERING);
+        updateJobView(jobui);
+    }
+    err = renderRGBA(map, render->colorscheme, job->outfile);
+
+    // Get final image dimensions
+    job->img_height = map->height;
+    job->img_width = map->width;
+
+    // Free the map
+    freeMap(map);
+
+    // Keep the tile for later runs
+    if(!err && render->cache)
+        storeCachedRender(render->cache, job, index);
+
+    return err;
+}
+
+static int16_t clampElevation(double elevation) {
+    if(elevation > INT16_MAX)
+        return INT16_MAX;
+    if(elevation < INT16_MIN)
+        return INT16_MIN;
+    return (int16_t)elevation;
+}
+
+// Read the first band's minimum and maximum from the statistics GDAL keeps in
+// a file's metadata tag, e.g.
+//   <Item name="STATISTICS_MAXIMUM" sample="0">2962</Item>
+// rounded outwards to whole meters
+int getGDALStatistics(TIFF *tiff, int16_t *max, int16_t *min) {
+    char *metadata = NULL;
+    if(!TIFFGetField(tiff, INGEST_TAG_GDAL_METADATA, &metadata) || !metadata)
+        return ANAX_ERR_INVALID_HEADER;
+
+    double stat_max = 0.0;
+    double stat_min = 0.0;
+    int found = 0;
+    for(char *item = strstr(metadata, "<Item"); item; item = strstr(item + 1, "<Item")) {
+        char *end = strchr(item, '>');
+        if(!end)
+            break;
+
+        // Items without a sample attribute apply to every band
+        char *sample = strstr(item, "sample=\"");
+        if(sample && sample < end && atoi(sample + 8) != 0)
+            continue;
+        char *name = strstr(item, "name=\"");
+        if(!name || name > end)
+            continue;
+        int is_max = !strncmp(name + 6, "STATISTICS_MAXIMUM\"", 19);
+        int is_min = !strncmp(name + 6, "STATISTICS_MINIMUM\"", 19);
+        if(!is_max && !is_min)
+            continue;
+
+        char *value_end;
+        double value = strtod(end + 1, &value_end);
+        if(value_end == end + 1)
+            continue;
+        if(is_max) {
+            stat_max = value;
+            found |= 1;
+        } else {
+            stat_min = value;
+            found |= 2;
+        }
+    }
+    if(found != 3 || stat_max < stat_min)
+        return ANAX_ERR_INVALID_HEADER;
+
+    *max = clampElevation(ceil(stat_max));
+    *min = clampElevation(floor(stat_min));
+    return 0;
+}
+
+// Find the elevation range of the current directory of a file from a grid of
+// its blocks spread evenly over it, adding up to about INGEST_SAMPLE_PIXELS
+// pixels (all of them for small images). Like a full read, the range takes in
+// no-data pixels.
+int scanElevationBlocks(TIFF *tiff, int16_t *max, int16_t *min) {
+    uint32_t width, height;
+    uint16_t bits_per_sample, samples_per_pixel;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_BITSPERSAMPLE, &bits_per_sample);
+    TIFFGetFieldDefaulted(tiff, TIFFTAG_SAMPLESPERPIXEL, &samples_per_pixel);
+    if(bits_per_sample != 16 || samples_per_pixel != 1 || width == 0 || height == 0)
+        return ANAX_ERR_TIFF_SCANLINE;
+
+    int tiled = TIFFIsTiled(tiff);
+    uint32_t block_width, block_height;
+    tmsize_t block_size;
+    if(tiled) {
+        TIFFGetField(tiff, TIFFTAG_TILEWIDTH, &block_width);
+        TIFFGetField(tiff, TIFFTAG_TILELENGTH, &block_height);
+        block_size = TIFFTileSize(tiff);
+    } else {
+        uint32_t rows_per_strip;
+        TIFFGetFieldDefaulted(tiff, TIFFTAG_ROWSPERSTRIP, &rows_per_strip);
+        block_width = width;
+        block_height = (rows_per_strip > height) ? height : rows_per_strip;
+        block_size = TIFFStripSize(tiff);
+    }
+    if(block_width == 0 || block_height == 0 || block_size <= 0)
+        return ANAX_ERR_TIFF_SCANLINE;
+    uint32_t blocks_across = (width + block_width - 1) / block_width;
+    uint32_t blocks_down = (height + block_height - 1) / block_height;
+
+    // Halve the grid along its longer side until it fits the sample
+    size_t block_pixels = (size_t)block_width * block_height;
+    size_t wanted = (INGEST_SAMPLE_PIXELS / block_pixels > 0) ? INGEST_SAMPLE_PIXELS / block_pixels : 1;
+    uint32_t rows_taken = blocks_down;
+    uint32_t cols_taken = blocks_across;
+    while((size_t)rows_taken * cols_taken > wanted) {
+        if(rows_taken >= cols_taken)
+            rows_taken = (rows_taken + 1) / 2;
+        else
+            cols_taken = (cols_taken + 1) / 2;
+    }
+
+    int16_t *buf = malloc(block_size);
+    if(!buf)
+        return ANAX_ERR_NO_MEMORY;
+
+    int16_t local_max = INT16_MIN;
+    int16_t local_min = INT16_MAX;
+    int err = 0;
+    for(uint32_t r = 0; r < rows_taken && !err; r++) {
+        for(uint32_t c = 0; c < cols_taken && !err; c++) {
+            uint32_t block_row = (uint32_t)(((uint64_t)r * blocks_down) / rows_taken);
+            uint32_t block_col = (uint32_t)(((uint64_t)c * blocks_across) / cols_taken);
+            tmsize_t res;
+            if(tiled)
+                res = TIFFReadEncodedTile(tiff, (block_row * blocks_across) + block_col, buf, block_size);
+            else
+                res = TIFFReadEncodedStrip(tiff, block_row, buf, block_size);
+            if(res < 0) {
+                err = ANAX_ERR_TIFF_SCANLINE;
+                break;
+            }
+
+            // Edge tiles are padded out to the full tile size, and the last
+            // strip may be short
+            uint32_t rows = block_height;
+            uint32_t cols = block_width;
+            if((block_row * block_height) + rows > height)
+                rows = height - (block_row * block_height);
+            if((block_col * block_width) + cols > width)
+                cols = width - (block_col * block_width);
+            for(uint32_t i = 0; i < rows; i++) {
+                int16_t *row = buf + ((size_t)i * block_width);
+                for(uint32_t j = 0; j < cols; j++) {
+                    if(row[j] > local_max)
+                        local_max = row[j];
+                    if(row[j] < local_min)
+                        local_min = row[j];
+                }
+            }
+        }
+    }
+    free(buf);
+
+    if(err)
+        return err;
+    *max = local_max;
+    *min = local_min;
+    return 0;
+}
+
+// Find a source file's elevation range without decoding all of it: from the
+// statistics GDAL keeps in its metadata, else from its smallest internal
+// overview, else from a sample of its blocks. Overviews and samples can miss
+// the extremes, in which case those pixels take the end colors of a relative
+// scheme. range is set to where the range came from.
+int scanElevationRange(TIFF *tiff, int16_t *max, int16_t *min, int *range) {
+    *range = INGEST_RANGE_NONE;
+    if(!getGDALStatistics(tiff, max, min)) {
+        *range = INGEST_RANGE_STATISTICS;
+        return 0;
+    }
+
+    // Find the smallest overview
+    tdir_t base = TIFFCurrentDirectory(tiff);
+    tdir_t smallest = base;
+    uint64_t smallest_pixels = UINT64_MAX;
+    tdir_t num_directories = TIFFNumberOfDirectories(tiff);
+    for(tdir_t d = 0; d < num_directories; d++) {
+        uint32_t subfile = 0;
+        uint32_t ow = 0;
+        uint32_t oh = 0;
+        if(d == base || !TIFFSetDirectory(tiff, d))
+            continue;
+        TIFFGetFieldDefaulted(tiff, TIFFTAG_SUBFILETYPE, &subfile);
+        TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &ow);
+        TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &oh);
+        if(!(subfile & FILETYPE_REDUCEDIMAGE) || ow == 0 || oh == 0)
+            continue;
+        if((uint64_t)ow * oh < smallest_pixels) {
+            smallest_pixels = (uint64_t)ow * oh;
+            smallest = d;
+        }
+    }
+
+    if(smallest != base && TIFFSetDirectory(tiff, smallest) && !scanElevationBlocks(tiff, max, min))
+        *range = INGEST_RANGE_OVERVIEW;
+    if(TIFFCurrentDirectory(tiff) != base && !TIFFSetDirectory(tiff, base))
+        return ANAX_ERR_TIFF_SCANLINE;
+    if(*range == INGEST_RANGE_NONE && !scanElevationBlocks(tiff, max, min))
+        *range = INGEST_RANGE_SAMPLE;
+
+    return 0;
+}
+
+// Settle one decimation factor for the whole run: the lowest that planIngest
+// picks for any surveyed file, since it lowers the factor for files that would
+// come out less than MAPFRAME pixels across. Every tile is then read at the
+// same resolution, so that the edges copied into neighboring halos line up.
+int settleIngestDecimation(jobsurvey_t *surveys, int num_jobs) {
+    int factor = getIngestDecimation();
+    for(int i = 0; i < num_jobs; i++) {
+        if(surveys[i].factor > 0 && surveys[i].factor < factor)
+            factor = surveys[i].factor;
+    }
+    setIngestDecimation(factor);
+
+    return factor;
+}
+
+// Read what can be known of every tile before any of them is loaded: its
+// footprint and, with scan_ranges set, its elevation range (see
+// scanElevationRange). The headers are read on a pool of worker threads. The
+// ranges found are folded into max and min, which are left at INT16_MIN and
+// INT16_MAX if none was.
+int surveyJobs(joblist_t *joblist, int scan_ranges, jobsurvey_t **surveys, int *max, int *min) {
+    pthread_once(&ingest_tags_once, registerIngestTags);
+
+    *surveys = calloc((joblist->num_jobs > 0) ? joblist->num_jobs : 1, sizeof(jobsurvey_t));
+    if(!*surveys)
+        return ANAX_ERR_NO_MEMORY;
+
+    surveypool_t pool;
+    memset(&pool, 0, sizeof(surveypool_t));
+    pool.joblist = joblist;
+    pool.surveys = *surveys;
+    pool.scan_ranges = scan_ranges;
+    pthread_mutex_init(&(pool.lock), NULL);
+
+    int num_workers = getIngestThreads();
+    if(num_workers > joblist->num_jobs)
+        num_workers = joblist->num_jobs;
+    if(num_workers > INGEST_MAX_THREADS)
+        num_workers = INGEST_MAX_THREADS;
+
+    pthread_t threads[INGEST_MAX_THREADS];
+    int spawned = 0;
+    for(int i = 1; i < num_workers; i++) {
+        if(pthread_create(&(threads[spawned]), NULL, surveyWorker, &pool) == 0)
+            spawned++;
+    }
+    surveyWorker(&pool);
+    for(int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_mutex_destroy(&(pool.lock));
+
+    *max = INT16_MIN;
+    *min = INT16_MAX;
+    for(int i = 0; i < joblist->num_jobs; i++) {
+        if((*surveys)[i].range == INGEST_RANGE_NONE)
+            continue;
+        *max = ((*surveys)[i].max_elevation > *max) ? (*surveys)[i].max_elevation : *max;
+        *min = ((*surveys)[i].min_elevation < *min) ? (*surveys)[i].min_elevation : *min;
+    }
+
+    return 0;
+}
+
+void *surveyWorker(void *argt) {
+    surveypool_t *pool = (surveypool_t *)argt;
+
+    while(1) {
+        pthread_mutex_lock(&(pool->lock));
+        int index = pool->next_job++;
+        pthread_mutex_unlock(&(pool->lock));
+        if(index >= pool->joblist->num_jobs)
+            break;
+
+        // A file that cannot be opened is reported when it is loaded
+        jobsurvey_t *survey = &(pool->surveys[index]);
+        TIFF *tiff = XTIFFOpen(pool->joblist->jobs[index].name, "r");
+        if(!tiff)
+            continue;
+
+        // The halo is MAPFRAME map pixels, each of which is up to the
+        // decimation factor of source pixels across
+        if(!getTIFFCorners(tiff, &(survey->top), &(survey->bottom), &(survey->left), &(survey->right))) {
+            uint32_t width, height;
+            TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+            TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+            double reach = (MAPFRAME + 1) * getIngestDecimation();
+            survey->margin_x = (width > 1) ? reach * fabs(survey->right - survey->left) / (width - 1) : 0.0;
+            survey->margin_y = (height > 1) ? reach * fabs(survey->top - survey->bottom) / (height - 1) : 0.0;
+            survey->has_corners = 1;
+        }
+
+        ingestplan_t plan;
+        if(!planIngest(tiff, &plan))
+            survey->factor = plan.factor;
+
+        if(pool->scan_ranges)
+            scanElevationRange(tiff, &(survey->max_elevation), &(survey->min_elevation), &(survey->range));
+        XTIFFClose(tiff);
+    }
+
+    return NULL;
+}
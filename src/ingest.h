@@ -0,0 +1,182 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <tiffio.h>
+#include "cache.h"
+#include "libanax.h"
+#include "tileindex.h"
+
+#define INGEST_MAX_THREADS                          64
+#define INGEST_MAX_OVERVIEWS                        32
+#define INGEST_SAMPLE_PIXELS                        (1 << 20)
+#define INGEST_TAG_GDAL_METADATA                    42112
+
+// Where the elevation range of a source file was found (see scanElevationRange)
+#define INGEST_RANGE_NONE                           0
+#define INGEST_RANGE_STATISTICS                     1
+#define INGEST_RANGE_OVERVIEW                       2
+#define INGEST_RANGE_SAMPLE                         3
+
+// How a raster is read into a map. Each map pixel stands for factor pixels of
+// the full-resolution image along each axis: it is read from directory (an
+// internal overview reduced by overview, or the image itself) and reduced by
+// a further step while it is read. offset is the distance, in full-resolution
+// pixels, from the first full-resolution pixel center to the first map pixel
+// center. With a region of interest set, the map is only the window of
+// width x height map pixels starting at map pixel (row0, col0).
+struct ingest_plan {
+    int factor;
+    int overview;
+    int step;
+    tdir_t directory;
+    int src_width;
+    int src_height;
+    int width;
+    int height;
+    int row0;
+    int col0;
+    double offset;
+};
+typedef struct ingest_plan ingestplan_t;
+
+struct ingest_state {
+    geotiffmap_t *map;
+    TIFF *tiff;
+    const char *filename;
+    tdir_t directory;
+    int src_width;
+    int src_height;
+    int step;
+    int win_row;            // Window of source pixels read (see windowIngestPlan)
+    int win_col;
+    int win_rows;
+    int win_cols;
+    int row_shift;          // Source pixel at map pixel 0 of the window
+    int col_shift;
+    float *sum;
+    float *weight;
+    int tiled;
+    uint32_t block_width;
+    uint32_t block_height;
+    uint32_t blocks_across;
+    uint32_t first_block_row;
+    uint32_t first_block_col;
+    uint32_t window_blocks_across;
+    uint32_t num_blocks;
+    tmsize_t block_size;
+    uint32_t next_block;
+    int16_t max_elevation;
+    int16_t min_elevation;
+    int err;
+    pthread_mutex_t lock;
+};
+typedef struct ingest_state ingest_t;
+
+// What surveyJobs reads from a source file's header before any file is loaded
+struct job_survey {
+    int has_corners;
+    double top;             // Outermost pixel centers (see getTIFFCorners)
+    double bottom;
+    double left;
+    double right;
+    double margin_x;        // MAPFRAME map pixels, in degrees
+    double margin_y;
+    int factor;             // Decimation planIngest picks for the file alone (0 if unknown)
+    int range;              // INGEST_RANGE_*
+    int16_t max_elevation;
+    int16_t min_elevation;
+};
+typedef struct job_survey jobsurvey_t;
+
+struct survey_pool {
+    joblist_t *joblist;
+    jobsurvey_t *surveys;
+    int scan_ranges;
+    int next_job;
+    pthread_mutex_t lock;
+};
+typedef struct survey_pool surveypool_t;
+
+// Everything rendering a loaded tile takes besides the tile (see renderJob)
+struct render_options {
+    colorscheme_t *colorscheme;
+    int relief;
+    double azimuth;
+    double altitude;
+    int water_min_area;
+    double scale;
+    int kernel;
+    region_t *region;
+    rendercache_t *cache;
+};
+typedef struct render_options renderopts_t;
+
+struct ingest_pool {
+    joblist_t *joblist;
+    uilist_t *uilist;
+    int projection;
+    int quiet;
+    int next_job;
+    int max_elevation;
+    int min_elevation;
+    int err;
+    size_t memory_budget;
+    size_t memory_in_use;
+    pthread_mutex_t lock;
+    pthread_cond_t memory_cond;
+
+    // When streaming (see streamJobs), each tile is rendered by whichever
+    // worker loads the last of it and its neighbors
+    renderopts_t *render;
+    tileindex_t *tileindex;
+    int *waiting;           // Per job, tiles (its own included) still to be loaded
+    int **neighbors;
+    int *num_neighbors;
+    int *ready;             // Jobs ready to render, in the order they became so
+    int num_ready;
+    int next_ready;
+    pthread_cond_t ready_cond;
+    region_t *bounds;       // Per job, bounds of the rendered tile (see streamJob)
+};
+typedef struct ingest_pool ingestpool_t;
+
+struct ingest_thread_arguments {
+    ingest_t *state;
+    int owns_handle;
+};
+typedef struct ingest_thread_arguments ingest_threadarg_t;
+
+void setIngestThreads(int num_threads);
+int getIngestThreads(void);
+void setIngestMemoryBudget(size_t bytes);
+size_t getIngestMemoryBudget(void);
+void setIngestDecimation(int factor);
+int getIngestDecimation(void);
+void setIngestRegion(region_t *region);
+region_t *getIngestRegion(void);
+void setIngestCache(rendercache_t *cache);
+rendercache_t *getIngestCache(void);
+int planIngest(TIFF *tiff, ingestplan_t *plan);
+void windowIngestPlan(ingestplan_t *plan, geotransform_t *gt);
+void copyElevationRow(int16_t *dst, const int16_t *src, int n, int16_t *min, int16_t *max);
+void reduceElevationBlock(ingest_t *state, const int16_t *src, size_t stride, int row0, int col0, int rows, int cols);
+void finishReduction(ingest_t *state);
+int mapElevationData(ingest_t *state);
+int readElevationData(geotiffmap_t *map, TIFF *tiff, ingestplan_t *plan);
+void *ingestThread(void *argt);
+int ingestJobs(joblist_t *joblist, uilist_t *uilist, int projection, int quiet, int *local_max, int *local_min);
+int streamJobs(joblist_t *joblist, uilist_t *uilist, int projection, int quiet, jobsurvey_t *surveys, renderopts_t *render);
+int ingestJob(ingestpool_t *pool, int index);
+int streamJob(ingestpool_t *pool, int index);
+void *ingestWorker(void *argt);
+int renderJob(anaxjob_t *job, int index, renderopts_t *render, jobui_t *jobui);
+int getGDALStatistics(TIFF *tiff, int16_t *max, int16_t *min);
+int scanElevationBlocks(TIFF *tiff, int16_t *max, int16_t *min);
+int scanElevationRange(TIFF *tiff, int16_t *max, int16_t *min, int *range);
+int settleIngestDecimation(jobsurvey_t *surveys, int num_jobs);
+int surveyJobs(joblist_t *joblist, int scan_ranges, jobsurvey_t **surveys, int *max, int *min);
+void *surveyWorker(void *argt);
+
+#endif
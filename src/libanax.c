@@ -1,3 +1,9 @@
+#include <fcntl.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <geotiff.h>
 #include <limits.h>
 #include <png.h>
@@ -5,26 +11,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 #include <xtiffio.h>
 #include <zlib.h>
 #include "globals.h"
 #include "libanax.h"
+#include "pngwriter.h"
 #include "projections.h"
 #include "anaxcurses.h"
+#include "ingest.h"
+#include "pyramid.h"
+#include "resample.h"
+#include "water.h"
 
 /* DEBUGGING FUNCTIONS */
 
 void SHOW_DATA_AT_POINT(geotiffmap_t *map, int r, int c) {
 	printf("SHOWING DATA AT ROW %i, COL %i\n", r, c);
-	printf("Location: %f°N, %f°E\n", map->data[r][c].latitude, map->data[r][c].longitude);
-	/*printf("Location: %i°%i'%f\"N, %i°%i'%f\"E\n", map->data[r][c].latitude.degree,
-	                                               map->data[r][c].latitude.minute,
-	                                               map->data[r][c].latitude.second,
-	                                               map->data[r][c].longitude.degree,
-	                                               map->data[r][c].longitude.minute,
-	                                               map->data[r][c].longitude.second);*/
-	printf("Elevation: %im\n", (int)map->data[r][c].elevation);
-	printf("Color: [R %i, G %i, B %i, A %f]\n", map->data[r][c].color.r, map->data[r][c].color.g, map->data[r][c].color.b, map->data[r][c].color.a);
+	printf("Location: %f°N, %f°E\n", gtRowToLatitude(&(map->geo), r - MAPFRAME), gtColToLongitude(&(map->geo), c - MAPFRAME));
+	printf("Elevation: %im\n", (int)MAPBUF_ROW(map->elevation, int16_t, r)[c]);
+	if(map->water)
+		printf("Water: %i\n", (int)MAPBUF_ROW(map->water, uint8_t, r)[c]);
+	if(map->relief)
+		printf("Relief: %i\n", (int)MAPBUF_ROW(map->relief, uint8_t, r)[c]);
 }
 
 void SHOW_COLOR_SCHEME(colorscheme_t *colors) {
@@ -40,101 +49,98 @@ void SHOW_COLOR_SCHEME(colorscheme_t *colors) {
 /* END DEBUGGING FUNCTIONS */
 
 
+int allocMap(geotiffmap_t **map, int height, int width) {
+	*map = calloc(1, sizeof(geotiffmap_t));
+	if(*map == NULL)
+		return ANAX_ERR_NO_MEMORY;
+	(*map)->height = height;
+	(*map)->width = width;
+	(*map)->decimation = 1;
+
+	return allocMapBuffer(&((*map)->elevation), height, width, MAPFRAME, sizeof(int16_t));
+}
+
+
 int initMap(geotiffmap_t **map, TIFF *tiff, char *srcfile, int suppress_output, frame_coords_t *frame) {
 	int err;
 	
 	// Load GTIF type from TIFF
+	*map = NULL;
 	GTIF *geotiff = GTIFNew(tiff);
-
-	// Allocate main map struct
-	*map = malloc(sizeof(geotiffmap_t));
-
-	// Get GeoTIFF file name
-	char *name = strrchr(srcfile, '/');
-	if(name == NULL) {
-		(*map)->name = calloc(strlen(srcfile) + 1, sizeof(char));
-		memcpy((*map)->name, srcfile, strlen(srcfile));
-	} else {
-		(*map)->name = calloc(strlen(name), sizeof(char));
-		memcpy((*map)->name, name + 1, strlen(name) - 1);
+	if(geotiff == NULL)
+		return ANAX_ERR_INVALID_HEADER;
+
+	// Get dimensions of the map, which is smaller than the GeoTIFF file when
+	// decimating
+	ingestplan_t plan;
+	err = planIngest(tiff, &plan);
+	if(err) {
+		GTIFFree(geotiff);
+		return err;
 	}
 
-	// Get dimensions of GeoTIFF file
-	TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &((*map)->width));
-	TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &((*map)->height));
-	
-	// Get the pixel scale
-	// (These values indicate degrees per pixel. For instance, a value of
-	//  0.00028 means the distance between two pixels is 0.00028 degrees, which
-	//  at the equator is approximately 30 meters)
+	// Set up the georeferencing from the coordinates of the top-left pixel
+	// (These pixel scale values indicate degrees per pixel. For instance, a
+	//  value of 0.00028 means the distance between two pixels is 0.00028
+	//  degrees, which at the equator is approximately 30 meters)
 	double *pixelscale;
 	int count;
-    TIFFGetField(tiff, TIFFTAG_GEOPIXELSCALE, &count, &pixelscale);
-    (*map)->horizontal_pixel_scale = pixelscale[0];
-    (*map)->vertical_pixel_scale = pixelscale[1];
-	
-	// Get the coordinates of each corner
-	double left_lon, right_lon, top_lat, bottom_lat;
-	double change_in_lon, change_in_lat;
-	double x, y;
-	x = 0.0;
-	y = 0.0;
+	TIFFGetField(tiff, TIFFTAG_GEOPIXELSCALE, &count, &pixelscale);
+	double x = plan.offset;
+	double y = plan.offset;
 	GTIFImageToPCS(geotiff, &x, &y);
-	left_lon = x;
-	top_lat = y;
-	x = (double)((*map)->width - 1);
-	y = (double)((*map)->height - 1);
-	GTIFImageToPCS(geotiff, &x, &y);
-	right_lon = x;
-	bottom_lat = y;
-	change_in_lon = right_lon - left_lon;
-	change_in_lat = top_lat - bottom_lat;
+	geotransform_t geo;
+	geo.projection = PROJ_EQUIRECTANGULAR;
+	geo.origin_x = x;
+	geo.step_x = pixelscale[0] * plan.factor;
+	geo.origin_y = y;
+	geo.step_y = -pixelscale[1] * plan.factor;
+	geo.radius = 0;
+	
+	// With a region of interest, only read the part of the map around it
+	windowIngestPlan(&plan, &geo);
 
 	// Allocate enough memory for the entire map struct
-    // (This is all done all at once to help ensure there won't be any out-of-memory
+	// (This is all done all at once to help ensure there won't be any out-of-memory
 	// errors after processing has already begun)
-	(*map)->data = calloc(((*map)->height + (2 * MAPFRAME)), sizeof(point_t *));
-	for(int i = 0; i < (*map)->height + (2 * MAPFRAME); i++) {
-		(*map)->data[i] = calloc(((*map)->width + (2 * MAPFRAME)), sizeof(point_t));
-		if((*map)->data[i] == NULL)
-			return ANAX_ERR_NO_MEMORY;
+	err = allocMap(map, plan.height, plan.width);
+	if(err) {
+		if(*map)
+			freeMap(*map);
+		*map = NULL;
+		GTIFFree(geotiff);
+		return err;
 	}
+	(*map)->decimation = plan.factor;
+	(*map)->horizontal_pixel_scale = pixelscale[0] * plan.factor;
+	(*map)->vertical_pixel_scale = pixelscale[1] * plan.factor;
+	(*map)->geo = geo;
 
-	// Scan GeoTIFF file for topological information and store it
-	int line_byte_size = TIFFScanlineSize(tiff);
-	(*map)->max_elevation = INT16_MIN;
-	(*map)->min_elevation = INT16_MAX;
-	union {
-		tdata_t buf[line_byte_size];
-		int16_t data[(*map)->width];
-	} tiff_line;
-
-	for(int row = 0; row < (*map)->height; row++) {
-		err = TIFFReadScanline(tiff, &(tiff_line.buf), row, 0);
-		if(err != 1)
-			return ANAX_ERR_TIFF_SCANLINE;
-		double lat = bottom_lat + change_in_lat * (1.0 - ((double)row / ((double)((*map)->height) - 1.0)));
-		for(int col = 0; col < (*map)->width; col++) {
-			(*map)->data[row + MAPFRAME][col + MAPFRAME].elevation = tiff_line.data[col];
-			if((*map)->data[row + MAPFRAME][col + MAPFRAME].elevation > (*map)->max_elevation) {
-				(*map)->max_elevation = (*map)->data[row + MAPFRAME][col + MAPFRAME].elevation;
-			}
-			if((*map)->data[row + MAPFRAME][col + MAPFRAME].elevation < (*map)->min_elevation) {
-				(*map)->min_elevation = (*map)->data[row + MAPFRAME][col + MAPFRAME].elevation;
-			}
-            (*map)->data[row + MAPFRAME][col + MAPFRAME].latitude = lat;
-            (*map)->data[row + MAPFRAME][col + MAPFRAME].longitude = left_lon + change_in_lon * ((double)col / ((double)((*map)->width) - 1.0));
-		}
+	// Get GeoTIFF file name
+	char *name = strrchr(srcfile, '/');
+	if(name == NULL) {
+		(*map)->name = calloc(strlen(srcfile) + 1, sizeof(char));
+		memcpy((*map)->name, srcfile, strlen(srcfile));
+	} else {
+		(*map)->name = calloc(strlen(name), sizeof(char));
+		memcpy((*map)->name, name + 1, strlen(name) - 1);
 	}
 
+	// Decode the GeoTIFF raster into the elevation plane, recording the
+	// elevation extremes as it goes
+	err = readElevationData(*map, tiff, &plan);
     GTIFFree(geotiff);
+	if(err) {
+		free((*map)->name);
+		freeMap(*map);
+		*map = NULL;
+		return err;
+	}
 	
 	// Set frame coordinates
 	// This code divides the frame into eight portions (N, S, E, W, NE, SE, SW, NW) and identifies
 	// what the coordinates of the midpoint of each section would be.
-	point_t *midpoint = &((*map)->data[(*map)->height / 2 + MAPFRAME][(*map)->width / 2 + MAPFRAME]);
-	double lat_step = (*map)->data[MAPFRAME][MAPFRAME].latitude - (*map)->data[MAPFRAME + 1][MAPFRAME + 1].latitude;
-	double lon_step = (*map)->data[MAPFRAME + 1][MAPFRAME + 1].longitude - (*map)->data[MAPFRAME][MAPFRAME].longitude;
+	geotransform_t *gt = &((*map)->geo);
 	frame->N_set = 0;
 	frame->S_set = 0;
 	frame->E_set = 0;
@@ -143,12 +149,12 @@ int initMap(geotiffmap_t **map, TIFF *tiff, char *srcfile, int suppress_output,
 	frame->SE_set = 0;
 	frame->SW_set = 0;
 	frame->NW_set = 0;
-	frame->north_lat = (*map)->data[MAPFRAME][(*map)->width / 2 + MAPFRAME].latitude + ((MAPFRAME / 2.0) * lat_step);
-	frame->south_lat = (*map)->data[(*map)->height + MAPFRAME - 1][(*map)->width / 2 + MAPFRAME].latitude - ((MAPFRAME / 2.0) * lat_step);
-	frame->mid_lat = midpoint->latitude;
-	frame->west_lon = (*map)->data[(*map)->height / 2 + MAPFRAME][MAPFRAME].longitude - ((MAPFRAME / 2.0) * lon_step);
-	frame->east_lon = (*map)->data[(*map)->height / 2 + MAPFRAME][(*map)->width + MAPFRAME - 1].longitude + ((MAPFRAME / 2.0) * lon_step);
-	frame->mid_lon = midpoint->longitude;
+	frame->north_lat = gtRowToLatitude(gt, -(MAPFRAME / 2.0));
+	frame->south_lat = gtRowToLatitude(gt, ((*map)->height - 1) + (MAPFRAME / 2.0));
+	frame->mid_lat = gtRowToLatitude(gt, (*map)->height / 2);
+	frame->west_lon = gtColToLongitude(gt, -(MAPFRAME / 2.0));
+	frame->east_lon = gtColToLongitude(gt, ((*map)->width - 1) + (MAPFRAME / 2.0));
+	frame->mid_lon = gtColToLongitude(gt, (*map)->width / 2);
 
 	// if(!suppress_output)
 	//  printGeotiffInfo(*map, tiff);
@@ -159,7 +165,9 @@ int setDefaultColors(geotiffmap_t *map, colorscheme_t **colorscheme, int isAbsol
 	int16_t min = (map == NULL) ? 0 : map->min_elevation;
 	int16_t max = (map == NULL) ? 0 : map->max_elevation;
 	
-	*colorscheme = malloc(sizeof(colorscheme_t));
+	*colorscheme = calloc(1, sizeof(colorscheme_t));
+	if(!*colorscheme)
+	    return ANAX_ERR_NO_MEMORY;
 	(*colorscheme)->isAbsolute = isAbsolute;
 	(*colorscheme)->num_stops = 2;
 	(*colorscheme)->colors = calloc(4, sizeof(colorstop_t));
@@ -184,14 +192,14 @@ int setDefaultColors(geotiffmap_t *map, colorscheme_t **colorscheme, int isAbsol
 	(*colorscheme)->colors[3].color.b = 255;
 	(*colorscheme)->colors[3].color.a = 1.0;
 
-	return 0;
+	return compileColorScheme(*colorscheme);
 }
 
 int loadColorScheme(geotiffmap_t *map, colorscheme_t **colorscheme, char *colorfile, int wflag) {
     FILE *fp = fopen(colorfile, "r");
     if(!fp)
         return ANAX_ERR_FILE_DOES_NOT_EXIST;
-    *colorscheme = malloc(sizeof(colorscheme_t));
+    *colorscheme = calloc(1, sizeof(colorscheme_t));
     if(!*colorscheme)
         return ANAX_ERR_NO_MEMORY;
 
@@ -286,7 +294,7 @@ int loadColorScheme(geotiffmap_t *map, colorscheme_t **colorscheme, char *colorf
 
     // SHOW_COLOR_SCHEME(*colorscheme);
 
-	return 0;
+	return compileColorScheme(*colorscheme);
 }
 
 int setRelativeElevations(colorscheme_t *colorscheme, int16_t max, int16_t min) {
@@ -298,48 +306,73 @@ int setRelativeElevations(colorscheme_t *colorscheme, int16_t max, int16_t min)
     colorscheme->colors[0].elevation = colorscheme->colors[1].elevation;
     colorscheme->colors[colorscheme->num_stops + 1].elevation = colorscheme->colors[colorscheme->num_stops].elevation;
     
-    return 0;
+    return compileColorScheme(colorscheme);
 }
 
-int findWater(geotiffmap_t *map) {
-    // Pass 1: Flag any point surrounded by points of equal elevation as water
-    for(int i = 1; i < map->height + (2 * MAPFRAME) - 1; i++) {
-        for(int j = 1; j < map->width + (2 * MAPFRAME) - 1; j++) {
-            int16_t e = map->data[i][j].elevation;
-            if(map->data[i - 1][j - 1].elevation == e &&
-               map->data[i - 1][j].elevation == e &&
-               map->data[i - 1][j + 1].elevation == e &&
-               map->data[i][j - 1].elevation == e &&
-               map->data[i][j + 1].elevation == e &&
-               map->data[i + 1][j - 1].elevation == e &&
-               map->data[i + 1][j].elevation == e &&
-               map->data[i + 1][j + 1].elevation == e) {
-                map->data[i][j].isWater = 1;
-            }
-        }
+int compileColorScheme(colorscheme_t *colorscheme) {
+    if(!colorscheme->lut) {
+        colorscheme->lut = malloc(COLORSCHEME_LUT_SIZE * sizeof(rgba_t));
+        if(!colorscheme->lut)
+            return ANAX_ERR_NO_MEMORY;
     }
-    
-    // Pass 2: If any point has the same elevation as a neighboring point that is
-    // flagged as water, flag it as well
-    for(int i = 1; i < map->height + (2 * MAPFRAME) - 1; i++) {
-        for(int j = 1; j < map->width + (2 * MAPFRAME) - 1; j++) {
-            int16_t e = map->data[i][j].elevation;
-            if((map->data[i - 1][j - 1].isWater && map->data[i - 1][j - 1].elevation == e) ||
-               (map->data[i - 1][j].isWater && map->data[i - 1][j].elevation == e) ||
-               (map->data[i - 1][j + 1].isWater && map->data[i - 1][j + 1].elevation == e) ||
-               (map->data[i][j - 1].isWater && map->data[i][j - 1].elevation == e) ||
-               (map->data[i][j + 1].isWater && map->data[i][j + 1].elevation == e) ||
-               (map->data[i + 1][j - 1].isWater && map->data[i + 1][j - 1].elevation == e) ||
-               (map->data[i + 1][j].isWater && map->data[i + 1][j].elevation == e) ||
-               (map->data[i + 1][j + 1].isWater && map->data[i + 1][j + 1].elevation == e)) {
-                map->data[i][j].isWater = 1;
-            }
+
+    // Evaluate the stops once for every possible elevation. A pixel's stop is
+    // the last of the leading run of stops at or below its elevation, which
+    // only ever moves forward as the elevation increases.
+    colorstop_t *colors = colorscheme->colors;
+    int stop = 0;
+    for(int e = INT16_MIN; e <= INT16_MAX; e++) {
+        while(stop < colorscheme->num_stops && colors[stop + 1].elevation <= e)
+            stop++;
+        int r = colors[stop].color.r;
+        int g = colors[stop].color.g;
+        int b = colors[stop].color.b;
+        int span = colors[stop + 1].elevation - colors[stop].elevation;
+        if(span > 0) {
+            double percent_of_elevation_change = (double)(e - colors[stop].elevation) / (double)span;
+            r += percent_of_elevation_change * (double)(colors[stop + 1].color.r - colors[stop].color.r);
+            g += percent_of_elevation_change * (double)(colors[stop + 1].color.g - colors[stop].color.g);
+            b += percent_of_elevation_change * (double)(colors[stop + 1].color.b - colors[stop].color.b);
         }
+        rgba_t *color = &(colorscheme->lut[COLORSCHEME_LUT_INDEX(e)]);
+        color->r = (r < 0) ? 0 : ((r > 255) ? 255 : r);
+        color->g = (g < 0) ? 0 : ((g > 255) ? 255 : g);
+        color->b = (b < 0) ? 0 : ((b > 255) ? 255 : b);
+        color->a = 255;
     }
-    
+
+    colorscheme->water_rgba.r = colorscheme->water.color.r;
+    colorscheme->water_rgba.g = colorscheme->water.color.g;
+    colorscheme->water_rgba.b = colorscheme->water.color.b;
+    colorscheme->water_rgba.a = 255;
+
     return 0;
 }
 
+int findWater(geotiffmap_t *map, int min_area, waterboundary_t *boundary) {
+    if(!map->water) {
+        int err = allocMapBuffer(&(map->water), map->height, map->width, MAPFRAME, sizeof(uint8_t));
+        if(err)
+            return err;
+    }
+
+    // Flag every region of equal elevation at least min_area pixels in size.
+    // Given a boundary merged with the neighboring tiles, only the tile's own
+    // pixels are labeled and regions reaching its edges are sized as a whole;
+    // otherwise regions are sized by what is visible through the halo.
+    waterlabels_t *labels;
+    int err = labelFlatRegions(map, boundary ? 0 : MAPFRAME, &labels);
+    if(err)
+        return err;
+    if(boundary)
+        err = applyWaterBoundary(labels, boundary);
+    if(!err)
+        err = flagWater(map, labels, min_area);
+    freeWaterLabels(labels);
+    
+    return err;
+}
+
 int applyProjection(geotiffmap_t **map, int projection) {
     switch(projection) {
         case PROJ_EQUIRECTANGULAR:
@@ -352,121 +385,164 @@ int applyProjection(geotiffmap_t **map, int projection) {
     return 0;
 }
 
-int colorize(geotiffmap_t *map, colorscheme_t *colorscheme) {
-	for(int i = MAPFRAME; i < map->height + MAPFRAME; i++) {
-		for(int j = MAPFRAME; j < map->width + MAPFRAME; j++) {
-		    if(map->data[i][j].isWater) {
-		        map->data[i][j].color.r = colorscheme->water.color.r;
-		        map->data[i][j].color.g = colorscheme->water.color.g;
-		        map->data[i][j].color.b = colorscheme->water.color.b;
-		        map->data[i][j].color.a = 1.0;
-		    } else {
-                int stop = 0;
-                for(int n = 1; n <= colorscheme->num_stops; n++) {
-                    if(colorscheme->colors[n].elevation <= map->data[i][j].elevation) {
-                        stop = n;
-                    } else {
-                        break;
-                    }
-                }
-                double percent_of_elevation_change = (double)(map->data[i][j].elevation - colorscheme->colors[stop].elevation) / (double)(colorscheme->colors[stop + 1].elevation - colorscheme->colors[stop].elevation);
-                map->data[i][j].color.r = colorscheme->colors[stop].color.r + (percent_of_elevation_change * (double)(colorscheme->colors[stop + 1].color.r - colorscheme->colors[stop].color.r));
-                map->data[i][j].color.g = colorscheme->colors[stop].color.g + (percent_of_elevation_change * (double)(colorscheme->colors[stop + 1].color.g - colorscheme->colors[stop].color.g));
-                map->data[i][j].color.b = colorscheme->colors[stop].color.b + (percent_of_elevation_change * (double)(colorscheme->colors[stop + 1].color.b - colorscheme->colors[stop].color.b));
-                map->data[i][j].color.a = 1.0;
-                
-                // Apply relief shading
-                map->data[i][j].color.r -= (map->data[i][j].relief * 16);
-                map->data[i][j].color.g -= (map->data[i][j].relief * 16);
-                map->data[i][j].color.b -= (map->data[i][j].relief * 16);
-                if(map->data[i][j].color.r < 0)
-                    map->data[i][j].color.r = 0;
-                if(map->data[i][j].color.g < 0)
-                    map->data[i][j].color.g = 0;
-                if(map->data[i][j].color.b < 0)
-                    map->data[i][j].color.b = 0;
-            }
-		}
-	}
-
-	return 0;
+// Scales a color channel by a shade in [0, 255], rounding to nearest
+static inline uint8_t applyShade(uint8_t c, uint8_t shade) {
+    unsigned int t = ((unsigned int)c * shade) + 128;
+    return (t + (t >> 8)) >> 8;
 }
 
-int reliefshade(geotiffmap_t *map, int direction) {
-    for(int i = MAPFRAME - 5; i < map->height + MAPFRAME + 5; i++) {
-        for(int j = MAPFRAME - 5; j < map->width + MAPFRAME + 5; j++) {
-            int16_t e = map->data[i][j].elevation;
-            for(int k = 1; k <= 5; k++) {
-                switch(direction) {
-                    case ANAX_MAP_NORTH:
-                        if(map->data[i + k][j].elevation < e) {
-                            map->data[i + k][j].relief++;
-                            e = map->data[i + k][j].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_SOUTH:
-                        if(map->data[i - k][j].elevation < e) {
-                            map->data[i - k][j].relief++;
-                            e = map->data[i - k][j].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_EAST:
-                        if(map->data[i][j - k].elevation < e) {
-                            map->data[i][j - k].relief++;
-                            e = map->data[i][j - k].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_WEST:
-                        if(map->data[i][j + k].elevation < e) {
-                            map->data[i][j + k].relief++;
-                            e = map->data[i][j + k].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_NORTHEAST:
-                        if(map->data[i + k][j - k].elevation < e) {
-                            map->data[i + k][j - k].relief++;
-                            e = map->data[i + k][j - k].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_NORTHWEST:
-                        if(map->data[i + k][j + k].elevation < e) {
-                            map->data[i + k][j + k].relief++;
-                            e = map->data[i + k][j + k].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_SOUTHEAST:
-                        if(map->data[i - k][j - k].elevation < e) {
-                            map->data[i - k][j - k].relief++;
-                            e = map->data[i - k][j - k].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                    case ANAX_MAP_SOUTHWEST:
-                        if(map->data[i - k][j + k].elevation < e) {
-                            map->data[i - k][j + k].relief++;
-                            e = map->data[i - k][j + k].elevation;
-                        } else {
-                            k = 9999;
-                        }
-                        break;
-                }
-            }
+void colorizeRow(colorscheme_t *colorscheme, const int16_t *elevation, const uint8_t *water, const uint8_t *relief, rgba_t *out, int n) {
+    const rgba_t *lut = colorscheme->lut;
+    int j = 0;
+
+#ifdef __AVX2__
+    // Eight pixels at a time: gather the packed colors from the table,
+    // multiply R, G and B by the shade and blend in water
+    uint32_t water_rgba;
+    memcpy(&water_rgba, &(colorscheme->water_rgba), sizeof(uint32_t));
+    __m256i water_px = _mm256_set1_epi32((int)water_rgba);
+    __m256i bias = _mm256_set1_epi32(COLORSCHEME_LUT_INDEX(0));
+    __m256i zero = _mm256_setzero_si256();
+    __m256i rounding = _mm256_set1_epi16(128);
+    for(; j + 8 <= n; j += 8) {
+        __m256i idx = _mm256_add_epi32(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(elevation + j))), bias);
+        __m256i px = _mm256_i32gather_epi32((const int *)lut, idx, 4);
+        if(relief) {
+            // Replicate each shade into R, G and B; alpha is multiplied by 255
+            __m256i level = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(relief + j)));
+            __m256i shade = _mm256_or_si256(_mm256_mullo_epi32(level, _mm256_set1_epi32(0x010101)), _mm256_set1_epi32((int)0xff000000));
+            __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(px, zero), _mm256_unpacklo_epi8(shade, zero)), rounding);
+            __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(px, zero), _mm256_unpackhi_epi8(shade, zero)), rounding);
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8);
+            px = _mm256_packus_epi16(lo, hi);
+        }
+        if(water) {
+            __m256i flag = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(water + j)));
+            px = _mm256_blendv_epi8(px, water_px, _mm256_cmpgt_epi32(flag, zero));
         }
+        _mm256_storeu_si256((__m256i *)(out + j), px);
     }
-    
+#endif
+
+    for(; j < n; j++) {
+        if(water && water[j]) {
+            out[j] = colorscheme->water_rgba;
+            continue;
+        }
+        rgba_t color = lut[COLORSCHEME_LUT_INDEX(elevation[j])];
+        if(relief) {
+            color.r = applyShade(color.r, relief[j]);
+            color.g = applyShade(color.g, relief[j]);
+            color.b = applyShade(color.b, relief[j]);
+        }
+        out[j] = color;
+    }
+}
+
+#ifdef __SSE2__
+// Loads four elevations, sign-extended and converted to float
+static inline __m128 loadElevation4(const int16_t *p) {
+    __m128i v = _mm_loadl_epi64((const __m128i *)p);
+    return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16));
+}
+#endif
+
+// Horn's 3x3 gradient over one row, lit from a unit vector (kx east, ky north,
+// kz up). up, mid and down point at the first output column in the rows above,
+// at and below it; fx and fy convert elevation differences to slopes. The
+// shade is scaled so that flat ground comes out at 255, and slopes facing the
+// light saturate rather than brighten.
+static void hillshadeRow(const int16_t *up, const int16_t *mid, const int16_t *down, uint8_t *out, int n, float fx, float fy, float kx, float ky, float kz, float scale) {
+    int j = 0;
+
+#ifdef __SSE2__
+    __m128 vfx = _mm_set1_ps(fx);
+    __m128 vfy = _mm_set1_ps(fy);
+    __m128 vkx = _mm_set1_ps(kx);
+    __m128 vky = _mm_set1_ps(ky);
+    __m128 vkz = _mm_set1_ps(kz);
+    __m128 vscale = _mm_set1_ps(scale);
+    __m128 one = _mm_set1_ps(1.0f);
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 lo = _mm_setzero_ps();
+    __m128 hi = _mm_set1_ps(255.0f);
+    for(; j + 4 <= n; j += 4) {
+        __m128 a = loadElevation4(up + j - 1);
+        __m128 b = loadElevation4(up + j);
+        __m128 c = loadElevation4(up + j + 1);
+        __m128 d = loadElevation4(mid + j - 1);
+        __m128 f = loadElevation4(mid + j + 1);
+        __m128 g = loadElevation4(down + j - 1);
+        __m128 h = loadElevation4(down + j);
+        __m128 i = loadElevation4(down + j + 1);
+        __m128 p = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(c, _mm_add_ps(f, f)), i), _mm_add_ps(_mm_add_ps(a, _mm_add_ps(d, d)), g)), vfx);
+        __m128 q = _mm_mul_ps(_mm_sub_ps(_mm_add_ps(_mm_add_ps(a, _mm_add_ps(b, b)), c), _mm_add_ps(_mm_add_ps(g, _mm_add_ps(h, h)), i)), vfy);
+        __m128 num = _mm_sub_ps(_mm_sub_ps(vkz, _mm_mul_ps(p, vkx)), _mm_mul_ps(q, vky));
+        __m128 den = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(one, _mm_mul_ps(p, p)), _mm_mul_ps(q, q)));
+        __m128 shade = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_div_ps(num, den), vscale), lo), hi);
+        __m128i v = _mm_cvttps_epi32(_mm_add_ps(shade, half));
+        v = _mm_packus_epi16(_mm_packs_epi32(v, v), v);
+        uint32_t packed = (uint32_t)_mm_cvtsi128_si32(v);
+        memcpy(out + j, &packed, sizeof(uint32_t));
+    }
+#endif
+
+    for(; j < n; j++) {
+        float a = up[j - 1], b = up[j], c = up[j + 1];
+        float d = mid[j - 1], f = mid[j + 1];
+        float g = down[j - 1], h = down[j], i = down[j + 1];
+        float p = (((c + (f + f)) + i) - ((a + (d + d)) + g)) * fx;
+        float q = (((a + (b + b)) + c) - ((g + (h + h)) + i)) * fy;
+        float num = (kz - (p * kx)) - (q * ky);
+        float den = sqrtf((1.0f + (p * p)) + (q * q));
+        float shade = (num / den) * scale;
+        shade = (shade < 0.0f) ? 0.0f : ((shade > 255.0f) ? 255.0f : shade);
+        out[j] = (uint8_t)(shade + 0.5f);
+    }
+}
+
+int reliefshade(geotiffmap_t *map, double azimuth, double altitude) {
+    if(altitude <= 0.0 || altitude > 90.0)
+        return ANAX_ERR_INVALID_INVOCATION;
+    if(!map->relief) {
+        int err = allocMapBuffer(&(map->relief), map->height, map->width, MAPFRAME, sizeof(uint8_t));
+        if(err)
+            return err;
+    }
+
+    // Unit vector toward the light. The azimuth is measured clockwise from
+    // north and the altitude up from the horizon.
+    float kx = cos(rad(altitude)) * sin(rad(azimuth));
+    float ky = cos(rad(altitude)) * cos(rad(azimuth));
+    float kz = sin(rad(altitude));
+    float scale = 255.0 / sin(rad(altitude));
+
+    // Shade everything but the outermost ring of the halo, which has no
+    // neighbors to take a gradient from and is copied in from the next ring
+    int rows = map->height + (2 * MAPFRAME);
+    int cols = map->width + (2 * MAPFRAME);
+    double meters_per_degree = (EARTHCIRCUMFERENCE_KM * 1000.0) / 360.0;
+    for(int i = 1; i < rows - 1; i++) {
+        // Ground distance between pixel centers, which varies with latitude
+        double row = i - MAPFRAME;
+        double lat = gtRowToLatitude(&(map->geo), row);
+        double dy = fabs(gtRowToLatitude(&(map->geo), row - 0.5) - gtRowToLatitude(&(map->geo), row + 0.5)) * meters_per_degree;
+        double dx = fabs(map->geo.step_x * cos(rad(lat))) * meters_per_degree;
+        dx = (dx < 1e-3) ? 1e-3 : dx;
+        dy = (dy < 1e-3) ? 1e-3 : dy;
+
+        uint8_t *relief = MAPBUF_ROW(map->relief, uint8_t, i);
+        hillshadeRow(MAPBUF_ROW(map->elevation, int16_t, i - 1) + 1,
+                     MAPBUF_ROW(map->elevation, int16_t, i) + 1,
+                     MAPBUF_ROW(map->elevation, int16_t, i + 1) + 1,
+                     relief + 1, cols - 2, 1.0 / (8.0 * dx), 1.0 / (8.0 * dy), kx, ky, kz, scale);
+        relief[0] = relief[1];
+        relief[cols - 1] = relief[cols - 2];
+    }
+    memcpy(MAPBUF_ROW(map->relief, uint8_t, 0), MAPBUF_ROW(map->relief, uint8_t, 1), cols);
+    memcpy(MAPBUF_ROW(map->relief, uint8_t, rows - 1), MAPBUF_ROW(map->relief, uint8_t, rows - 2), cols);
+
     return 0;
 }
 
@@ -482,78 +558,33 @@ void printGeotiffInfo(geotiffmap_t *map, TIFF *tiff) {
 	printf("    Min Elevation: %lim\n", (long) map->min_elevation);
 }
 
-int scaleImage(geotiffmap_t **map, double scale) {
-	// Allocate a new map struct
-	geotiffmap_t *newmap = malloc(sizeof(geotiffmap_t));
-
-	// Calculate the new image size
-	newmap->height = (int)((double)(*map)->height * scale);
-	newmap->width = (int)((double)(*map)->width * scale);
-	
-	// Calculate the step size
-	// (i.e., how many old pixels one new pixel corresponds to)
-	double step_vert = (double)((*map)->height) / (double)(newmap->height);
-	double step_horiz = (double)((*map)->height) / (double)(newmap->height);
-	//int16_t step_vert = (*map)->height / newmap->height;
-	//int16_t step_horiz = (*map)->width / newmap->width;
-	//step_vert += (step_vert % 2 == 0) ? 1 : 0;
-	//step_horiz += (step_horiz % 2 == 0) ? 1 : 0;
-
-	// Allocate enough memory for the entire map struct
-	newmap->data = malloc((newmap->height + (2 * MAPFRAME)) * sizeof(point_t *));
-	for(int i = 0; i < newmap->height + (2 * MAPFRAME); i++) {
-		newmap->data[i] = malloc((newmap->width + (2 * MAPFRAME)) * sizeof(point_t));
-		if(newmap->data[i] == NULL)
-			return ANAX_ERR_NO_MEMORY;
+int scaleImage(geotiffmap_t **map, double scale, int kernel) {
+	// Allocate a new map struct with the new image size
+	geotiffmap_t *newmap;
+	int err = allocMap(&newmap, (int)((double)(*map)->height * scale), (int)((double)(*map)->width * scale));
+	if(err)
+		return err;
+	if((*map)->water) {
+		err = allocMapBuffer(&(newmap->water), newmap->height, newmap->width, MAPFRAME, sizeof(uint8_t));
+		if(err) {
+			freeMap(newmap);
+			return err;
+		}
 	}
-
-	// Create a matrix ('box') that contains all of the old pixels corresponding to one new pixel
-	int16_t box[(int)step_vert][(int)step_horiz];
-
-	// Scale the image
-	for(int r = 0; r < newmap->height; r++) {
-		for(int c = 0; c < newmap->width; c++) {
-			memset(box, 0, step_vert * step_horiz * sizeof(int16_t));
-
-			// Set up the box
-			int16_t box_firstrow = (int)((r * step_vert) - ((step_vert - 1) / 2) + MAPFRAME);
-			int16_t box_firstcol = (int)((c * step_horiz) - ((step_horiz - 1) / 2) + MAPFRAME);
-			long int sum = 0;
-			int cellcount = 0;
-			int watersum = 0;
-			int reliefsum = 0;
-			for(int boxr = 0; boxr < (int)step_vert; boxr++) {
-				for(int boxc = 0; boxc < (int)step_horiz; boxc++) {
-					box[boxr][boxc] = (*map)->data[box_firstrow + boxr][box_firstcol + boxc].elevation;
-					if(box[boxr][boxc] != -9999) {
-					    sum += box[boxr][boxc];
-					    cellcount++;
-					    
-					    watersum += (*map)->data[box_firstrow + boxr][box_firstcol + boxc].isWater;
-					    reliefsum += (*map)->data[box_firstrow + boxr][box_firstcol + boxc].relief;
-					}
-					/*
-					if((box_firstrow + boxr >= 0) && (box_firstcol + boxc >= 0) && (box_firstrow + boxr < (*map)->height) && (box_firstcol + boxc < (*map)->width)) {
-						box[boxr][boxc] = (*map)->data[box_firstrow + boxr][box_firstcol + boxc].elevation;
-						sum += box[boxr][boxc];
-						cellcount++;
-					} else {
-						box[boxr][boxc] = -9999;
-					}
-					*/
-				}
-			}
-
-			// Average the elevation and save the value
-			newmap->data[r + MAPFRAME][c + MAPFRAME].elevation = sum / cellcount;
-			
-			// Determine whether the tile contains more water or land
-			newmap->data[r + MAPFRAME][c + MAPFRAME].isWater = (watersum >= cellcount / 2) ? 1 : 0;
-			
-			// Get the average relief value
-			newmap->data[r + MAPFRAME][c + MAPFRAME].relief = reliefsum / cellcount;
+	if((*map)->relief) {
+		err = allocMapBuffer(&(newmap->relief), newmap->height, newmap->width, MAPFRAME, sizeof(uint8_t));
+		if(err) {
+			freeMap(newmap);
+			return err;
 		}
 	}
+	
+	// Resample the elevation, water and relief planes together
+	err = resampleMap(*map, newmap, kernel);
+	if(err) {
+		freeMap(newmap);
+		return err;
+	}
 
 	// Copy over metadata from the old map struct that has not changed
 	newmap->name = calloc(strlen((*map)->name) + 1, sizeof(char));
@@ -562,6 +593,8 @@ int scaleImage(geotiffmap_t **map, double scale) {
 	newmap->min_elevation = (*map)->min_elevation;
 	newmap->vertical_pixel_scale = (*map)->vertical_pixel_scale;
 	newmap->horizontal_pixel_scale = (*map)->horizontal_pixel_scale;
+	newmap->geo = (*map)->geo;
+	scaleGeotransform(&(newmap->geo), (double)newmap->width / (double)(*map)->width, (double)newmap->height / (double)(*map)->height);
 
 	// Free the old map struct and return the new one
 	freeMap(*map);
@@ -570,192 +603,453 @@ int scaleImage(geotiffmap_t **map, double scale) {
 	return 0;
 }
 
-int renderPNG(geotiffmap_t *map, char *outfile, int suppress_output) {
-	FILE *fp = fopen(outfile, "w");
-	png_structp png_ptr = NULL;
-	png_infop info_ptr = NULL;
-	if(!fp)
-		return ANAX_ERR_NO_MEMORY;
-
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	//png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, (png_voidp) user_error_ptr, user_error_fn, user_warning_fn);
-	if(!png_ptr)
-		return ANAX_ERR_PNG_STRUCT_FAILURE;
-	info_ptr = png_create_info_struct(png_ptr);
-	if(!info_ptr) {
-		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
-		return ANAX_ERR_PNG_STRUCT_FAILURE;
-	}
-	
-	if(setjmp(png_jmpbuf(png_ptr))) {
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(fp);
-		return ANAX_ERR_PNG_STRUCT_FAILURE;
-	}
+void scaleGeotransform(geotransform_t *gt, double scale_x, double scale_y) {
+    // Pixel centers move as well as the spacing between them: the center of new
+    // pixel n lies at old pixel ((n + 0.5) / scale) - 0.5
+    gt->origin_x += gt->step_x * ((0.5 / scale_x) - 0.5);
+    gt->step_x /= scale_x;
+    gt->origin_y += gt->step_y * ((0.5 / scale_y) - 0.5);
+    gt->step_y /= scale_y;
+}
 
-	png_init_io(png_ptr, fp);
-	png_set_write_status_fn(png_ptr, NULL);
-
-	png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-
-	int bit_depth = 8;
-
-	// Set up the PNG header
-	png_set_IHDR(
-			png_ptr,
-			info_ptr,
-			map->width,						// Width of image in pixels
-			map->height,					// Height of image in pixels
-			bit_depth, 						// Color depth of each channel
-			PNG_COLOR_TYPE_RGB_ALPHA, 		// Supported channels
-			PNG_INTERLACE_NONE,				// Interlace type
-			PNG_COMPRESSION_TYPE_DEFAULT,	// Compression type
-			PNG_FILTER_TYPE_DEFAULT			// Filter type
-	);
-	png_write_info(png_ptr, info_ptr);
-
-	if(bit_depth > 8) {
-		png_set_swap(png_ptr);
-	} else if(bit_depth < 8) {
-		png_set_packswap(png_ptr);
-	}
+int renderPNG(geotiffmap_t *map, colorscheme_t *colorscheme, char *outfile, int suppress_output) {
+    if(!colorscheme->lut) {
+        int err = compileColorScheme(colorscheme);
+        if(err)
+            return err;
+    }
 
-	// Flush after every line
-	png_set_flush(png_ptr, 1);
+	pngwriter_t *writer;
+	int err = openPNGWriter(&writer, outfile, map->width, map->height, 0);
+	if(err)
+		return err;
 
 	// Write the PNG
-	double percent_interval = (double)map->height / 100.0;
-	png_byte *row_pointer = calloc(map->width, 4 * (bit_depth / 8));
-	for(int i = MAPFRAME; i < map->height + MAPFRAME; i++) {
-		int pos = 0;
-		for(int j = MAPFRAME; j < map->width + MAPFRAME; j++) {
-			row_pointer[pos] = (char)(map->data[i][j].color.r);
-			row_pointer[pos + 1] = (char)(map->data[i][j].color.g);
-			row_pointer[pos + 2] = (char)(map->data[i][j].color.b);
-			row_pointer[pos + 3] = (char)((int)(map->data[i][j].color.a * 255));
-			pos += 4;
-		}
+	// Each row is colorized straight into the PNG row buffer, whose RGBA8
+	// layout matches rgba_t
+	png_byte *row_pointer = calloc(map->width, 4);
+	if(!row_pointer) {
+		closePNGWriter(writer);
+		return ANAX_ERR_NO_MEMORY;
+	}
+	for(int i = MAPFRAME; i < map->height + MAPFRAME && !err; i++) {
+		int16_t *elev = MAPBUF_ROW(map->elevation, int16_t, i) + MAPFRAME;
+		uint8_t *water = map->water ? MAPBUF_ROW(map->water, uint8_t, i) + MAPFRAME : NULL;
+		uint8_t *relief = map->relief ? MAPBUF_ROW(map->relief, uint8_t, i) + MAPFRAME : NULL;
+		colorizeRow(colorscheme, elev, water, relief, (rgba_t *)row_pointer, map->width);
 
-		png_write_row(png_ptr, row_pointer);
-
-		//if(!suppress_output) {
-		//	if((int)percent_interval > 0) {
-		//		if((i - MAPFRAME) % (int)percent_interval == 0) {
-		//			printf("%i%%\n", (int)((i - MAPFRAME) / percent_interval) + 1);
-		//		}
-		//	} else {
-		//		printf("%i%%\n", ((i - MAPFRAME) * 100) / (int)map->height);
-		//	}
-		//}
+		err = writePNGRow(writer, row_pointer);
 	}
-	png_write_end(png_ptr, NULL);
 	
 	// Free memory
 	free(row_pointer);
-	png_destroy_write_struct(&png_ptr, &info_ptr);
-	
+	int close_err = closePNGWriter(writer);
+	return err ? err : close_err;
+}
 
-	fclose(fp);
-	return 0;
+// Write the colorized map as bare RGBA rows, top to bottom, for stitch to
+// read back without a round trip through deflate
+int renderRGBA(geotiffmap_t *map, colorscheme_t *colorscheme, char *outfile) {
+    if(!colorscheme->lut) {
+        int err = compileColorScheme(colorscheme);
+        if(err)
+            return err;
+    }
+    
+    FILE *fp = fopen(outfile, "w");
+    if(!fp)
+        return ANAX_ERR_NO_MEMORY;
+    rgba_t *row = calloc(map->width, sizeof(rgba_t));
+    if(!row) {
+        fclose(fp);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    
+    int err = 0;
+    for(int i = MAPFRAME; i < map->height + MAPFRAME && !err; i++) {
+        int16_t *elev = MAPBUF_ROW(map->elevation, int16_t, i) + MAPFRAME;
+        uint8_t *water = map->water ? MAPBUF_ROW(map->water, uint8_t, i) + MAPFRAME : NULL;
+        uint8_t *relief = map->relief ? MAPBUF_ROW(map->relief, uint8_t, i) + MAPFRAME : NULL;
+        colorizeRow(colorscheme, elev, water, relief, row, map->width);
+        if(fwrite(row, sizeof(rgba_t), map->width, fp) != map->width)
+            err = ANAX_ERR_COULD_NOT_WRITE;
+    }
+    
+    free(row);
+    if(fclose(fp) && !err)
+        err = ANAX_ERR_COULD_NOT_WRITE;
+    return err;
 }
 
 int getCorners(geotiffmap_t *map, double *top, double *bottom, double *left, double *right) {
-    *top = map->data[MAPFRAME][MAPFRAME].latitude;
-    *left = map->data[MAPFRAME][MAPFRAME].longitude;
-    *bottom = map->data[map->height + MAPFRAME - 1][map->width + MAPFRAME - 1].latitude;
-    *right = map->data[map->height + MAPFRAME - 1][map->width + MAPFRAME - 1].longitude;
+    *top = gtRowToLatitude(&(map->geo), 0);
+    *left = gtColToLongitude(&(map->geo), 0);
+    *bottom = gtRowToLatitude(&(map->geo), map->height - 1);
+    *right = gtColToLongitude(&(map->geo), map->width - 1);
     
     return 0;
 }
 
-int writeMapData(anaxjob_t *current_job, geotiffmap_t *map) {
-    FILE *fp = fopen(current_job->tmpfile, "w+");
+// Get the corners of a GeoTIFF's raster from its header alone
+int getTIFFCorners(TIFF *tiff, double *top, double *bottom, double *left, double *right) {
+    uint32_t width, height;
+    TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+    TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+    GTIF *geotiff = GTIFNew(tiff);
+    if(geotiff == NULL)
+        return ANAX_ERR_INVALID_HEADER;
+    
+    double x = 0;
+    double y = 0;
+    GTIFImageToPCS(geotiff, &x, &y);
+    *left = x;
+    *top = y;
+    x = width - 1;
+    y = height - 1;
+    GTIFImageToPCS(geotiff, &x, &y);
+    *right = x;
+    *bottom = y;
+    GTIFFree(geotiff);
+    
+    return 0;
+}
+
+// Cut a map down to the pixels whose centers lie inside region. This is done
+// after relief shading and water finding, which use the pixels around them.
+// At least one pixel is always kept.
+int cropMap(geotiffmap_t **map, region_t *region) {
+    geotransform_t *gt = &((*map)->geo);
+    int top = (int)ceil(gtLatitudeToRow(gt, region->north) - 1e-6);
+    int bottom = (int)floor(gtLatitudeToRow(gt, region->south) + 1e-6);
+    int left = (int)ceil(gtLongitudeToCol(gt, region->west) - 1e-6);
+    int right = (int)floor(gtLongitudeToCol(gt, region->east) + 1e-6);
+    top = (top < 0) ? 0 : ((top > (*map)->height - 1) ? (*map)->height - 1 : top);
+    bottom = (bottom < top) ? top : ((bottom > (*map)->height - 1) ? (*map)->height - 1 : bottom);
+    left = (left < 0) ? 0 : ((left > (*map)->width - 1) ? (*map)->width - 1 : left);
+    right = (right < left) ? left : ((right > (*map)->width - 1) ? (*map)->width - 1 : right);
+    if(top == 0 && left == 0 && bottom == (*map)->height - 1 && right == (*map)->width - 1)
+        return 0;
     
-    uint32_t hdr[4];
-    hdr[0] = (uint32_t)(map->height);
-    hdr[1] = (uint32_t)(map->width);
-    hdr[2] = map->max_elevation;
-    hdr[3] = map->min_elevation;
-    int count = 0;
-    while(count < 4)
-        count += fwrite(hdr, sizeof(uint32_t), 4 - count, fp);
-    while(count < 5)
-        count += fwrite(&(map->vertical_pixel_scale), sizeof(double), 1, fp);
-    while(count < 6)
-        count += fwrite(&(map->horizontal_pixel_scale), sizeof(double), 1, fp);
-
-    int bufsize = map->width + (2 * MAPFRAME);
-    int16_t buf[bufsize];
-    for(int i = 0; i < map->height + (2 * MAPFRAME); i++) {
-        for(int j = 0; j < map->width + (2 * MAPFRAME); j++) {
-            buf[j] = map->data[i][j].elevation;
+    // Allocate a new map struct with the cropped size
+    geotiffmap_t *newmap;
+    int err = allocMap(&newmap, bottom - top + 1, right - left + 1);
+    if(err)
+        return err;
+    if((*map)->water) {
+        err = allocMapBuffer(&(newmap->water), newmap->height, newmap->width, MAPFRAME, sizeof(uint8_t));
+        if(err) {
+            freeMap(newmap);
+            return err;
         }
-        int c = 0;
-        while(c < bufsize) {
-            c += fwrite(buf + c, sizeof(int16_t), bufsize - c, fp);
+    }
+    if((*map)->relief) {
+        err = allocMapBuffer(&(newmap->relief), newmap->height, newmap->width, MAPFRAME, sizeof(uint8_t));
+        if(err) {
+            freeMap(newmap);
+            return err;
+        }
+    }
+    
+    // Copy the rows of each plane inside the region
+    mapbuf_t *src[3] = {(*map)->elevation, (*map)->water, (*map)->relief};
+    mapbuf_t *dst[3] = {newmap->elevation, newmap->water, newmap->relief};
+    for(int p = 0; p < 3; p++) {
+        if(!src[p])
+            continue;
+        for(int r = 0; r < newmap->height; r++) {
+            memcpy(MAPBUF_ROW(dst[p], uint8_t, r + MAPFRAME) + (MAPFRAME * dst[p]->elem_size),
+                   MAPBUF_ROW(src[p], uint8_t, top + r + MAPFRAME) + ((left + MAPFRAME) * src[p]->elem_size),
+                   newmap->width * dst[p]->elem_size);
         }
     }
     
-    fclose(fp);
+    // Copy over the metadata, moving the origin to the first pixel kept
+    newmap->name = calloc(strlen((*map)->name) + 1, sizeof(char));
+    strncpy(newmap->name, (*map)->name, strlen((*map)->name));
+    newmap->max_elevation = (*map)->max_elevation;
+    newmap->min_elevation = (*map)->min_elevation;
+    newmap->vertical_pixel_scale = (*map)->vertical_pixel_scale;
+    newmap->horizontal_pixel_scale = (*map)->horizontal_pixel_scale;
+    newmap->decimation = (*map)->decimation;
+    newmap->geo = (*map)->geo;
+    newmap->geo.origin_x += left * newmap->geo.step_x;
+    newmap->geo.origin_y += top * newmap->geo.step_y;
+    
+    freeMap(*map);
+    *map = newmap;
     
     return 0;
 }
 
-int readMapData(anaxjob_t *current_job, geotiffmap_t **map) {
-    FILE *fp = fopen(current_job->tmpfile, "r");
+void setScratchHeader(scratch_hdr_t *hdr, anaxjob_t *current_job, geotiffmap_t *map) {
+    frame_coords_t *frame = &(current_job->frame_coordinates);
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    memset(hdr, 0, sizeof(scratch_hdr_t));
+    hdr->magic = SCRATCH_MAGIC;
+    hdr->version = SCRATCH_VERSION;
+    hdr->data_offset = ((sizeof(scratch_hdr_t) + pagesize - 1) / pagesize) * pagesize;
+    hdr->height = map->height;
+    hdr->width = map->width;
+    hdr->halo = MAPFRAME;
+    hdr->stride = map->elevation->stride;
+    hdr->max_elevation = map->max_elevation;
+    hdr->min_elevation = map->min_elevation;
+    hdr->halo_set[SCRATCH_HALO_N] = frame->N_set;
+    hdr->halo_set[SCRATCH_HALO_S] = frame->S_set;
+    hdr->halo_set[SCRATCH_HALO_E] = frame->E_set;
+    hdr->halo_set[SCRATCH_HALO_W] = frame->W_set;
+    hdr->halo_set[SCRATCH_HALO_NE] = frame->NE_set;
+    hdr->halo_set[SCRATCH_HALO_SE] = frame->SE_set;
+    hdr->halo_set[SCRATCH_HALO_SW] = frame->SW_set;
+    hdr->halo_set[SCRATCH_HALO_NW] = frame->NW_set;
+    hdr->projection = map->geo.projection;
+    hdr->decimation = map->decimation;
+    hdr->vertical_pixel_scale = map->vertical_pixel_scale;
+    hdr->horizontal_pixel_scale = map->horizontal_pixel_scale;
+    hdr->origin_x = map->geo.origin_x;
+    hdr->step_x = map->geo.step_x;
+    hdr->origin_y = map->geo.origin_y;
+    hdr->step_y = map->geo.step_y;
+    hdr->radius = map->geo.radius;
+    hdr->top = current_job->top_lat;
+    hdr->bottom = current_job->bottom_lat;
+    hdr->left = current_job->left_lon;
+    hdr->right = current_job->right_lon;
+}
 
-	// Allocate main map struct
-	*map = malloc(sizeof(geotiffmap_t));
+int writeMapData(anaxjob_t *current_job, geotiffmap_t *map) {
+    scratch_hdr_t hdr;
+    setScratchHeader(&hdr, current_job, map);
+    
+    // A map read back from its own scratch file is a live mapping of it, so
+    // only the header needs refreshing
+    if(map->elevation->flags & MAPBUF_MAPPED) {
+        int fd = open(current_job->tmpfile, O_RDWR);
+        if(fd < 0)
+            return ANAX_ERR_FILE_DOES_NOT_EXIST;
+        int err = (pwrite(fd, &hdr, sizeof(scratch_hdr_t), 0) == sizeof(scratch_hdr_t)) ? 0 : ANAX_ERR_FILE_DOES_NOT_EXIST;
+        close(fd);
+        return err;
+    }
+    
+    int fd = open(current_job->tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0)
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    
+    // The plane is one contiguous slab, so it goes out in a single run after
+    // the page-aligned header
+    size_t datasize = (size_t)map->elevation->stride * map->elevation->elem_size * map->elevation->rows;
+    int err = 0;
+    if(pwrite(fd, &hdr, sizeof(scratch_hdr_t), 0) != sizeof(scratch_hdr_t))
+        err = ANAX_ERR_FILE_DOES_NOT_EXIST;
+    size_t written = 0;
+    while(!err && written < datasize) {
+        ssize_t res = pwrite(fd, map->elevation->slab + written, datasize - written, hdr.data_offset + written);
+        if(res <= 0)
+            err = ANAX_ERR_FILE_DOES_NOT_EXIST;
+        else
+            written += res;
+    }
+    close(fd);
+    
+    return err;
+}
 
-    // Load data into main map struct
-    uint32_t hdr[4];
-    fread(hdr, sizeof(uint32_t), 4, fp);
+int readScratchHeader(int fd, scratch_hdr_t *hdr) {
+    if(pread(fd, hdr, sizeof(scratch_hdr_t), 0) != sizeof(scratch_hdr_t))
+        return ANAX_ERR_INVALID_HEADER;
+    if(hdr->magic != SCRATCH_MAGIC || hdr->version != SCRATCH_VERSION)
+        return ANAX_ERR_INVALID_HEADER;
+    if(hdr->halo != MAPFRAME || hdr->stride != (uint32_t)getMapBufferStride(hdr->width, MAPFRAME, sizeof(int16_t)))
+        return ANAX_ERR_INVALID_HEADER;
+    return 0;
+}
+
+int readMapData(anaxjob_t *current_job, geotiffmap_t **map) {
+    int fd = open(current_job->tmpfile, O_RDWR);
+    if(fd < 0)
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    
+    scratch_hdr_t hdr;
+    int err = readScratchHeader(fd, &hdr);
+    if(err) {
+        close(fd);
+        return err;
+    }
+    
+    // Set up the map struct around a shared mapping of the elevation plane
+    *map = calloc(1, sizeof(geotiffmap_t));
+    if(*map == NULL) {
+        close(fd);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    err = mapMapBuffer(&((*map)->elevation), fd, hdr.data_offset, hdr.height, hdr.width, MAPFRAME, sizeof(int16_t));
+    close(fd);
+    if(err) {
+        free(*map);
+        *map = NULL;
+        return err;
+    }
     (*map)->name = current_job->name;
-    (*map)->height = hdr[0];
-    (*map)->width = hdr[1];
-    (*map)->max_elevation = (int16_t)hdr[2];
-    (*map)->min_elevation = (int16_t)hdr[3];
-    fread(&((*map)->vertical_pixel_scale), sizeof(double), 1, fp);
-    fread(&((*map)->horizontal_pixel_scale), sizeof(double), 1, fp);
-
-    // Allocate map data array
-	(*map)->data = malloc(((*map)->height + (2 * MAPFRAME)) * sizeof(point_t *));
-	if((*map)->data == NULL) {
-	    printf("Height: %i\n", (*map)->height + (2 * MAPFRAME));
-	    return ANAX_ERR_NO_MEMORY;    
-	}
-	for(int i = 0; i < (*map)->height + (2 * MAPFRAME); i++) {
-		(*map)->data[i] = malloc(((*map)->width + (2 * MAPFRAME)) * sizeof(point_t));
-		if((*map)->data[i] == NULL) {
-		    printf("Width: %i\n", (*map)->width + (2 * MAPFRAME));
-			return ANAX_ERR_NO_MEMORY;
-		}
-	}
-	
-	// Read map data from the file and store it
-	int bufsize = (*map)->width + (2 * MAPFRAME);
-	int16_t buf[bufsize];
-	for(int i = 0; i < (*map)->height + (2 * MAPFRAME); i++) {
-	    int c = 0;
-	    while(c < bufsize) {
-    	    c += fread(buf, sizeof(int16_t), bufsize - c, fp);
-    	}
-	    for(int j = 0; j < (*map)->width + (2 * MAPFRAME); j++) {
-	        //fread(buf, sizeof(int16_t), bufsize, fp);
-	        (*map)->data[i][j].elevation = buf[j];
-	    }
-	}
-	
-	fclose(fp);
+    (*map)->height = hdr.height;
+    (*map)->width = hdr.width;
+    (*map)->max_elevation = hdr.max_elevation;
+    (*map)->min_elevation = hdr.min_elevation;
+    (*map)->vertical_pixel_scale = hdr.vertical_pixel_scale;
+    (*map)->horizontal_pixel_scale = hdr.horizontal_pixel_scale;
+    (*map)->decimation = hdr.decimation;
+    (*map)->geo.projection = hdr.projection;
+    (*map)->geo.origin_x = hdr.origin_x;
+    (*map)->geo.step_x = hdr.step_x;
+    (*map)->geo.origin_y = hdr.origin_y;
+    (*map)->geo.step_y = hdr.step_y;
+    (*map)->geo.radius = hdr.radius;
 	
 	return 0;
 }
 
-void freeMap(geotiffmap_t *map) {
-    for(int i = 0; i < map->height + (2 * MAPFRAME); i++) {
-        free(map->data[i]);
+int readMapRegion(int fd, scratch_hdr_t *hdr, int row, int col, int nrows, int ncols, int16_t *dst, int dst_stride) {
+    // Rows of the block are stride elements apart in the file, so each one is
+    // fetched with its own pread straight into the destination row
+    for(int r = 0; r < nrows; r++) {
+        off_t offset = hdr->data_offset + ((((off_t)(row + r) * hdr->stride) + col) * (off_t)sizeof(int16_t));
+        size_t size = ncols * sizeof(int16_t);
+        size_t done = 0;
+        while(done < size) {
+            ssize_t res = pread(fd, (uint8_t *)(dst + ((size_t)r * dst_stride)) + done, size - done, offset + done);
+            if(res <= 0)
+                return ANAX_ERR_FILE_DOES_NOT_EXIST;
+            done += res;
+        }
+    }
+    
+    return 0;
+}
+
+int readMapEdge(anaxjob_t *job, int part, int16_t *dst, int dst_stride, int max_rows, int max_cols, int *nrows, int *ncols) {
+    int fd = open(job->tmpfile, O_RDONLY);
+    if(fd < 0)
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    
+    scratch_hdr_t hdr;
+    int err = readScratchHeader(fd, &hdr);
+    if(err) {
+        close(fd);
+        return err;
     }
-    free(map->data);
+    
+    // Locate the block within the plane
+    int row = MAPFRAME;
+    int col = MAPFRAME;
+    int rows = hdr.height;
+    int cols = hdr.width;
+    switch(part) {
+        case ANAX_MAP_NORTH:
+            rows = MAPFRAME;
+            break;
+        case ANAX_MAP_SOUTH:
+            row = hdr.height;
+            rows = MAPFRAME;
+            break;
+        case ANAX_MAP_EAST:
+            col = hdr.width;
+            cols = MAPFRAME;
+            break;
+        case ANAX_MAP_WEST:
+            cols = MAPFRAME;
+            break;
+        case ANAX_MAP_NORTHEAST:
+            col = hdr.width;
+            rows = MAPFRAME;
+            cols = MAPFRAME;
+            break;
+        case ANAX_MAP_SOUTHEAST:
+            row = hdr.height;
+            col = hdr.width;
+            rows = MAPFRAME;
+            cols = MAPFRAME;
+            break;
+        case ANAX_MAP_SOUTHWEST:
+            row = hdr.height;
+            rows = MAPFRAME;
+            cols = MAPFRAME;
+            break;
+        case ANAX_MAP_NORTHWEST:
+            rows = MAPFRAME;
+            cols = MAPFRAME;
+            break;
+    }
+    rows = (rows > max_rows) ? max_rows : rows;
+    cols = (cols > max_cols) ? max_cols : cols;
+    if(nrows)
+        *nrows = rows;
+    if(ncols)
+        *ncols = cols;
+    
+    if(dst)
+        err = readMapRegion(fd, &hdr, row, col, rows, cols, dst, dst_stride);
+    close(fd);
+    
+    return err;
+}
+
+// Locate the halo region of a map on the given side, in plane coordinates
+int getHaloRegion(geotiffmap_t *map, int direction, int *row, int *col, int *nrows, int *ncols) {
+    *row = MAPFRAME;
+    *col = MAPFRAME;
+    *nrows = map->height;
+    *ncols = map->width;
+    switch(direction) {
+        case ANAX_MAP_NORTH:
+            *row = 0;
+            *nrows = MAPFRAME;
+            break;
+        case ANAX_MAP_SOUTH:
+            *row = map->height + MAPFRAME;
+            *nrows = MAPFRAME;
+            break;
+        case ANAX_MAP_EAST:
+            *col = map->width + MAPFRAME;
+            *ncols = MAPFRAME;
+            break;
+        case ANAX_MAP_WEST:
+            *col = 0;
+            *ncols = MAPFRAME;
+            break;
+        case ANAX_MAP_NORTHEAST:
+            *row = 0;
+            *col = map->width + MAPFRAME;
+            *nrows = MAPFRAME;
+            *ncols = MAPFRAME;
+            break;
+        case ANAX_MAP_SOUTHEAST:
+            *row = map->height + MAPFRAME;
+            *col = map->width + MAPFRAME;
+            *nrows = MAPFRAME;
+            *ncols = MAPFRAME;
+            break;
+        case ANAX_MAP_SOUTHWEST:
+            *row = map->height + MAPFRAME;
+            *col = 0;
+            *nrows = MAPFRAME;
+            *ncols = MAPFRAME;
+            break;
+        case ANAX_MAP_NORTHWEST:
+            *row = 0;
+            *col = 0;
+            *nrows = MAPFRAME;
+            *ncols = MAPFRAME;
+            break;
+    }
+    
+    return 0;
+}
+
+void freeMap(geotiffmap_t *map) {
+    freeMapBuffer(map->elevation);
+    freeMapBuffer(map->water);
+    freeMapBuffer(map->relief);
     free(map);
 }
 
@@ -774,14 +1068,208 @@ int finalizeLocalJobs(joblist_t *joblist) {
     return 0;
 }
 
-int stitch(tilelist_t *tilelist, char *outfile, uilist_t *uilist) {
-    // Open outfile
-	FILE *out = fopen(outfile, "w");
-	png_structp png_ptr = NULL;
-	png_infop info_ptr = NULL;
-	if(!out)
-		return ANAX_ERR_NO_MEMORY;
+// Drop the jobs whose rasters lie wholly outside region, reading only their
+// headers, and number the rest again in order. Rasters outside region but
+// within the halo of a tile inside it are kept to fill that halo, and are
+// left out of the output by dropRegionHaloTiles. Files that cannot be opened
+// are kept, so that they are reported when they are loaded.
+int selectRegionJobs(joblist_t *joblist, region_t *region) {
+    int kept = 0;
+    for(int i = 0; i < joblist->num_jobs; i++) {
+        int inside = 1;
+        TIFF *tiff = XTIFFOpen(joblist->jobs[i].name, "r");
+        if(tiff) {
+            double top, bottom, left, right;
+            if(!getTIFFCorners(tiff, &top, &bottom, &left, &right)) {
+                uint32_t width, height;
+                TIFFGetField(tiff, TIFFTAG_IMAGEWIDTH, &width);
+                TIFFGetField(tiff, TIFFTAG_IMAGELENGTH, &height);
+                double reach = (MAPFRAME + 1) * getIngestDecimation();
+                double margin_x = (width > 1) ? reach * fabs(right - left) / (width - 1) : 0.0;
+                double margin_y = (height > 1) ? reach * fabs(top - bottom) / (height - 1) : 0.0;
+                inside = !(left - margin_x > region->east || right + margin_x < region->west ||
+                           bottom - margin_y > region->north || top + margin_y < region->south);
+            }
+            XTIFFClose(tiff);
+        }
+        
+        if(inside) {
+            if(kept != i)
+                joblist->jobs[kept] = joblist->jobs[i];
+            joblist->jobs[kept].index = kept;
+            kept++;
+        } else {
+            free(joblist->jobs[i].name);
+        }
+    }
+    joblist->num_jobs = kept;
+    
+    return 0;
+}
+
+// Drop the tiles that were only kept by selectRegionJobs to fill their
+// neighbours' halos. Their renders keep the one pixel cropMap always leaves,
+// which lies outside region.
+int dropRegionHaloTiles(tilelist_t *tilelist, region_t *region) {
+    int kept = 0;
+    for(int i = 0; i < tilelist->num_tiles; i++) {
+        tile_t *tile = &(tilelist->tiles[i]);
+        if(tile->north < region->south - 1e-9 || tile->south > region->north + 1e-9 ||
+           tile->east < region->west - 1e-9 || tile->west > region->east + 1e-9) {
+            free(tile->name);
+            continue;
+        }
+        if(kept != i)
+            tilelist->tiles[kept] = *tile;
+        kept++;
+    }
+    tilelist->num_tiles = kept;
+    
+    return 0;
+}
+
+static int compareTilesWest(const void *a, const void *b) {
+    const tile_t *ta = *(tile_t * const *)a;
+    const tile_t *tb = *(tile_t * const *)b;
+    return (ta->west > tb->west) - (ta->west < tb->west);
+}
+
+static int compareTilesNorth(const void *a, const void *b) {
+    const tile_t *ta = *(tile_t * const *)a;
+    const tile_t *tb = *(tile_t * const *)b;
+    return (ta->north < tb->north) - (ta->north > tb->north);
+}
+
+static int compareTilesLeft(const void *a, const void *b) {
+    return (*(tile_t * const *)a)->left_col - (*(tile_t * const *)b)->left_col;
+}
+
+static int compareInts(const void *a, const void *b) {
+    return (*(const int *)a > *(const int *)b) - (*(const int *)a < *(const int *)b);
+}
+
+// Place tiles along one axis, given sorted from west to east (or north to
+// south). Tiles whose first pixel centers lie within half a pixel of each
+// other share a column (or row) of the image, as wide as the widest of
+// them. Neighbouring columns are packed together, so edges shared between
+// tiles are kept twice as before; a gap of whole pixels between them is left
+// blank. Returns the length of the axis in pixels.
+static int layoutTileAxis(tile_t **sorted, int num_tiles, int horizontal) {
+    int pxl = 0;
+    double prev_trail = 0.0;
+    for(int i = 0; i < num_tiles; ) {
+        tile_t *first = sorted[i];
+        double lead = horizontal ? first->west : -first->north;
+        int size = horizontal ? first->img_width : first->img_height;
+        double trail = horizontal ? first->east : -first->south;
+        double step = (size > 1) ? (trail - lead) / (size - 1) : 0.0;
+        if(i > 0 && step > 0.0) {
+            long gap = lround((lead - prev_trail) / step) - 1;
+            if(gap > 0)
+                pxl += gap;
+        }
+        
+        int group_size = 0;
+        prev_trail = -DBL_MAX;
+        for(; i < num_tiles; i++) {
+            tile_t *tile = sorted[i];
+            double tile_lead = horizontal ? tile->west : -tile->north;
+            if(tile != first && fabs(tile_lead - lead) >= step / 2.0)
+                break;
+            size = horizontal ? tile->img_width : tile->img_height;
+            trail = horizontal ? tile->east : -tile->south;
+            if(horizontal) {
+                tile->left_col = pxl;
+                tile->right_col = pxl + size - 1;
+            } else {
+                tile->top_row = pxl;
+                tile->bottom_row = pxl + size - 1;
+            }
+            group_size = (size > group_size) ? size : group_size;
+            prev_trail = (trail > prev_trail) ? trail : prev_trail;
+        }
+        pxl += group_size;
+    }
+    return pxl;
+}
+
+// Index the tiles by the bands of rows they cross. Band edges are wherever
+// a tile starts or ends, so every row of a band has the same tiles.
+static int indexTileBands(tilelist_t *tilelist, tile_t **by_col, int img_height) {
+    free(tilelist->bands);
+    free(tilelist->band_tiles);
+    tilelist->num_bands = 0;
+    tilelist->band_tiles = NULL;
+    
+    int *edges = malloc((2 * tilelist->num_tiles + 2) * sizeof(int));
+    tilelist->bands = malloc((2 * tilelist->num_tiles + 1) * sizeof(tileband_t));
+    if(!edges || !(tilelist->bands)) {
+        free(edges);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    int num_edges = 0;
+    edges[num_edges++] = 0;
+    edges[num_edges++] = img_height;
+    for(int i = 0; i < tilelist->num_tiles; i++) {
+        edges[num_edges++] = tilelist->tiles[i].top_row;
+        edges[num_edges++] = tilelist->tiles[i].bottom_row + 1;
+    }
+    qsort(edges, num_edges, sizeof(int), compareInts);
+    for(int i = 0; i < num_edges - 1; i++) {
+        if(edges[i + 1] == edges[i])
+            continue;
+        tileband_t *band = &(tilelist->bands[tilelist->num_bands++]);
+        band->top_row = edges[i];
+        band->bottom_row = edges[i + 1] - 1;
+        band->num_tiles = 0;
+        band->tiles = NULL;
+    }
+    free(edges);
+    
+    // Count, then fill, each band's tiles in column order
+    int total = 0;
+    for(int i = 0; i < tilelist->num_tiles; i++) {
+        for(int j = findTileBand(tilelist, by_col[i]->top_row); j < tilelist->num_bands && tilelist->bands[j].top_row <= by_col[i]->bottom_row; j++) {
+            tilelist->bands[j].num_tiles++;
+            total++;
+        }
+    }
+    tilelist->band_tiles = malloc((total ? total : 1) * sizeof(tile_t *));
+    if(!(tilelist->band_tiles))
+        return ANAX_ERR_NO_MEMORY;
+    total = 0;
+    for(int j = 0; j < tilelist->num_bands; j++) {
+        tilelist->bands[j].tiles = tilelist->band_tiles + total;
+        total += tilelist->bands[j].num_tiles;
+        tilelist->bands[j].num_tiles = 0;
+    }
+    for(int i = 0; i < tilelist->num_tiles; i++) {
+        for(int j = findTileBand(tilelist, by_col[i]->top_row); j < tilelist->num_bands && tilelist->bands[j].top_row <= by_col[i]->bottom_row; j++)
+            tilelist->bands[j].tiles[tilelist->bands[j].num_tiles++] = by_col[i];
+    }
+    
+    return 0;
+}
+
+// Find the band holding row, or -1
+int findTileBand(tilelist_t *tilelist, int row) {
+    int lo = 0;
+    int hi = tilelist->num_bands - 1;
+    while(lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if(row < tilelist->bands[mid].top_row)
+            hi = mid - 1;
+        else if(row > tilelist->bands[mid].bottom_row)
+            lo = mid + 1;
+        else
+            return mid;
+    }
+    return -1;
+}
 
+// Work out the size of the combined image and where each tile goes in it,
+// from each tile's corners, then index the tiles by row band
+int layoutTiles(tilelist_t *tilelist, int *width, int *height) {
     // Determine combined image periphery
     for(int i = 0; i < tilelist->num_tiles; i++) {
         if(tilelist->tiles[i].north > tilelist->north_lim)
@@ -794,130 +1282,91 @@ int stitch(tilelist_t *tilelist, char *outfile, uilist_t *uilist) {
             tilelist->west_lim = tilelist->tiles[i].west;
     }
     
-    // Get the final image width and height in pixels
-    // (This iterative method is necessary because the tiles may not
-    //  represent a rectangular area; for instance, there may be gaps)
-    int img_height = 0;
-    int img_width = 0;
-    double cur_coord = tilelist->west_lim;
-    while(cur_coord < tilelist->east_lim) {
-        for(int i = 0; i < tilelist->num_tiles; i++) {
-            // TODO: This condition needs to be better; "cur_coord + 0.01" is not very portable
-            if(tilelist->tiles[i].west >= cur_coord && tilelist->tiles[i].west <= cur_coord + 0.01) {
-                img_width += tilelist->tiles[i].img_width;
-                cur_coord = tilelist->tiles[i].east;
-                break;
-            }
-        }
-    }
-    cur_coord = tilelist->south_lim;
-    while(cur_coord < tilelist->north_lim) {
-        for(int i = 0; i < tilelist->num_tiles; i++) {
-            // TODO: This condition needs to be better; "cur_coord + 0.01" is not very portable
-            if(tilelist->tiles[i].south >= cur_coord && tilelist->tiles[i].south <= cur_coord + 0.01) {
-                img_height += tilelist->tiles[i].img_height;
-                cur_coord = tilelist->tiles[i].north;
-                break;
-            }
-        }
-    }
-    
     // Identify the pixel coordinates each tile corresponds to
     // TODO: This currently only works for rectilinear projections
     //   (i.e., projections where all vertical and horizontal lines connect
     //    points of equal longitude or latitude)
-    cur_coord = tilelist->north_lim;
-    int cur_pxl = 0;
-    while(cur_pxl < img_height) {
-        int tile_height;
-        double new_coord;
-        for(int i = 0; i < tilelist->num_tiles; i++) {
-            // TODO: This condition needs to be better; "cur_coord - 0.01" is not very portable
-            if(tilelist->tiles[i].north <= cur_coord && tilelist->tiles[i].north >= cur_coord - 0.01) {
-                tile_height = tilelist->tiles[i].img_height;
-                tilelist->tiles[i].top_row = cur_pxl;
-                tilelist->tiles[i].bottom_row = cur_pxl + tile_height - 1;
-                new_coord = tilelist->tiles[i].south;
-            }
-        }
-        cur_pxl += tile_height;
-        cur_coord = new_coord;
-    }
-    cur_coord = tilelist->west_lim;
-    cur_pxl = 0;
-    while(cur_pxl < img_width) {
-        int tile_width;
-        double new_coord;
-        for(int i = 0; i < tilelist->num_tiles; i++) {
-            // TODO: This condition needs to be better; "cur_coord + 0.01" is not very portable
-            if(tilelist->tiles[i].west >= cur_coord && tilelist->tiles[i].west <= cur_coord + 0.01) {
-                tile_width = tilelist->tiles[i].img_width;
-                tilelist->tiles[i].left_col = cur_pxl;
-                tilelist->tiles[i].right_col = cur_pxl + tile_width - 1;
-                new_coord = tilelist->tiles[i].east;
-            }
-        }
-        cur_pxl += tile_width;
-        cur_coord = new_coord;
+    tile_t **sorted = malloc((tilelist->num_tiles ? tilelist->num_tiles : 1) * sizeof(tile_t *));
+    if(!sorted)
+        return ANAX_ERR_NO_MEMORY;
+    for(int i = 0; i < tilelist->num_tiles; i++)
+        sorted[i] = &(tilelist->tiles[i]);
+    qsort(sorted, tilelist->num_tiles, sizeof(tile_t *), compareTilesWest);
+    *width = layoutTileAxis(sorted, tilelist->num_tiles, 1);
+    qsort(sorted, tilelist->num_tiles, sizeof(tile_t *), compareTilesNorth);
+    *height = layoutTileAxis(sorted, tilelist->num_tiles, 0);
+    
+    qsort(sorted, tilelist->num_tiles, sizeof(tile_t *), compareTilesLeft);
+    int err = indexTileBands(tilelist, sorted, *height);
+    free(sorted);
+    return err;
+}
+
+// Release the reader of a tile, finishing the PNG if it was read to the end
+static void closeStitchTile(tile_t *tile, int finished) {
+    if(!tile->raw) {
+        if(finished)
+            png_read_end(tile->png_ptr, NULL);
+        png_destroy_read_struct(&(tile->png_ptr), &(tile->info_ptr), &(tile->end_info));
     }
+    fclose(tile->fp);
+    tile->fp = NULL;
+    tile->is_open = 0;
+}
+
+int stitch(tilelist_t *tilelist, char *outfile, int pyramid_levels, uilist_t *uilist) {
+    // Lay out the tiles
+    int img_width;
+    int img_height;
+    int err = layoutTiles(tilelist, &img_width, &img_height);
+    if(err)
+        return err;
     
     // Prepare the out PNG for rendering
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if(!png_ptr)
-		return ANAX_ERR_PNG_STRUCT_FAILURE;
-	info_ptr = png_create_info_struct(png_ptr);
-	if(!info_ptr) {
-		png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
-		return ANAX_ERR_PNG_STRUCT_FAILURE;
-	}
+    pngwriter_t *writer;
+    err = openPNGWriter(&writer, outfile, img_width, img_height, 0);
+    if(err)
+        return err;
 	
-	if(setjmp(png_jmpbuf(png_ptr))) {
-		png_destroy_write_struct(&png_ptr, &info_ptr);
-		fclose(out);
-		return ANAX_ERR_PNG_STRUCT_FAILURE;
-	}
-
-	png_init_io(png_ptr, out);
-	png_set_write_status_fn(png_ptr, NULL);
-
-	png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-
-	int bit_depth = 8;
-
-	// Set up the PNG header
-	png_set_IHDR(
-			png_ptr,
-			info_ptr,
-			img_width,						// Width of image in pixels
-			img_height, 					// Height of image in pixels
-			bit_depth, 						// Color depth of each channel
-			PNG_COLOR_TYPE_RGB_ALPHA, 		// Supported channels
-			PNG_INTERLACE_NONE,				// Interlace type
-			PNG_COMPRESSION_TYPE_DEFAULT,	// Compression type
-			PNG_FILTER_TYPE_DEFAULT			// Filter type
-	);
-	png_write_info(png_ptr, info_ptr);
-
-	if(bit_depth > 8) {
-		png_set_swap(png_ptr);
-	} else if(bit_depth < 8) {
-		png_set_packswap(png_ptr);
-	}
-
-	// Flush after every line
-	png_set_flush(png_ptr, 1);
+    // Overview levels are built from the rows as they are written
+    pyramid_t *pyramid = NULL;
+    int pyramid_err = 0;
+    if(pyramid_levels > 0) {
+        pyramid_err = initPyramid(&pyramid, outfile, img_width, img_height, pyramid_levels);
+        if(pyramid_err)
+            pyramid = NULL;
+    }
 	
     // Write the new image
     int y = 0;
     double percent_interval = (double)img_height / 100.0;
-    png_byte *row_pointer = calloc(img_width, 4 * (bit_depth / 8));
-    while(y < img_height) {
+    png_byte *row_pointer = calloc(img_width, 4);
+    if(!row_pointer)
+        err = ANAX_ERR_NO_MEMORY;
+    while(y < img_height && !err) {
         tile_subset_t *tile_subset;
-        getTileRowSubset(tilelist, y, img_width, &tile_subset);
+        err = getTileRowSubset(tilelist, y, img_width, &tile_subset);
+        if(err) {
+            if(tile_subset) {
+                free(tile_subset->refs);
+                free(tile_subset->scratch);
+            }
+            free(tile_subset);
+            break;
+        }
         
         for(int i = 0; i < tile_subset->height; i++) {
             loadRowData(row_pointer, tile_subset, img_width);
-            png_write_row(png_ptr, row_pointer);
+            err = writePNGRow(writer, row_pointer);
+            if(err)
+                break;
+            if(pyramid) {
+                pyramid_err = pushPyramidRow(pyramid, row_pointer);
+                if(pyramid_err) {
+                    freePyramid(pyramid);
+                    pyramid = NULL;
+                }
+            }
             y++;
             
             if(uilist) {
@@ -944,83 +1393,129 @@ int stitch(tilelist_t *tilelist, char *outfile, uilist_t *uilist) {
         */
         }
         
-        // Clean up the tile subset
-        for(int i = 0; i < tile_subset->num_tiles; i++) {
-            if(tile_subset->refs[i].fp != NULL && y == tile_subset->refs[i].tile->bottom_row) {
-                png_read_end(tile_subset->refs[i].png_ptr, NULL);
-                png_destroy_read_struct(&(tile_subset->refs[i].png_ptr), &(tile_subset->refs[i].info_ptr), &(tile_subset->refs[i].end_info));
-                fclose(tile_subset->refs[i].fp);
-            }
+        // Close the tiles that end in this band; the rest carry on below
+        for(int i = 0; i < tile_subset->num_tiles && !err; i++) {
+            tile_t *tile = tile_subset->refs[i].tile;
+            if(tile && tile->is_open && y > tile->bottom_row)
+                closeStitchTile(tile, 1);
         }
         free(tile_subset->refs);
+        free(tile_subset->scratch);
         free(tile_subset);
     }
-    png_write_end(png_ptr, NULL);
-    fclose(out);
+    for(int i = 0; i < tilelist->num_tiles; i++) {
+        if(tilelist->tiles[i].is_open)
+            closeStitchTile(&(tilelist->tiles[i]), 0);
+    }
+    free(row_pointer);
+    int close_err = closePNGWriter(writer);
     
-    return 0;
+    if(pyramid) {
+        if(!err)
+            pyramid_err = finishPyramid(pyramid);
+        freePyramid(pyramid);
+    }
+    
+    if(err)
+        return err;
+    return close_err ? close_err : pyramid_err;
 }
 
+// Gather, in order, the tiles crossing row, with blank runs between them, for
+// the rest of the band holding row. Tiles already open from the band above
+// carry on from where they are; the rest are opened at row.
 int getTileRowSubset(tilelist_t *tilelist, int row, int img_width, tile_subset_t **tile_subset) {
-    int least_height = INT_MAX;
-    
     // Initialize the tile_subset_t
     *tile_subset = malloc(sizeof(tile_subset_t));
+    if(!*tile_subset)
+        return ANAX_ERR_NO_MEMORY;
     (*tile_subset)->num_tiles = 0;
     (*tile_subset)->height = 0;
     (*tile_subset)->refs = NULL;
+    (*tile_subset)->scratch = NULL;
+    
+    int b = findTileBand(tilelist, row);
+    if(b < 0)
+        return ANAX_ERR_NO_MAP;
+    tileband_t *band = &(tilelist->bands[b]);
+    (*tile_subset)->refs = malloc((2 * band->num_tiles + 1) * sizeof(tile_ref_t));
+    if(!(*tile_subset)->refs)
+        return ANAX_ERR_NO_MEMORY;
+    (*tile_subset)->height = band->bottom_row - row + 1;
     
-    // Iterate through the tiles and identify, in order, all of the tiles that contain
-    // part of row
     int col = 0;
-    int last_op_was_null = 0;
-    while(col < img_width) {
-        int match = 0;
-        for(int i = 0; i < tilelist->num_tiles; i++) {
-            if(row >= tilelist->tiles[i].top_row &&
-               row <= tilelist->tiles[i].bottom_row &&
-               col >= tilelist->tiles[i].left_col &&
-               col <= tilelist->tiles[i].right_col) {
-                // TODO: Check for and handle tiles that have already been opened
-                match = 1;
-                (*tile_subset)->num_tiles++;
-                (*tile_subset)->refs = realloc((*tile_subset)->refs, (*tile_subset)->num_tiles * sizeof(tile_ref_t));
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].tile = &(tilelist->tiles[i]);
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].fp = fopen(tilelist->tiles[i].name, "r");
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].info_ptr = png_create_info_struct((*tile_subset)->refs[(*tile_subset)->num_tiles - 1].png_ptr);
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].end_info = png_create_info_struct((*tile_subset)->refs[(*tile_subset)->num_tiles - 1].png_ptr);
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].width = tilelist->tiles[i].img_width;
-                png_init_io((*tile_subset)->refs[(*tile_subset)->num_tiles - 1].png_ptr, (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].fp);
-                png_read_info((*tile_subset)->refs[(*tile_subset)->num_tiles - 1].png_ptr, (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].info_ptr);
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].tile->is_open = 1;
-                least_height = (tilelist->tiles[i].img_height < least_height) ? tilelist->tiles[i].img_height : least_height;
-                last_op_was_null = 0;
-                col = tilelist->tiles[i].right_col + 1;
-                break;
-            }
+    size_t scratch_bytes = 0;
+    for(int i = 0; i <= band->num_tiles; i++) {
+        tile_t *tile = (i < band->num_tiles) ? band->tiles[i] : NULL;
+        int left_col = tile ? tile->left_col : img_width;
+        
+        // Fill any gap before the tile with a NULL ref
+        if(left_col > col) {
+            tile_ref_t *ref = &((*tile_subset)->refs[(*tile_subset)->num_tiles++]);
+            ref->tile = NULL;
+            ref->fp = NULL;
+            ref->skip = 0;
+            ref->width = left_col - col;
+            col = left_col;
+        }
+        if(!tile)
+            continue;
+        if(tile->right_col < col) {
+            // Wholly hidden by the tiles before it here, so its reader would
+            // fall behind; it is opened again where it next shows
+            if(tile->is_open)
+                closeStitchTile(tile, 0);
+            continue;
         }
         
-        // If no match, add a NULL to the refs list
-        // If the match list already ends in a NULL, increment its width
-        if(!match) {
-            if(last_op_was_null) {
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].width++;
-                col++;
-            } else {
-                (*tile_subset)->num_tiles++;
-                (*tile_subset)->refs = realloc((*tile_subset)->refs, (*tile_subset)->num_tiles * sizeof(tile_ref_t));
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].tile = NULL;
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].fp = NULL;
-                (*tile_subset)->refs[(*tile_subset)->num_tiles - 1].width = 1;
-                col++;
-                // TODO: Need check/special protections if the NULL tile actually has the least height
+        if(!tile->is_open) {
+            tile->fp = fopen(tile->name, "r");
+            tile->png_ptr = NULL;
+            tile->info_ptr = NULL;
+            tile->end_info = NULL;
+            if(tile->fp && tile->raw) {
+                // Bare rows can be read from anywhere in the tile
+                fseeko(tile->fp, (off_t)(row - tile->top_row) * tile->img_width * 4, SEEK_SET);
+                tile->is_open = 1;
+            } else if(tile->fp) {
+                tile->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+                tile->info_ptr = png_create_info_struct(tile->png_ptr);
+                tile->end_info = png_create_info_struct(tile->png_ptr);
+                png_init_io(tile->png_ptr, tile->fp);
+                png_read_info(tile->png_ptr, tile->info_ptr);
+                tile->is_open = 1;
+                
+                // A PNG first needed below its top row is read down to row
+                if(row > tile->top_row) {
+                    png_byte *skip = malloc(tile->img_width * 4);
+                    if(!skip)
+                        return ANAX_ERR_NO_MEMORY;
+                    for(int r = tile->top_row; r < row; r++)
+                        png_read_row(tile->png_ptr, skip, NULL);
+                    free(skip);
+                }
             }
-            last_op_was_null = 1;
         }
+        
+        tile_ref_t *ref = &((*tile_subset)->refs[(*tile_subset)->num_tiles++]);
+        ref->tile = tile;
+        ref->fp = tile->fp;
+        ref->png_ptr = tile->png_ptr;
+        ref->info_ptr = tile->info_ptr;
+        ref->end_info = tile->end_info;
+        
+        // A tile overlapping the one before it shows only the rest of its row
+        ref->skip = (left_col < col) ? col - left_col : 0;
+        ref->width = tile->img_width - ref->skip;
+        if(ref->skip && ref->fp && !tile->raw && (size_t)tile->img_width * 4 > scratch_bytes)
+            scratch_bytes = (size_t)tile->img_width * 4;
+        col = tile->right_col + 1;
+    }
+    if(scratch_bytes) {
+        (*tile_subset)->scratch = malloc(scratch_bytes);
+        if(!(*tile_subset)->scratch)
+            return ANAX_ERR_NO_MEMORY;
     }
-    
-    (*tile_subset)->height = least_height;
     
     return 0;
 }
@@ -1028,12 +1523,21 @@ int getTileRowSubset(tilelist_t *tilelist, int row, int img_width, tile_subset_t
 int loadRowData(png_byte *row_ptr, tile_subset_t *tile_subset, int img_width) {
     int offset = 0;
     for(int i = 0; i < tile_subset->num_tiles; i++) {
-        if(tile_subset->refs[i].fp) {
-            png_read_row(tile_subset->refs[i].png_ptr, row_ptr + offset, NULL);
+        tile_ref_t *ref = &(tile_subset->refs[i]);
+        if(ref->fp && ref->tile->raw) {
+            if(ref->skip)
+                fseeko(ref->fp, (off_t)ref->skip * 4, SEEK_CUR);
+            if(fread(row_ptr + offset, 4, ref->width, ref->fp) != ref->width)
+                memset(row_ptr + offset, 0, 4 * ref->width);
+        } else if(ref->fp && ref->skip) {
+            png_read_row(ref->png_ptr, tile_subset->scratch, NULL);
+            memcpy(row_ptr + offset, tile_subset->scratch + (4 * ref->skip), 4 * ref->width);
+        } else if(ref->fp) {
+            png_read_row(ref->png_ptr, row_ptr + offset, NULL);
         } else {
-            memset(row_ptr + offset, 0, 4 * tile_subset->refs[i].width);
+            memset(row_ptr + offset, 0, 4 * ref->width);
         }
-        offset += (4 * tile_subset->refs[i].width);
+        offset += (4 * ref->width);
     }
 
     return 0;
@@ -2,11 +2,13 @@
 #define LIBANAX_H
 
 #include <float.h>
+#include <math.h>
 #include <png.h>
 #include <stdint.h>
 #include <tiffio.h>
 #include "globals.h"
 #include "anaxcurses.h"
+#include "mapbuf.h"
 
 struct color {
 	int r;
@@ -16,16 +18,67 @@ struct color {
 };
 typedef struct color rgb_t;
 
-struct point {
-	int16_t elevation;
-	double latitude;
-	double longitude;
-	uint8_t isWater;
-	uint8_t relief;
-	rgb_t color;
+struct rgba {
+	uint8_t r;
+	uint8_t g;
+	uint8_t b;
+	uint8_t a;
+};
+typedef struct rgba rgba_t;
+
+// Converts between pixel coordinates and geographic coordinates. Rows and
+// columns are relative to the top-left pixel of the map (not including the
+// MAPFRAME halo) and refer to pixel centers. Columns are linear in longitude;
+// rows are linear in latitude, or in Mercator y for PROJ_MERCATOR maps.
+struct geotransform {
+	int projection;
+	double origin_x;    // Longitude of pixel (0, 0)
+	double step_x;      // Degrees of longitude per column
+	double origin_y;    // Latitude (or Mercator y) of pixel (0, 0)
+	double step_y;      // Change in latitude (or Mercator y) per row
+	double radius;      // Earth radius in pixels (PROJ_MERCATOR only)
+};
+typedef struct geotransform geotransform_t;
+
+static inline double gtColToLongitude(const geotransform_t *gt, double col) {
+	return gt->origin_x + (col * gt->step_x);
+}
+
+static inline double gtLongitudeToCol(const geotransform_t *gt, double lon) {
+	return (lon - gt->origin_x) / gt->step_x;
+}
+
+static inline double gtRowToLatitude(const geotransform_t *gt, double row) {
+	double y = gt->origin_y + (row * gt->step_y);
+	if(gt->projection == PROJ_MERCATOR)
+		return atan(sinh(y / gt->radius)) * (180.0 / M_PI);
+	return y;
+}
+
+static inline double gtLatitudeToRow(const geotransform_t *gt, double lat) {
+	double y = lat;
+	if(gt->projection == PROJ_MERCATOR) {
+		double phi = lat * (M_PI / 180.0);
+		y = gt->radius * log((1.0 + sin(phi)) / cos(phi));
+	}
+	return (y - gt->origin_y) / gt->step_y;
+}
+
+// A bounding box in degrees, e.g. the region of interest given with -b
+struct region {
+	double north;
+	double south;
+	double east;
+	double west;
 };
-typedef struct point point_t;
+typedef struct region region_t;
 
+// Raster data is stored as separate planes, each a single slab indexed
+// [row][col] with the MAPFRAME halo included (see MAPBUF_ROW). Only the
+// elevation plane is always present; the water and relief planes are
+// allocated by findWater and reliefshade; relief holds a hillshade from 0
+// (full shadow) to 255 (flat or lit). Colors are never stored; renderPNG and
+// renderRGBA colorize each row as it is written.
 struct geotiff_map {
 	char *name;
 	int height;
@@ -34,7 +87,11 @@ struct geotiff_map {
 	double horizontal_pixel_scale;
 	int16_t max_elevation;
 	int16_t min_elevation;
-	point_t **data;
+	int decimation;     // Source pixels per map pixel along each axis
+	geotransform_t geo;
+	mapbuf_t *elevation;
+	mapbuf_t *water;
+	mapbuf_t *relief;
 };
 typedef struct geotiff_map geotiffmap_t;
 
@@ -44,20 +101,71 @@ struct colorstop {
 };
 typedef struct colorstop colorstop_t;
 
+#define COLORSCHEME_LUT_SIZE            65536
+#define COLORSCHEME_LUT_INDEX(e)        ((int32_t)(e) + 32768)
+
+// The color stops are compiled by compileColorScheme into a lookup table with
+// one packed RGBA entry per int16 elevation. The table must be recompiled
+// whenever the stops change.
 struct colorscheme {
 	int isAbsolute;
 	int showWater;
 	int num_stops;
 	colorstop_t *colors;
 	colorstop_t water;
+	rgba_t *lut;
+	rgba_t water_rgba;
 };
 typedef struct colorscheme colorscheme_t;
 
+// Header of a job's scratch file. The elevation plane follows at data_offset
+// (a multiple of the page size) in exactly the layout of an in-memory plane,
+// halo and row padding included, so the file can be mapped and used in place.
+#define SCRATCH_MAGIC                   0x58414e41  // "ANAX"
+#define SCRATCH_VERSION                 2
+
+#define SCRATCH_HALO_N                  0
+#define SCRATCH_HALO_S                  1
+#define SCRATCH_HALO_E                  2
+#define SCRATCH_HALO_W                  3
+#define SCRATCH_HALO_NE                 4
+#define SCRATCH_HALO_SE                 5
+#define SCRATCH_HALO_SW                 6
+#define SCRATCH_HALO_NW                 7
+
+struct scratch_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t data_offset;
+    uint32_t height;
+    uint32_t width;
+    uint32_t halo;
+    uint32_t stride;                // Elements per row of the plane
+    int16_t max_elevation;
+    int16_t min_elevation;
+    uint8_t halo_set[8];            // Indexed by SCRATCH_HALO_*
+    int32_t projection;
+    uint32_t decimation;
+    double vertical_pixel_scale;
+    double horizontal_pixel_scale;
+    double origin_x;
+    double step_x;
+    double origin_y;
+    double step_y;
+    double radius;
+    double top;
+    double bottom;
+    double left;
+    double right;
+};
+typedef struct scratch_header scratch_hdr_t;
+
 struct tile {
     char *name;
     int img_height;
     int img_width;
     int is_open;
+    int raw;                // name holds bare RGBA rows (see renderRGBA), not a PNG
 
     // Coordinate values
     double north;
@@ -70,9 +178,25 @@ struct tile {
     int bottom_row;
     int left_col;
     int right_col;
+
+    // Reader kept from band to band while is_open
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_infop end_info;
 };
 typedef struct tile tile_t;
 
+// A run of rows of the combined image crossed by the same tiles, which are
+// ordered west to east
+struct tile_band {
+    int top_row;
+    int bottom_row;
+    int num_tiles;
+    tile_t **tiles;
+};
+typedef struct tile_band tileband_t;
+
 struct tile_list {
     int num_tiles;
     tile_t *tiles;
@@ -81,6 +205,11 @@ struct tile_list {
     double east_lim;
     double west_lim;
     pthread_mutex_t lock;
+
+    // Row band index built by layoutTiles
+    int num_bands;
+    tileband_t *bands;
+    tile_t **band_tiles;
 };
 typedef struct tile_list tilelist_t;
 
@@ -90,7 +219,8 @@ struct tile_ref {
     png_structp png_ptr;
     png_infop info_ptr;
     png_infop end_info;
-    int width;
+    int skip;               // Pixels of each row hidden by the tile before it
+    int width;              // Pixels of each row shown
 };
 typedef struct tile_ref tile_ref_t;
 
@@ -98,30 +228,47 @@ struct tile_row {
     int num_tiles;
     int height;
     tile_ref_t *refs;
+    png_byte *scratch;      // A whole row of the widest clipped PNG tile
 };
 typedef struct tile_row tile_subset_t;
 
+int allocMap(geotiffmap_t **map, int height, int width);
 int initMap(geotiffmap_t **map, TIFF *tiff, char *srcfile, int suppress_output, frame_coords_t *frame);
 void printGeotiffInfo(geotiffmap_t *map, TIFF *tiff);
 int setDefaultColors(geotiffmap_t *map, colorscheme_t **colorscheme, int isAbsolute);
 int loadColorScheme(geotiffmap_t *map, colorscheme_t **colorscheme, char *colorfile, int wflag);
+int compileColorScheme(colorscheme_t *colorscheme);
+void colorizeRow(colorscheme_t *colorscheme, const int16_t *elevation, const uint8_t *water, const uint8_t *relief, rgba_t *out, int n);
 int setRelativeElevations(colorscheme_t *colorscheme, int16_t max, int16_t min);
-int findWater(geotiffmap_t *map);
+int findWater(geotiffmap_t *map, int min_area, struct water_boundary *boundary);
 int applyProjection(geotiffmap_t **map, int projection);
-int colorize(geotiffmap_t *map, colorscheme_t *colorscheme);
-int reliefshade(geotiffmap_t *map, int direction);
-int renderPNG(geotiffmap_t *map, char *outfile, int suppress_output);
+int reliefshade(geotiffmap_t *map, double azimuth, double altitude);
+int renderPNG(geotiffmap_t *map, colorscheme_t *colorscheme, char *outfile, int suppress_output);
+int renderRGBA(geotiffmap_t *map, colorscheme_t *colorscheme, char *outfile);
 //void updatePNGWriteStatus(png_structp png_ptr, png_uint32 row, int pass);
-int scaleImage(geotiffmap_t **map, double scale);
+int scaleImage(geotiffmap_t **map, double scale, int kernel);
 int getCorners(geotiffmap_t *map, double *top, double *bottom, double *left, double *right);
+int getTIFFCorners(TIFF *tiff, double *top, double *bottom, double *left, double *right);
+int cropMap(geotiffmap_t **map, region_t *region);
+void setScratchHeader(scratch_hdr_t *hdr, anaxjob_t *current_job, geotiffmap_t *map);
 int writeMapData(anaxjob_t *current_job, geotiffmap_t *map);
+int readScratchHeader(int fd, scratch_hdr_t *hdr);
 int readMapData(anaxjob_t *current_job, geotiffmap_t **map);
+int readMapRegion(int fd, scratch_hdr_t *hdr, int row, int col, int nrows, int ncols, int16_t *dst, int dst_stride);
+int getHaloRegion(geotiffmap_t *map, int direction, int *row, int *col, int *nrows, int *ncols);
+int readMapEdge(anaxjob_t *job, int part, int16_t *dst, int dst_stride, int max_rows, int max_cols, int *nrows, int *ncols);
 void freeMap(geotiffmap_t *map);
 int finalizeLocalJobs(joblist_t *joblist);
-int stitch(tilelist_t *tilelist, char *outfile, uilist_t *uilist);
+int selectRegionJobs(joblist_t *joblist, region_t *region);
+int dropRegionHaloTiles(tilelist_t *tilelist, region_t *region);
+int findTileBand(tilelist_t *tilelist, int row);
+int layoutTiles(tilelist_t *tilelist, int *width, int *height);
+int stitch(tilelist_t *tilelist, char *outfile, int pyramid_levels, uilist_t *uilist);
 int getTileRowSubset(tilelist_t *tilelist, int row, int img_width, tile_subset_t **tile_subset);
 int loadRowData(png_byte *row_ptr, tile_subset_t *tile_subset, int img_width);
 
+void scaleGeotransform(geotransform_t *gt, double scale_x, double scale_y);
+
 void SHOW_DATA_AT_POINT(geotiffmap_t *map, int r, int c);
 void SHOW_COLOR_SCHEME(colorscheme_t *colors);
 
@@ -8,19 +8,60 @@
 #include "libanax.h"
 #include "distranax.h"
 #include "anaxcurses.h"
+#include "cache.h"
+#include "ingest.h"
+#include "pngwriter.h"
+#include "resample.h"
+#include "tiffwriter.h"
+#include "water.h"
+#include "xyztiles.h"
 
 void usage() {
-	fprintf(stderr, "Usage: geotiff [-cdloqrsw] [SRC PATH]\n");
+	fprintf(stderr, "Usage: geotiff [-abcCdDFklmoPqrSstwz] [SRC PATH]\n");
 	fprintf(stderr, "    Flags:\n");
+	fprintf(stderr, "    -a [ALTITUDE]: Light relief shading from ALTITUDE degrees above the horizon (0 to 90). Default is 45\n");
+	fprintf(stderr, "    -b [N,S,E,W]: Only render the region between latitudes N and S and longitudes E and W, skipping source files outside it\n");
 	fprintf(stderr, "    -c [FILEPATH]: Apply the color scheme in FILEPATH instead of the default color scheme\n");
+	fprintf(stderr, "    -C [DIRECTORY]: Keep loaded and rendered tiles in DIRECTORY, and on later runs only redo those whose source files, neighbors or settings have changed (not with -d)\n");
     fprintf(stderr, "    -d [FILEPATH]: Run in distributed mode, with FILEPATH containing a list of addresses to other machines\n");
+	fprintf(stderr, "    -D : With -s below 1, downsample while reading the source files (from their internal overviews where possible) instead of after rendering\n");
+	fprintf(stderr, "    -F [FILTER]: Filter PNG rows with FILTER before compressing. Options are NONE, SUB, UP, AVERAGE, PAETH, ADAPTIVE. Default is ADAPTIVE\n");
+	fprintf(stderr, "    -k [KERNEL]: Resample with KERNEL when scaling. Options are BOX, BILINEAR, LANCZOS. Default is BOX\n");
     fprintf(stderr, "    -l : Run in listening mode, waiting for a connection from an instance running in distributed mode\n");
-	fprintf(stderr, "    -o [FILEPATH]: Save the output file to FILEPATH\n");
+	fprintf(stderr, "    -m [PIXELS]: With -w, only treat flat regions of at least PIXELS pixels as water. Default is %i\n", WATER_MIN_AREA_DEFAULT);
+	fprintf(stderr, "    -o [FILEPATH]: Save the output file to FILEPATH. If it ends in .tif or .tiff, save a tiled GeoTIFF instead of a PNG\n");
+	fprintf(stderr, "    -P [LEVELS]: Also save LEVELS overview levels at 1/2, 1/4, 1/8... the output size, as FILEPATH_1.png, FILEPATH_2.png..., or inside the file for a GeoTIFF\n");
 	fprintf(stderr, "    -p [PROJECTION]: Use projection PROJECTION. Options are EQUIRECTANGULAR, MERCATOR. Default is EQUIRECTANGULAR\n");
 	fprintf(stderr, "    -q : Suppress output to stdout\n");
-	fprintf(stderr, "    -r [SOURCE]: Draw relief shading using light originating in the direction of SOURCE (one of N, S, E, W, NE, SE, NW, SW)\n");
+	fprintf(stderr, "    -r [SOURCE]: Draw relief shading using light originating in the direction of SOURCE (one of N, S, E, W, NE, SE, NW, SW, or an azimuth in degrees clockwise from north)\n");
+	fprintf(stderr, "    -S : With a relative color scheme, take the elevation range from the statistics in the source files' metadata (or estimate it from their overviews or a sample of their pixels) before loading them, so that tiles are rendered as they are loaded\n");
 	fprintf(stderr, "    -s [SCALE]: Scale the output file by a factor of SCALE\n");
+	fprintf(stderr, "    -t [SIZE]: Save the output as z/x/y web map tiles of SIZE pixels (256 or 512) under the directory given by -o, or in a single container if it ends in .mbtiles. With -P, also build LEVELS zoom levels out\n");
 	fprintf(stderr, "    -w : Try to identify bodies of water\n");
+	fprintf(stderr, "    -z [LEVEL]: Compress PNG output at LEVEL, from 0 (fastest) to 9 (smallest). Default is 6\n");
+}
+
+// Output paths ending in .tif or .tiff are saved as tiled GeoTIFFs
+int isTIFFPath(char *path) {
+    size_t len = strlen(path);
+    return (len > 4 && !strcmp(path + len - 4, ".tif")) || (len > 5 && !strcmp(path + len - 5, ".tiff"));
+}
+
+int getAzimuth(char *source, double *azimuth) {
+    const char *names[] = {"N", "NE", "E", "SE", "S", "SW", "W", "NW"};
+    for(int i = 0; i < 8; i++) {
+        if(!strcmp(source, names[i])) {
+            *azimuth = i * 45.0;
+            return 0;
+        }
+    }
+    
+    char *end;
+    *azimuth = strtod(source, &end);
+    if(end == source || *end != '\0')
+        return ANAX_ERR_INVALID_INVOCATION;
+    *azimuth = fmod(*azimuth, 360.0);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
@@ -30,35 +71,111 @@ int main(int argc, char *argv[]) {
 	int c;
 	int cflag = 0;
     int dflag = 0;
+    int Dflag = 0;
 	int lflag = 0;
 	int oflag = 0;
 	int pflag = 0;
 	int qflag = 0;
 	int sflag = 0;
+	int Sflag = 0;
 	int rflag = 0;
 	int wflag = 0;
 	char *outfile = NULL;
 	char *colorfile = NULL;
 	char *addrfile = NULL;
+	char *cachedir = NULL;
 	double scale = 1.0;
 	int relief = 0;
+	double azimuth = 0.0;
+	double altitude = 45.0;
+	int water_min_area = WATER_MIN_AREA_DEFAULT;
 	int projection = 0;
+	int kernel = RESAMPLE_BOX;
+	int pyramid_levels = 0;
+	int tile_size = 0;
+	int png_level = Z_DEFAULT_COMPRESSION;
+	int png_filter = PNGWRITER_FILTER_ADAPTIVE;
+	region_t roi;
+	region_t *region = NULL;
 
 	int err;
 
-	while((c = getopt(argc, argv, "c:d:lo:p:qr:s:w")) != -1) {
+	while((c = getopt(argc, argv, "a:b:c:C:d:DF:k:lm:o:p:P:qr:Ss:t:wz:")) != -1) {
 		switch(c) {
+			case 'a':
+			    altitude = atof(optarg);
+			    if(altitude <= 0.0 || altitude > 90.0) {
+			        fprintf(stderr, "Error: %s is not a valid argument to -a\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
+			case 'b':
+			    if(sscanf(optarg, "%lf,%lf,%lf,%lf", &(roi.north), &(roi.south), &(roi.east), &(roi.west)) != 4 ||
+			       roi.north <= roi.south || roi.east <= roi.west) {
+			        fprintf(stderr, "Error: %s is not a valid argument to -b\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    region = &roi;
+			    break;
 			case 'c':
 				cflag = 1;
 				colorfile = optarg;
 				break;
+			case 'C':
+			    cachedir = optarg;
+			    break;
 			case 'd':
 				dflag = 1;
 				addrfile = optarg;
 				break;
+			case 'D':
+			    Dflag = 1;
+			    break;
+			case 'F':
+			    if(!strcmp(optarg, "NONE"))
+			        png_filter = PNGWRITER_FILTER_NONE;
+			    else if(!strcmp(optarg, "SUB"))
+			        png_filter = PNGWRITER_FILTER_SUB;
+			    else if(!strcmp(optarg, "UP"))
+			        png_filter = PNGWRITER_FILTER_UP;
+			    else if(!strcmp(optarg, "AVERAGE"))
+			        png_filter = PNGWRITER_FILTER_AVERAGE;
+			    else if(!strcmp(optarg, "PAETH"))
+			        png_filter = PNGWRITER_FILTER_PAETH;
+			    else if(!strcmp(optarg, "ADAPTIVE"))
+			        png_filter = PNGWRITER_FILTER_ADAPTIVE;
+			    else {
+			        fprintf(stderr, "Error: %s is not a recognized PNG filter\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
+			case 'k':
+			    if(!strcmp(optarg, "BOX"))
+			        kernel = RESAMPLE_BOX;
+			    else if(!strcmp(optarg, "BILINEAR"))
+			        kernel = RESAMPLE_BILINEAR;
+			    else if(!strcmp(optarg, "LANCZOS"))
+			        kernel = RESAMPLE_LANCZOS;
+			    else {
+			        fprintf(stderr, "Error: %s is not a recognized resampling kernel\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
 			case 'l':
 				lflag = 1;
 				break;
+			case 'm':
+			    water_min_area = atoi(optarg);
+			    if(water_min_area < 1) {
+			        fprintf(stderr, "Error: %s is not a valid argument to -m\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
 			case 'o':
 				oflag = 1;
 				outfile = optarg;
@@ -75,40 +192,52 @@ int main(int argc, char *argv[]) {
 			        exit(ANAX_ERR_INVALID_INVOCATION);
 			    }
 			    break;
+			case 'P':
+			    pyramid_levels = atoi(optarg);
+			    if(pyramid_levels < 1) {
+			        fprintf(stderr, "Error: %s is not a valid argument to -P\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
 			case 'q':
 				qflag = 1;
 				break;
 			case 'r':
 			    rflag = 1;
-			    if(!strcmp(optarg, "N"))
-			        relief = ANAX_MAP_NORTH;
-			    else if(!strcmp(optarg, "S"))
-			        relief = ANAX_MAP_SOUTH;
-			    else if(!strcmp(optarg, "E"))
-			        relief = ANAX_MAP_EAST;
-			    else if(!strcmp(optarg, "W"))
-			        relief = ANAX_MAP_WEST;
-			    else if(!strcmp(optarg, "NE"))
-			        relief = ANAX_MAP_NORTHEAST;
-			    else if(!strcmp(optarg, "SE"))
-			        relief = ANAX_MAP_SOUTHEAST;
-			    else if(!strcmp(optarg, "SW"))
-			        relief = ANAX_MAP_SOUTHWEST;
-			    else if(!strcmp(optarg, "NW"))
-			        relief = ANAX_MAP_NORTHWEST;
-			    else {
-			        fprintf(stderr, "Error: %s is not a valid argument to -w\n", optarg);
+			    relief = 1;
+			    if(getAzimuth(optarg, &azimuth)) {
+			        fprintf(stderr, "Error: %s is not a valid argument to -r\n", optarg);
 			        usage();
 			        exit(ANAX_ERR_INVALID_INVOCATION);
 			    }
 			    break;
+			case 'S':
+			    Sflag = 1;
+			    break;
 			case 's':
 				sflag = 1;
 				scale = atof(optarg);
 				break;
+			case 't':
+			    tile_size = atoi(optarg);
+			    if(tile_size != 256 && tile_size != 512) {
+			        fprintf(stderr, "Error: %s is not a valid argument to -t\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
 			case 'w':
 			    wflag = 1;
 			    break;
+			case 'z':
+			    png_level = atoi(optarg);
+			    if(png_level < 0 || png_level > 9 || optarg[0] < '0' || optarg[0] > '9') {
+			        fprintf(stderr, "Error: %s is not a valid argument to -z\n", optarg);
+			        usage();
+			        exit(ANAX_ERR_INVALID_INVOCATION);
+			    }
+			    break;
 			case ':':
 				fprintf(stderr, "Error: Flag is missing argument\n");
 				usage();
@@ -121,6 +250,15 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	// Read every source pixel only as finely as the output needs; scaleImage
+	// makes up whatever is left of the scale
+	int decimation = 1;
+	if(Dflag && scale > 0.0 && scale < 1.0)
+	    decimation = (int)floor((1.0 / scale) + 1e-9);
+	setIngestDecimation(decimation);
+	setIngestRegion(region);
+	setPNGWriterOptions(png_level, png_filter);
+
 	joblist_t *joblist = malloc(sizeof(joblist_t));
 	joblist->jobs = NULL;
 	joblist->num_jobs = 0;
@@ -128,8 +266,8 @@ int main(int argc, char *argv[]) {
 	for(int i = optind; i < argc; i++) {
 		joblist->num_jobs++;
 		joblist->jobs = realloc(joblist->jobs, joblist->num_jobs * sizeof(anaxjob_t));
-		memset(&(joblist->jobs[i]), 0, sizeof(anaxjob_t));
-		joblist->jobs[joblist->num_jobs - 1].name = calloc(strlen(argv[i] + 1), sizeof(char));
+		memset(&(joblist->jobs[joblist->num_jobs - 1]), 0, sizeof(anaxjob_t));
+		joblist->jobs[joblist->num_jobs - 1].name = calloc(strlen(argv[i]) + 1, sizeof(char));
 		strcpy(joblist->jobs[joblist->num_jobs - 1].name, argv[i]);
 		joblist->jobs[joblist->num_jobs - 1].tmpfile = NULL;
 		joblist->jobs[joblist->num_jobs - 1].outfile = NULL;
@@ -141,6 +279,16 @@ int main(int argc, char *argv[]) {
 		usage();
 		exit(ANAX_ERR_INVALID_INVOCATION);
 	}
+	
+	// Leave out the source files outside the region of interest before any
+	// of them are loaded or sent anywhere
+	if(region && !lflag) {
+	    selectRegionJobs(joblist, region);
+	    if(joblist->num_jobs == 0) {
+	        fprintf(stderr, "Error: No source file lies in the region given with -b\n");
+	        exit(ANAX_ERR_NO_MAP);
+	    }
+	}
 
     uilist_t *uilist = NULL;
 	if(!qflag && !lflag) {
@@ -167,7 +315,7 @@ int main(int argc, char *argv[]) {
 		char cwd[FILENAME_MAX];
 		getcwd(cwd, FILENAME_MAX);
 		outfile = calloc(FILENAME_MAX, sizeof(char));
-		sprintf(outfile, "%s%s", cwd, "/out.png");
+		sprintf(outfile, "%s%s", cwd, tile_size ? "/tiles" : "/out.png");
 	}
 
 	if(dflag) {
@@ -194,6 +342,24 @@ int main(int argc, char *argv[]) {
 	        setDefaultColors(NULL, &colorscheme, ANAX_RELATIVE_COLORS);
 	    }
 	    
+	    // Settle the decimation factor and, with -S, a relative color scheme
+	    // from the source files here, so that every node reads at the same
+	    // resolution and the scheme goes out to them as an absolute one
+	    int scan_ranges = Sflag && colorscheme->isAbsolute == ANAX_RELATIVE_COLORS;
+	    if(scan_ranges || decimation > 1) {
+	        jobsurvey_t *surveys;
+	        int range_max, range_min;
+	        err = surveyJobs(joblist, scan_ranges, &surveys, &range_max, &range_min);
+	        if(err)
+	            exit(err);
+	        decimation = settleIngestDecimation(surveys, joblist->num_jobs);
+	        if(scan_ranges && range_max >= range_min) {
+	            setRelativeElevations(colorscheme, range_max, range_min);
+	            colorscheme->isAbsolute = ANAX_ABSOLUTE_COLORS;
+	        }
+	        free(surveys);
+	    }
+	    
 	    // Initialize the tile list for receiving incoming renders
 	    tilelist_t *tilelist = malloc(sizeof(tilelist_t));
 	    tilelist->num_tiles = 0;
@@ -202,10 +368,13 @@ int main(int argc, char *argv[]) {
 	    tilelist->south_lim = DBL_MAX;
 	    tilelist->east_lim = -DBL_MAX;
 	    tilelist->west_lim = DBL_MAX;
+	    tilelist->num_bands = 0;
+	    tilelist->bands = NULL;
+	    tilelist->band_tiles = NULL;
 	    pthread_mutex_init(&(tilelist->lock), NULL);
 	    
 	    // Send each remote node the colorscheme, scale, and remote node list
-	    err = initRemoteHosts(destinationlist, tilelist, colorscheme, scale, relief, projection, uilist);
+	    err = initRemoteHosts(destinationlist, tilelist, colorscheme, scale, relief, azimuth, altitude, water_min_area, projection, kernel, decimation, region, uilist);
 	    
 	    // Send out initial jobs
 	    err = distributeJobs(destinationlist, joblist);
@@ -230,9 +399,23 @@ int main(int argc, char *argv[]) {
 		// Clean up local and remote memory, and terminate remote processes
 		finalizeRemoteJobs(destinationlist);
 		finalizeLocalJobs(joblist);
+		if(region)
+		    dropRegionHaloTiles(tilelist, region);
 		
-        // Stitch together the received images
-        stitch(tilelist, outfile, uilist);
+        // Stitch together the received images, or cut them into web map tiles
+        int out_err = 0;
+        if(tile_size)
+            out_err = writeXYZTiles(tilelist, outfile, projection, tile_size, pyramid_levels, uilist);
+        else if(isTIFFPath(outfile))
+            out_err = writeTiledTIFF(tilelist, outfile, projection, pyramid_levels, uilist);
+        else
+            out_err = stitch(tilelist, outfile, pyramid_levels, uilist);
+        if(out_err) {
+            if(!qflag)
+                endWindows();
+            fprintf(stderr, "Error: Could not write %s\n", outfile);
+            exit(out_err);
+        }
 		
     } else if(lflag) {
         // Handle receipt of distributed rendering job
@@ -255,8 +438,11 @@ int main(int argc, char *argv[]) {
         int global_min = INT16_MAX;
         colorscheme_t *colorscheme;
         double scale;
-        int relief, projection;
-        getInitHeaderData(outsocketfd, &whoami, &colorscheme, &scale, &relief, &projection);
+        int relief, water_min_area, projection, kernel, decimation;
+        double azimuth, altitude;
+        getInitHeaderData(outsocketfd, &whoami, &colorscheme, &scale, &relief, &azimuth, &altitude, &water_min_area, &projection, &kernel, &decimation, &region);
+        setIngestDecimation(decimation);
+        setIngestRegion(region);
         
         SHOW_COLOR_SCHEME(colorscheme);
         
@@ -269,10 +455,15 @@ int main(int argc, char *argv[]) {
         localjobs->num_jobs = 0;
         localjobs->jobs = NULL;
 
+        // Set up a spatial index over local and remote tiles
+        tileindex_t *tileindex;
+        initTileIndex(&tileindex);
+
         // Set up data exchange thread spawner
         threadshare_t *argt = malloc(sizeof(threadshare_t));
         argt->remotenodes = remotenodes;
         argt->localjobs = localjobs;
+        argt->tileindex = tileindex;
         argt->global_max = &global_max;
         argt->global_min = &global_min;
         argt->whoami = whoami;
@@ -347,14 +538,29 @@ int main(int argc, char *argv[]) {
             sendMinMax(remotenodes, local_min, local_max, whoami);
         }
         
+        // Index the local tiles (the job array no longer moves from here on),
+        // with the grid sized to them rather than to whichever tile came first
+        sizeTileIndexToJobs(tileindex, localjobs->jobs, localjobs->num_jobs);
+        for(int i = 0; i < localjobs->num_jobs; i++) {
+            insertTileIndex(tileindex, &(localjobs->jobs[i]), TILEINDEX_LOCAL, i);
+        }
+        
         // Check for neighboring images amongst local tiles
         printf("Performing local map query...\n");
         for(int i = 0; i < localjobs->num_jobs; i++) {
             printf("... Examining job %i of %i\n", i + 1, localjobs->num_jobs);
-            queryForMapFrameLocal(&(localjobs->jobs[i]), localjobs);
+            queryForMapFrameLocal(&(localjobs->jobs[i]), tileindex, colorscheme->showWater);
             sendUIUpdate(outsocketfd, &(localjobs->jobs[i]), UI_STATE_REMOTECHK);
         }
         
+        // Share the flat regions along the local tiles' edges with all other nodes
+        if(colorscheme->showWater) {
+            for(int i = 0; i < localjobs->num_jobs; i++) {
+                if(sendWaterBoundary(remotenodes, &(localjobs->jobs[i]), whoami))
+                    fprintf(stderr, "Error: Could not share the water boundary of job %i\n", i);
+            }
+        }
+        
         // Query other nodes for frame information
         printf("Performing remote map query...\n");
         int done = 0;
@@ -362,7 +568,7 @@ int main(int argc, char *argv[]) {
             for(int i = 0; i < localjobs->num_jobs; i++) {
                 if(localjobs->jobs[i].status == ANAX_STATE_LOADED) {
                     printf("Querying job %i of %i\n", i + 1, localjobs->num_jobs);
-                    queryForMapFrame(&(localjobs->jobs[i]), remotenodes);
+                    queryForMapFrame(&(localjobs->jobs[i]), remotenodes, tileindex);
                 }
                 
                 // Check if all remote jobs have received all the jobs they are going to get
@@ -397,6 +603,13 @@ int main(int argc, char *argv[]) {
         }
         printf("All data is ready. Proceeding to rendering phase.\n");
         
+        // Settle which flat regions along tile edges are water
+        if(colorscheme->showWater) {
+            printf("Merging water boundaries...\n");
+            if(mergeRemoteWaterBoundaries(tileindex, remotenodes, localjobs, whoami))
+                fprintf(stderr, "Warning: Water could not be settled across nodes; each tile finds its own\n");
+        }
+        
         // If the colorscheme is relative, update it with the appropriate scale
         if(colorscheme->isAbsolute == ANAX_RELATIVE_COLORS) {
             printf(">>> Local Max: %i / Global Max: %i / New Global Max: %i", local_max, global_max, (local_max > global_max) ? local_max : global_max);
@@ -426,28 +639,34 @@ int main(int argc, char *argv[]) {
                     // Find water
                     if(colorscheme->showWater) {
                         printf("  Identifying water\n");
-                        findWater(map);
+                        findWater(map, water_min_area, current_job->water_boundary);
+                        freeWaterBoundary(current_job->water_boundary);
+                        current_job->water_boundary = NULL;
                     }
                     
                     // Apply relief shading
                     if(relief) {
                         printf("  Applying relief shading\n");
-                        reliefshade(map, relief);
+                        reliefshade(map, azimuth, altitude);
                     }
                     
-                    // Scale
-                    if(scale != 1.0) {
+                    // Scale, allowing for any downsampling done while reading
+                    if(scale * map->decimation != 1.0) {
                         printf("  Scaling\n");
-                        scaleImage(&map, scale);
+                        scaleImage(&map, scale * map->decimation, kernel);
                     }
                     
-                    // Colorize
-                    printf("  Colorizing\n");
-                    colorize(map, colorscheme);
+                    // Cut the map down to the region of interest
+                    if(region) {
+                        printf("  Cropping\n");
+                        cropMap(&map, region);
+                        getCorners(map, &(current_job->top_lat), &(current_job->bottom_lat), &(current_job->left_lon), &(current_job->right_lon));
+                    }
                     
-                    // Render
+                    // Colorize and render
+                    printf("  Rendering\n");
                     sendUIUpdate(outsocketfd, current_job, UI_STATE_RENDERING);
-                    renderPNG(map, current_job->outfile, 0);
+                    renderPNG(map, colorscheme, current_job->outfile, 0);
                 
                     // Update local and remote state
                     rendered++;
@@ -511,123 +730,126 @@ int main(int argc, char *argv[]) {
 	        setDefaultColors(NULL, &colorscheme, ANAX_RELATIVE_COLORS);
 	    }
 	    
-	    for(int i = 0; i < joblist->num_jobs; i++) {
-	        if(!qflag) {
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_RECEIVING);
-	            updateJobView(&(uilist->jobuis[i]));
-	        }
-	    
-	        // Open TIFF file
-	        TIFF *srctiff = XTIFFOpen(joblist->jobs[i].name, "r");
-	        if(srctiff == NULL) {
-	            fprintf(stderr, "Error: No such file: %s\n", joblist->jobs[i].name);
-	            exit(ANAX_ERR_FILE_DOES_NOT_EXIST);
-	        }
-	        
-	        // Set the new name for the outfile (PNG) and tempfile (TMP)
-	        joblist->jobs[i].outfile = malloc(32);
-	        joblist->jobs[i].tmpfile = malloc(32);
-	        sprintf(joblist->jobs[i].tmpfile, "/tmp/map%i.tmp", i);
-	        sprintf(joblist->jobs[i].outfile, "/tmp/map%i.png", i);
-	        
-	        if(!qflag) {
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_PROCESSING);
-	            updateJobView(&(uilist->jobuis[i]));
-	        }
-	        
-	        // Load data from GeoTIFF
-	        geotiffmap_t *map;
-	        frame_coords_t *frame = malloc(sizeof(frame_coords_t));
-	        err = initMap(&map, srctiff, joblist->jobs[i].name, qflag, frame);
+	    // Read the source files' headers first when the decimation factor or,
+	    // with -S, a relative color scheme is to be settled from them, or the
+	    // tiles can be streamed (see below)
+	    int scan_ranges = Sflag && colorscheme->isAbsolute == ANAX_RELATIVE_COLORS;
+	    jobsurvey_t *surveys = NULL;
+	    if(scan_ranges || decimation > 1 || (colorscheme->isAbsolute == ANAX_ABSOLUTE_COLORS && !colorscheme->showWater)) {
+	        int range_max, range_min;
+	        err = surveyJobs(joblist, scan_ranges, &surveys, &range_max, &range_min);
 	        if(err)
 	            exit(err);
-	        XTIFFClose(srctiff);
-	        
-	        // Store the frame coordinates
-	        memcpy(&(joblist->jobs[i].frame_coordinates), frame, sizeof(frame_coords_t));
-	        
-	        // Get periphery
-	        getCorners(map, &(joblist->jobs[i].top_lat), &(joblist->jobs[i].bottom_lat), &(joblist->jobs[i].left_lon), &(joblist->jobs[i].right_lon));
 	        
-	        // Change projections
-	        if(projection)
-	            applyProjection(&map, projection);
+	        // Read every tile at the same resolution, so that halos line up
+	        decimation = settleIngestDecimation(surveys, joblist->num_jobs);
 	        
-	        // Update elevation extreme variables
-	        local_max = (map->max_elevation > local_max) ? map->max_elevation : local_max;
-	        local_min = (map->min_elevation < local_min) ? map->min_elevation : local_min;
-	        
-	        // Write the map data to a temporary file
-	        writeMapData(&(joblist->jobs[i]), map);
-	        
-	        // Free the map
-	        freeMap(map);
+	        // Settle a relative color scheme before any tile is loaded
+	        if(scan_ranges && range_max >= range_min) {
+	            setRelativeElevations(colorscheme, range_max, range_min);
+	            colorscheme->isAbsolute = ANAX_ABSOLUTE_COLORS;
+	        }
 	    }
 	    
-	    // Check for neighboring images amongst local tiles
-	    for(int i = 0; i < joblist->num_jobs; i++) {
-	        if(!qflag) {
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_LOCALCHK);
-	            updateJobView(&(uilist->jobuis[i]));
-	        }
-	        
-	        queryForMapFrameLocal(&(joblist->jobs[i]), joblist);
-	        
-	        if(!qflag) {
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_REMOTECHK);
-	            updateJobView(&(uilist->jobuis[i]));
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_PREPARING);
-	            updateJobView(&(uilist->jobuis[i]));
+	    // Pick up the tiles of earlier runs
+	    rendercache_t *cache = NULL;
+	    if(cachedir) {
+	        err = initRenderCache(&cache, cachedir, joblist->num_jobs, projection);
+	        if(err) {
+	            fprintf(stderr, "Error: Could not use %s as a cache directory\n", cachedir);
+	            exit(err);
 	        }
+	        setIngestCache(cache);
 	    }
 	    
-	    // If the colorscheme is relative, update it with the appropriate scale
-	    if(colorscheme->isAbsolute == ANAX_RELATIVE_COLORS) {
-	        setRelativeElevations(colorscheme, local_max, local_min);
-	    }
+	    // Everything a tile is rendered with besides the tile
+	    renderopts_t render;
+	    render.colorscheme = colorscheme;
+	    render.relief = relief;
+	    render.azimuth = azimuth;
+	    render.altitude = altitude;
+	    render.water_min_area = water_min_area;
+	    render.scale = scale;
+	    render.kernel = kernel;
+	    render.region = region;
+	    render.cache = cache;
 	    
-	    // Render all maps
-	    for(int i = 0; i < joblist->num_jobs; i++) {
-	        // Load the map
-	        geotiffmap_t *map;
-	        readMapData(&(joblist->jobs[i]), &map);
-	        
-	        // Find water
-	        if(colorscheme->showWater)
-	            findWater(map);
-	            
-	        // Apply relief shading
-	        if(relief)
-	            reliefshade(map, relief);
+	    if(colorscheme->isAbsolute == ANAX_ABSOLUTE_COLORS && !colorscheme->showWater) {
+	        // With nothing left to settle across all tiles, render each tile as
+	        // soon as it and its neighbors are loaded
+	        if(cache)
+	            setRenderCacheParams(cache, colorscheme, relief, azimuth, altitude, water_min_area, scale, kernel, region);
+	        err = streamJobs(joblist, uilist, projection, qflag, surveys, &render);
+	        if(err)
+	            exit(err);
+	    } else {
+	        // Load, project and spill every tile to its temporary file, several
+	        // tiles at a time
+	        err = ingestJobs(joblist, uilist, projection, qflag, &local_max, &local_min);
+	        if(err)
+	            exit(err);
 	        
-	        // Scale
-	        if(scale != 1.0)
-	            scaleImage(&map, scale);
+	        // Index the tiles by their bounds
+	        tileindex_t *tileindex;
+	        initTileIndex(&tileindex);
+	        sizeTileIndexToJobs(tileindex, joblist->jobs, joblist->num_jobs);
+	        for(int i = 0; i < joblist->num_jobs; i++) {
+	            insertTileIndex(tileindex, &(joblist->jobs[i]), TILEINDEX_LOCAL, i);
+	        }
 	        
-	        // Colorize
-	        colorize(map, colorscheme);
+	        // Check for neighboring images amongst local tiles
+	        for(int i = 0; i < joblist->num_jobs; i++) {
+	            if(!qflag) {
+	                updateJobUIState(&(uilist->jobuis[i]), UI_STATE_LOCALCHK);
+	                updateJobView(&(uilist->jobuis[i]));
+	            }
+	            
+	            queryForMapFrameLocal(&(joblist->jobs[i]), tileindex, colorscheme->showWater);
+	            
+	            if(!qflag) {
+	                updateJobUIState(&(uilist->jobuis[i]), UI_STATE_REMOTECHK);
+	                updateJobView(&(uilist->jobuis[i]));
+	                updateJobUIState(&(uilist->jobuis[i]), UI_STATE_PREPARING);
+	                updateJobView(&(uilist->jobuis[i]));
+	            }
+	        }
 	        
-	        // Render
-	        if(!qflag) {
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_RENDERING);
-	            updateJobView(&(uilist->jobuis[i]));
+	        // Settle which flat regions along tile edges are water
+	        if(colorscheme->showWater) {
+	            anaxjob_t **jobs = malloc(joblist->num_jobs * sizeof(anaxjob_t *));
+	            for(int i = 0; i < joblist->num_jobs; i++) {
+	                jobs[i] = &(joblist->jobs[i]);
+	            }
+	            mergeWaterBoundaries(tileindex, jobs, joblist->num_jobs);
+	            free(jobs);
 	        }
-	        renderPNG(map, joblist->jobs[i].outfile, qflag);
+	        freeTileIndex(tileindex);
 	        
-	        // Get final image dimensions
-	        joblist->jobs[i].img_height = map->height;
-	        joblist->jobs[i].img_width = map->width;
+	        // If the colorscheme is relative, update it with the appropriate scale
+	        if(colorscheme->isAbsolute == ANAX_RELATIVE_COLORS) {
+	            setRelativeElevations(colorscheme, local_max, local_min);
+	        }
+	        if(cache)
+	            setRenderCacheParams(cache, colorscheme, relief, azimuth, altitude, water_min_area, scale, kernel, region);
 	        
-	        // Free the map
-	        freeMap(map);
-
-	        if(!qflag) {
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_SENDING);
-	            updateJobView(&(uilist->jobuis[i]));
-	            updateJobUIState(&(uilist->jobuis[i]), UI_STATE_COMPLETE);
-	            updateJobView(&(uilist->jobuis[i]));
+	        // Render all maps
+	        for(int i = 0; i < joblist->num_jobs; i++) {
+	            err = renderJob(&(joblist->jobs[i]), i, &render, qflag ? NULL : &(uilist->jobuis[i]));
+	            if(err)
+	                exit(err);
+	            
+	            if(!qflag) {
+	                updateJobUIState(&(uilist->jobuis[i]), UI_STATE_SENDING);
+	                updateJobView(&(uilist->jobuis[i]));
+	                updateJobUIState(&(uilist->jobuis[i]), UI_STATE_COMPLETE);
+	                updateJobView(&(uilist->jobuis[i]));
+	            }
 	        }
 	    }
+	    free(surveys);
+	    
+	    setIngestCache(NULL);
+	    freeRenderCache(cache);
 	    
 	    // Initialize a tile list
 	    tilelist_t *tilelist = malloc(sizeof(tilelist_t));
@@ -637,14 +859,18 @@ int main(int argc, char *argv[]) {
 	    tilelist->south_lim = DBL_MAX;
 	    tilelist->east_lim = -DBL_MAX;
 	    tilelist->west_lim = DBL_MAX;
+	    tilelist->num_bands = 0;
+	    tilelist->bands = NULL;
+	    tilelist->band_tiles = NULL;
 
         // Add tiles to the tile list
         for(int i = 0; i < tilelist->num_tiles; i++) {
-            tilelist->tiles[i].name = calloc(32, sizeof(char));
+            tilelist->tiles[i].name = calloc(strlen(joblist->jobs[i].outfile) + 1, sizeof(char));
             strcpy(tilelist->tiles[i].name, joblist->jobs[i].outfile);
             tilelist->tiles[i].img_height = joblist->jobs[i].img_height;
             tilelist->tiles[i].img_width = joblist->jobs[i].img_width;
             tilelist->tiles[i].is_open = 0;
+            tilelist->tiles[i].raw = 1;
             tilelist->tiles[i].north = joblist->jobs[i].top_lat;
             tilelist->tiles[i].south = joblist->jobs[i].bottom_lat;
             tilelist->tiles[i].east = joblist->jobs[i].right_lon;
@@ -657,9 +883,23 @@ int main(int argc, char *argv[]) {
         
         // Clean up job list
         finalizeLocalJobs(joblist);
+        if(region)
+            dropRegionHaloTiles(tilelist, region);
         
-        // Stitch together the tiles
-        stitch(tilelist, outfile, uilist);
+        // Stitch together the tiles, or cut them into web map tiles
+        int out_err = 0;
+        if(tile_size)
+            out_err = writeXYZTiles(tilelist, outfile, projection, tile_size, pyramid_levels, uilist);
+        else if(isTIFFPath(outfile))
+            out_err = writeTiledTIFF(tilelist, outfile, projection, pyramid_levels, uilist);
+        else
+            out_err = stitch(tilelist, outfile, pyramid_levels, uilist);
+        if(out_err) {
+            if(!qflag)
+                endWindows();
+            fprintf(stderr, "Error: Could not write %s\n", outfile);
+            exit(out_err);
+        }
 	}
 	
 	if(!qflag) {
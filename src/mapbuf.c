@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "globals.h"
+#include "mapbuf.h"
+
+int getMapBufferStride(int width, int halo, size_t elem_size) {
+    // Pad each row out to a whole number of cache lines
+    size_t row_bytes = (size_t)(width + (2 * halo)) * elem_size;
+    row_bytes = (row_bytes + MAPBUF_ALIGNMENT - 1) & ~((size_t)MAPBUF_ALIGNMENT - 1);
+    return row_bytes / elem_size;
+}
+
+int allocMapBuffer(mapbuf_t **buf, int height, int width, int halo, size_t elem_size) {
+    *buf = malloc(sizeof(mapbuf_t));
+    if(!*buf)
+        return ANAX_ERR_NO_MEMORY;
+
+    (*buf)->elem_size = elem_size;
+    (*buf)->rows = height + (2 * halo);
+    (*buf)->cols = width + (2 * halo);
+    (*buf)->stride = getMapBufferStride(width, halo, elem_size);
+    size_t row_bytes = (*buf)->stride * elem_size;
+    (*buf)->halo = halo;
+    (*buf)->flags = 0;
+    (*buf)->slab_size = row_bytes * (*buf)->rows;
+
+    // Large planes are aligned to the huge page size so that the kernel can
+    // back them with transparent huge pages
+    size_t alignment = MAPBUF_ALIGNMENT;
+#ifdef MADV_HUGEPAGE
+    if((*buf)->slab_size >= MAPBUF_HUGEPAGE_SIZE) {
+        alignment = MAPBUF_HUGEPAGE_SIZE;
+        (*buf)->slab_size = ((*buf)->slab_size + MAPBUF_HUGEPAGE_SIZE - 1) & ~((size_t)MAPBUF_HUGEPAGE_SIZE - 1);
+    }
+#endif
+
+    void *slab;
+    if(posix_memalign(&slab, alignment, (*buf)->slab_size)) {
+        free(*buf);
+        *buf = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+    (*buf)->slab = slab;
+
+#ifdef MADV_HUGEPAGE
+    if(alignment == MAPBUF_HUGEPAGE_SIZE && !madvise(slab, (*buf)->slab_size, MADV_HUGEPAGE))
+        (*buf)->flags |= MAPBUF_HUGEPAGES;
+#endif
+
+    memset(slab, 0, (*buf)->slab_size);
+
+    return 0;
+}
+
+// Map a plane that has been written to a file in the layout allocMapBuffer
+// would give it, starting at the page-aligned offset
+int mapMapBuffer(mapbuf_t **buf, int fd, off_t offset, int height, int width, int halo, size_t elem_size) {
+    *buf = malloc(sizeof(mapbuf_t));
+    if(!*buf)
+        return ANAX_ERR_NO_MEMORY;
+
+    (*buf)->elem_size = elem_size;
+    (*buf)->rows = height + (2 * halo);
+    (*buf)->cols = width + (2 * halo);
+    (*buf)->stride = getMapBufferStride(width, halo, elem_size);
+    (*buf)->halo = halo;
+    (*buf)->flags = MAPBUF_MAPPED;
+    (*buf)->slab_size = (size_t)(*buf)->stride * elem_size * (*buf)->rows;
+
+    void *slab = mmap(NULL, (*buf)->slab_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+    if(slab == MAP_FAILED) {
+        free(*buf);
+        *buf = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+    (*buf)->slab = slab;
+
+    return 0;
+}
+
+void freeMapBuffer(mapbuf_t *buf) {
+    if(!buf)
+        return;
+    if(buf->flags & MAPBUF_MAPPED)
+        munmap(buf->slab, buf->slab_size);
+    else
+        free(buf->slab);
+    free(buf);
+}
@@ -0,0 +1,39 @@
+#ifndef MAPBUF_H
+#define MAPBUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MAPBUF_ALIGNMENT                            64
+#define MAPBUF_HUGEPAGE_SIZE                        (2 * 1024 * 1024)
+
+#define MAPBUF_HUGEPAGES                            0x01
+#define MAPBUF_MAPPED                               0x02
+
+// A raster plane backed by a single aligned slab. Rows are padded out to a
+// multiple of MAPBUF_ALIGNMENT bytes, so consecutive rows are 'stride'
+// elements apart. Row and column indices include the halo; the interior of
+// the plane starts at (halo, halo). A plane may also be a shared mapping of a
+// file laid out the same way (MAPBUF_MAPPED), in which case writes to it go
+// straight to the file.
+struct map_buffer {
+    uint8_t *slab;
+    size_t slab_size;
+    size_t elem_size;
+    int rows;
+    int cols;
+    int stride;
+    int halo;
+    int flags;
+};
+typedef struct map_buffer mapbuf_t;
+
+#define MAPBUF_ROW(buf, type, r)    ((type *)((buf)->slab + ((size_t)(r) * (buf)->stride * (buf)->elem_size)))
+
+int getMapBufferStride(int width, int halo, size_t elem_size);
+int allocMapBuffer(mapbuf_t **buf, int height, int width, int halo, size_t elem_size);
+int mapMapBuffer(mapbuf_t **buf, int fd, off_t offset, int height, int width, int halo, size_t elem_size);
+void freeMapBuffer(mapbuf_t *buf);
+
+#endif
@@ -0,0 +1,393 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pngwriter.h"
+
+static int png_level = Z_DEFAULT_COMPRESSION;
+static int png_filter = PNGWRITER_FILTER_ADAPTIVE;
+
+// Compression level (0 to 9) and row filter used by every PNG written from
+// here on
+void setPNGWriterOptions(int level, int filter) {
+    png_level = level;
+    png_filter = filter;
+}
+
+static void putUint32(png_byte *buf, uint32_t value) {
+    buf[0] = (value >> 24) & 0xff;
+    buf[1] = (value >> 16) & 0xff;
+    buf[2] = (value >> 8) & 0xff;
+    buf[3] = value & 0xff;
+}
+
+// Write a chunk whose data is the concatenation of up to three pieces. The
+// middle piece's CRC is already known, so only the pieces around it are read.
+static int writePNGChunk(FILE *fp, const char *type, png_byte *head, size_t head_size, png_byte *body, size_t body_size, uLong body_crc, png_byte *tail, size_t tail_size) {
+    png_byte buf[8];
+    putUint32(buf, (uint32_t)(head_size + body_size + tail_size));
+    memcpy(buf + 4, type, 4);
+    uLong crc = crc32(0L, (Bytef *)type, 4);
+    if(head_size)
+        crc = crc32(crc, head, head_size);
+    if(body_size)
+        crc = crc32_combine(crc, body_crc, body_size);
+    if(tail_size)
+        crc = crc32(crc, tail, tail_size);
+
+    if(fwrite(buf, 1, 8, fp) != 8 ||
+       (head_size && fwrite(head, 1, head_size, fp) != head_size) ||
+       (body_size && fwrite(body, 1, body_size, fp) != body_size) ||
+       (tail_size && fwrite(tail, 1, tail_size, fp) != tail_size))
+        return ANAX_ERR_COULD_NOT_WRITE;
+    putUint32(buf, (uint32_t)crc);
+    if(fwrite(buf, 1, 4, fp) != 4)
+        return ANAX_ERR_COULD_NOT_WRITE;
+    return 0;
+}
+
+static int paethPredictor(int left, int up, int upleft) {
+    int p = left + up - upleft;
+    int pa = abs(p - left);
+    int pb = abs(p - up);
+    int pc = abs(p - upleft);
+    if(pa <= pb && pa <= pc)
+        return left;
+    return (pb <= pc) ? up : upleft;
+}
+
+// Filter one row of RGBA pixels with the given filter type into out, which
+// starts with the filter type byte. prev is NULL for the first row of the
+// image. Returns the sum of the filtered bytes taken as signed magnitudes.
+static unsigned long filterPNGRow(int type, png_byte *row, png_byte *prev, size_t rowbytes, png_byte *out) {
+    unsigned long cost = 0;
+    out[0] = type;
+    for(size_t i = 0; i < rowbytes; i++) {
+        int left = (i >= 4) ? row[i - 4] : 0;
+        int up = prev ? prev[i] : 0;
+        int upleft = (prev && i >= 4) ? prev[i - 4] : 0;
+        png_byte value = row[i];
+        switch(type) {
+            case PNGWRITER_FILTER_SUB:
+                value -= left;
+                break;
+            case PNGWRITER_FILTER_UP:
+                value -= up;
+                break;
+            case PNGWRITER_FILTER_AVERAGE:
+                value -= (left + up) >> 1;
+                break;
+            case PNGWRITER_FILTER_PAETH:
+                value -= paethPredictor(left, up, upleft);
+                break;
+        }
+        out[i + 1] = value;
+        cost += (value < 128) ? value : 256 - value;
+    }
+    return cost;
+}
+
+// Adaptive filtering tries every filter and keeps the one with the smallest
+// sum, as libpng does
+static void filterPNGRows(int filter, png_byte *raw, png_byte *prev, int rows, size_t rowbytes, png_byte *out, png_byte *scratch) {
+    for(int r = 0; r < rows; r++) {
+        png_byte *row = raw + (r * rowbytes);
+        png_byte *dst = out + (r * (rowbytes + 1));
+        if(filter != PNGWRITER_FILTER_ADAPTIVE) {
+            filterPNGRow(filter, row, prev, rowbytes, dst);
+        } else {
+            unsigned long best = filterPNGRow(PNGWRITER_FILTER_NONE, row, prev, rowbytes, dst);
+            for(int type = PNGWRITER_FILTER_SUB; type <= PNGWRITER_FILTER_PAETH; type++) {
+                unsigned long cost = filterPNGRow(type, row, prev, rowbytes, scratch);
+                if(cost < best) {
+                    best = cost;
+                    memcpy(dst, scratch, rowbytes + 1);
+                }
+            }
+        }
+        prev = row;
+    }
+}
+
+static int deflatePNGBlock(pngwriter_t *writer, pngblock_t *block) {
+    size_t rowbytes = writer->rowbytes;
+    size_t stride = rowbytes + 1;
+    png_byte *scratch = malloc(stride);
+    if(!scratch)
+        return ANAX_ERR_NO_MEMORY;
+
+    // The context is filtered exactly as it was for the band before, so its
+    // tail matches what that band fed to deflate
+    size_t dict_size = 0;
+    png_byte *dict = NULL;
+    if(block->context_rows > 1) {
+        filterPNGRows(writer->filter, block->raw + rowbytes, block->raw, block->context_rows - 1, rowbytes, block->filtered, scratch);
+        dict_size = (block->context_rows - 1) * stride;
+        dict = block->filtered;
+        if(dict_size > PNGWRITER_WINDOW) {
+            dict += dict_size - PNGWRITER_WINDOW;
+            dict_size = PNGWRITER_WINDOW;
+        }
+    }
+    png_byte *raw = block->raw + (block->context_rows * rowbytes);
+    png_byte *prev = block->context_rows ? raw - rowbytes : NULL;
+    png_byte *in = block->filtered + (block->context_rows * stride);
+    block->in_size = block->rows * stride;
+    filterPNGRows(writer->filter, raw, prev, block->rows, rowbytes, in, scratch);
+    free(scratch);
+
+    // Bands end on a byte boundary so they can be concatenated; only the
+    // last one closes the stream
+    z_stream strm;
+    memset(&strm, 0, sizeof(z_stream));
+    if(deflateInit2(&strm, writer->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return ANAX_ERR_NO_MEMORY;
+    if(dict_size)
+        deflateSetDictionary(&strm, dict, dict_size);
+    size_t bound = deflateBound(&strm, block->in_size) + 16;
+    png_byte *out = realloc(block->out, bound);
+    if(!out) {
+        deflateEnd(&strm);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    block->out = out;
+    strm.next_in = in;
+    strm.avail_in = block->in_size;
+    strm.next_out = block->out;
+    strm.avail_out = bound;
+    int ret = deflate(&strm, block->last ? Z_FINISH : Z_SYNC_FLUSH);
+    block->out_size = bound - strm.avail_out;
+    deflateEnd(&strm);
+    if(ret != (block->last ? Z_STREAM_END : Z_OK) || strm.avail_in)
+        return ANAX_ERR_NO_MEMORY;
+
+    block->adler = adler32(adler32(0L, Z_NULL, 0), in, block->in_size);
+    block->crc = crc32(0L, block->out, block->out_size);
+    return 0;
+}
+
+// Worker threads take queued bands in order
+void *deflatePNGBlocks(void *argt) {
+    pngwriter_t *writer = (pngwriter_t *)argt;
+
+    pthread_mutex_lock(&(writer->lock));
+    while(1) {
+        pngblock_t *block = &(writer->slots[writer->taken % writer->num_slots]);
+        if(writer->taken < writer->submitted && block->state == PNGWRITER_BLOCK_QUEUED) {
+            writer->taken++;
+            block->state = PNGWRITER_BLOCK_RUNNING;
+            pthread_mutex_unlock(&(writer->lock));
+            int err = deflatePNGBlock(writer, block);
+            pthread_mutex_lock(&(writer->lock));
+            block->err = err;
+            block->state = PNGWRITER_BLOCK_DONE;
+            pthread_cond_broadcast(&(writer->cond));
+        } else if(writer->stop) {
+            break;
+        } else {
+            pthread_cond_wait(&(writer->cond), &(writer->lock));
+        }
+    }
+    pthread_mutex_unlock(&(writer->lock));
+
+    return NULL;
+}
+
+// Write out the oldest band as an IDAT chunk, adding the zlib header to the
+// first and the checksum of the whole stream to the last
+static int writePNGBlock(pngwriter_t *writer, pngblock_t *block) {
+    if(block->err)
+        return block->err;
+
+    png_byte header[2];
+    int flevel = (writer->level == Z_DEFAULT_COMPRESSION) ? 2 : ((writer->level < 2) ? 0 : ((writer->level < 6) ? 1 : ((writer->level == 6) ? 2 : 3)));
+    header[0] = 0x78;
+    header[1] = flevel << 6;
+    header[1] += 31 - (((header[0] << 8) | header[1]) % 31);
+
+    writer->adler = adler32_combine(writer->adler, block->adler, block->in_size);
+    png_byte trailer[4];
+    putUint32(trailer, (uint32_t)writer->adler);
+
+    return writePNGChunk(writer->fp, "IDAT", header, block->first ? 2 : 0,
+                         block->out, block->out_size, block->crc,
+                         trailer, block->last ? 4 : 0);
+}
+
+// Write out finished bands in order until the first `until` bands are out,
+// waiting for any that are still being deflated
+static int flushPNGBlocks(pngwriter_t *writer, long until) {
+    int err = 0;
+    pthread_mutex_lock(&(writer->lock));
+    while(writer->written < until && !err) {
+        pngblock_t *block = &(writer->slots[writer->written % writer->num_slots]);
+        if(block->state != PNGWRITER_BLOCK_DONE) {
+            pthread_cond_wait(&(writer->cond), &(writer->lock));
+            continue;
+        }
+        pthread_mutex_unlock(&(writer->lock));
+        err = writePNGBlock(writer, block);
+        pthread_mutex_lock(&(writer->lock));
+        block->state = PNGWRITER_BLOCK_EMPTY;
+        writer->written++;
+    }
+    pthread_mutex_unlock(&(writer->lock));
+    return err;
+}
+
+int openPNGWriter(pngwriter_t **writer, char *filename, int width, int height, int num_threads) {
+    *writer = calloc(1, sizeof(pngwriter_t));
+    if(!*writer)
+        return ANAX_ERR_NO_MEMORY;
+    pngwriter_t *w = *writer;
+    w->width = width;
+    w->height = height;
+    w->level = png_level;
+    w->filter = png_filter;
+    w->rowbytes = (size_t)width * 4;
+    w->adler = adler32(0L, Z_NULL, 0);
+    pthread_mutex_init(&(w->lock), NULL);
+    pthread_cond_init(&(w->cond), NULL);
+
+    // Enough rows before each band to fill the deflate window, plus the row
+    // above those
+    w->context_rows = (int)((PNGWRITER_WINDOW + w->rowbytes) / (w->rowbytes + 1)) + 1;
+    w->band_rows = (int)((PNGWRITER_BLOCK_BYTES + w->rowbytes - 1) / w->rowbytes);
+    if(w->band_rows < w->context_rows)
+        w->band_rows = w->context_rows;
+
+    if(num_threads < 1) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = (cores < 1) ? 1 : (int)cores;
+    }
+    if(num_threads > PNGWRITER_MAX_THREADS)
+        num_threads = PNGWRITER_MAX_THREADS;
+    w->num_slots = 2 * num_threads;
+    w->slots = calloc(w->num_slots, sizeof(pngblock_t));
+    if(!w->slots) {
+        closePNGWriter(w);
+        *writer = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+    for(int i = 0; i < w->num_slots; i++) {
+        w->slots[i].raw = malloc((w->context_rows + w->band_rows) * w->rowbytes);
+        w->slots[i].filtered = malloc((w->context_rows + w->band_rows) * (w->rowbytes + 1));
+        if(!w->slots[i].raw || !w->slots[i].filtered) {
+            closePNGWriter(w);
+            *writer = NULL;
+            return ANAX_ERR_NO_MEMORY;
+        }
+    }
+
+    w->fp = fopen(filename, "w");
+    if(!w->fp) {
+        closePNGWriter(w);
+        *writer = NULL;
+        return ANAX_ERR_COULD_NOT_WRITE;
+    }
+
+    // Signature and header
+    png_byte signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    png_byte ihdr[13];
+    putUint32(ihdr, width);
+    putUint32(ihdr + 4, height);
+    ihdr[8] = 8;                        // Bit depth
+    ihdr[9] = PNG_COLOR_TYPE_RGB_ALPHA;
+    ihdr[10] = 0;                       // Deflate
+    ihdr[11] = 0;                       // Adaptive filtering
+    ihdr[12] = 0;                       // No interlacing
+    if(fwrite(signature, 1, 8, w->fp) != 8 ||
+       writePNGChunk(w->fp, "IHDR", ihdr, 13, NULL, 0, 0L, NULL, 0)) {
+        closePNGWriter(w);
+        *writer = NULL;
+        return ANAX_ERR_COULD_NOT_WRITE;
+    }
+
+    for(int i = 0; i < num_threads; i++) {
+        if(pthread_create(&(w->threads[w->num_threads]), NULL, deflatePNGBlocks, w) == 0)
+            w->num_threads++;
+    }
+    if(w->num_threads == 0) {
+        closePNGWriter(w);
+        *writer = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+
+    return 0;
+}
+
+int writePNGRow(pngwriter_t *writer, png_byte *row) {
+    if(writer->err)
+        return writer->err;
+    if(writer->rows_in >= writer->height)
+        return ANAX_ERR_INVALID_INVOCATION;
+
+    // Starting a band: wait for its slot to be written out, then carry over
+    // the tail of the band before as context
+    pngblock_t *block = &(writer->slots[writer->submitted % writer->num_slots]);
+    int row_in_band = writer->rows_in % writer->band_rows;
+    if(row_in_band == 0) {
+        writer->err = flushPNGBlocks(writer, writer->submitted - writer->num_slots + 1);
+        if(writer->err)
+            return writer->err;
+        block->first = (writer->submitted == 0);
+        block->rows = 0;
+        block->context_rows = 0;
+        if(!block->first) {
+            pngblock_t *prev = &(writer->slots[(writer->submitted - 1) % writer->num_slots]);
+            block->context_rows = writer->context_rows;
+            memcpy(block->raw, prev->raw + ((prev->context_rows + prev->rows - block->context_rows) * writer->rowbytes), block->context_rows * writer->rowbytes);
+        }
+    }
+
+    memcpy(block->raw + ((block->context_rows + block->rows) * writer->rowbytes), row, writer->rowbytes);
+    block->rows++;
+    writer->rows_in++;
+
+    // Queue the band once it is full
+    if(block->rows == writer->band_rows || writer->rows_in == writer->height) {
+        block->last = (writer->rows_in == writer->height);
+        pthread_mutex_lock(&(writer->lock));
+        block->state = PNGWRITER_BLOCK_QUEUED;
+        writer->submitted++;
+        pthread_cond_broadcast(&(writer->cond));
+        pthread_mutex_unlock(&(writer->lock));
+    }
+
+    return 0;
+}
+
+// Finish the image and free the writer
+int closePNGWriter(pngwriter_t *writer) {
+    int err = writer->err;
+    if(writer->fp && !err) {
+        if(writer->rows_in < writer->height)
+            err = ANAX_ERR_INVALID_INVOCATION;
+        else
+            err = flushPNGBlocks(writer, writer->submitted);
+        if(!err)
+            err = writePNGChunk(writer->fp, "IEND", NULL, 0, NULL, 0, 0L, NULL, 0);
+    }
+
+    pthread_mutex_lock(&(writer->lock));
+    writer->stop = 1;
+    pthread_cond_broadcast(&(writer->cond));
+    pthread_mutex_unlock(&(writer->lock));
+    for(int i = 0; i < writer->num_threads; i++)
+        pthread_join(writer->threads[i], NULL);
+
+    if(writer->fp && fclose(writer->fp) && !err)
+        err = ANAX_ERR_COULD_NOT_WRITE;
+    if(writer->slots) {
+        for(int i = 0; i < writer->num_slots; i++) {
+            free(writer->slots[i].raw);
+            free(writer->slots[i].filtered);
+            free(writer->slots[i].out);
+        }
+        free(writer->slots);
+    }
+    pthread_mutex_destroy(&(writer->lock));
+    pthread_cond_destroy(&(writer->cond));
+    free(writer);
+
+    return err;
+}
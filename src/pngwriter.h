@@ -0,0 +1,85 @@
+#ifndef PNGWRITER_H
+#define PNGWRITER_H
+
+#include <png.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <zlib.h>
+#include "globals.h"
+
+#define PNGWRITER_FILTER_NONE                       0
+#define PNGWRITER_FILTER_SUB                        1
+#define PNGWRITER_FILTER_UP                         2
+#define PNGWRITER_FILTER_AVERAGE                    3
+#define PNGWRITER_FILTER_PAETH                      4
+#define PNGWRITER_FILTER_ADAPTIVE                   5
+
+#define PNGWRITER_MAX_THREADS                       64
+#define PNGWRITER_BLOCK_BYTES                       (256 * 1024)
+#define PNGWRITER_WINDOW                            32768
+
+#define PNGWRITER_BLOCK_EMPTY                       0
+#define PNGWRITER_BLOCK_QUEUED                      1
+#define PNGWRITER_BLOCK_RUNNING                     2
+#define PNGWRITER_BLOCK_DONE                        3
+
+// A band of rows filtered and deflated on its own. Each band is preceded by
+// enough raw rows of the band before it to rebuild that band's last 32K of
+// filtered data, which primes the deflate window so that compression carries
+// on across bands as if they were one stream.
+struct png_block {
+    int state;
+    int first;              // First band of the image
+    int last;               // Last band of the image
+    int context_rows;
+    int rows;
+    png_byte *raw;          // context_rows + rows raw rows
+    png_byte *filtered;     // The same rows, filtered
+    size_t in_size;         // Filtered bytes in the band itself
+    png_byte *out;
+    size_t out_size;
+    uLong adler;            // Adler-32 of the filtered band
+    uLong crc;              // CRC-32 of out
+    int err;
+};
+typedef struct png_block pngblock_t;
+
+// Writes an 8-bit RGBA PNG a row at a time, deflating bands of rows on a pool
+// of threads as they fill. Each band becomes one IDAT chunk; together they
+// form a single zlib stream.
+struct png_writer {
+    FILE *fp;
+    int width;
+    int height;
+    int level;
+    int filter;
+    size_t rowbytes;
+    int band_rows;
+    int context_rows;
+    int rows_in;
+    uLong adler;
+    int err;
+    
+    // Bands are numbered in order; band n uses slot n % num_slots
+    int num_slots;
+    pngblock_t *slots;
+    long submitted;
+    long taken;
+    long written;
+    int stop;
+    
+    int num_threads;
+    pthread_t threads[PNGWRITER_MAX_THREADS];
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+typedef struct png_writer pngwriter_t;
+
+void setPNGWriterOptions(int level, int filter);
+int openPNGWriter(pngwriter_t **writer, char *filename, int width, int height, int num_threads);
+int writePNGRow(pngwriter_t *writer, png_byte *row);
+int closePNGWriter(pngwriter_t *writer);
+void *deflatePNGBlocks(void *argt);
+
+#endif
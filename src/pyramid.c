@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include "pyramid.h"
+
+// Name level n after outfile, e.g. out.png becomes out_1.png for level 1
+char *getPyramidLevelName(char *outfile, int level) {
+    char *dot = strrchr(outfile, '.');
+    char *slash = strrchr(outfile, '/');
+    if(dot && slash && dot < slash)
+        dot = NULL;
+    int stem = dot ? (int)(dot - outfile) : (int)strlen(outfile);
+    
+    char *name = calloc(strlen(outfile) + 16, sizeof(char));
+    if(!name)
+        return NULL;
+    sprintf(name, "%.*s_%i%s", stem, outfile, level, dot ? dot : "");
+    return name;
+}
+
+int initPyramid(pyramid_t **pyramid, char *outfile, int width, int height, int num_levels) {
+    *pyramid = calloc(1, sizeof(pyramid_t));
+    if(!*pyramid)
+        return ANAX_ERR_NO_MEMORY;
+    (*pyramid)->width = width;
+    (*pyramid)->height = height;
+    
+    // Stop once a level is down to a single pixel
+    if(num_levels > PYRAMID_MAX_LEVELS)
+        num_levels = PYRAMID_MAX_LEVELS;
+    (*pyramid)->levels = calloc(num_levels, sizeof(pyramidlevel_t));
+    if(!(*pyramid)->levels) {
+        freePyramid(*pyramid);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    int above_width = width;
+    int above_height = height;
+    for(int i = 0; i < num_levels && (above_width > 1 || above_height > 1); i++) {
+        pyramidlevel_t *level = &((*pyramid)->levels[i]);
+        (*pyramid)->num_levels++;
+        level->width = (above_width + 1) / 2;
+        level->height = (above_height + 1) / 2;
+        level->filename = getPyramidLevelName(outfile, i + 1);
+        level->pending = malloc(4 * above_width);
+        level->row = malloc(4 * level->width);
+        if(!level->filename || !level->pending || !level->row) {
+            freePyramid(*pyramid);
+            return ANAX_ERR_NO_MEMORY;
+        }
+        // Each level is a quarter the size of the one above, so one thread
+        // apiece keeps up
+        int err = openPNGWriter(&(level->writer), level->filename, level->width, level->height, 1);
+        if(err) {
+            freePyramid(*pyramid);
+            return err;
+        }
+        above_width = level->width;
+        above_height = level->height;
+    }
+    
+    return 0;
+}
+
+// Average each 2x2 block of two RGBA rows above_width pixels wide into the
+// width pixels of out. Color is weighted by alpha so transparent gaps don't
+// darken their edges.
+void reduceRGBARows(png_byte *top, png_byte *bottom, int above_width, png_byte *out, int width) {
+    for(int x = 0; x < width; x++) {
+        int c0 = 4 * (2 * x);
+        int c1 = (2 * x + 1 < above_width) ? c0 + 4 : c0;
+        png_byte *px[4] = {top + c0, top + c1, bottom + c0, bottom + c1};
+        unsigned int alpha = px[0][3] + px[1][3] + px[2][3] + px[3][3];
+        for(int ch = 0; ch < 3; ch++) {
+            if(alpha) {
+                unsigned int sum = 0;
+                for(int i = 0; i < 4; i++)
+                    sum += px[i][ch] * px[i][3];
+                out[4 * x + ch] = (sum + alpha / 2) / alpha;
+            } else {
+                out[4 * x + ch] = (px[0][ch] + px[1][ch] + px[2][ch] + px[3][ch] + 2) / 4;
+            }
+        }
+        out[4 * x + 3] = (alpha + 2) / 4;
+    }
+}
+
+// Hand a row of the level above to level n; every second row completes a
+// row of level n, which cascades down to level n + 1
+static int feedPyramidLevel(pyramid_t *pyramid, int n, png_byte *row) {
+    pyramidlevel_t *level = &(pyramid->levels[n]);
+    int above_width = n ? pyramid->levels[n - 1].width : pyramid->width;
+    
+    if(level->rows_in++ % 2 == 0) {
+        memcpy(level->pending, row, 4 * above_width);
+        return 0;
+    }
+    reduceRGBARows(level->pending, row, above_width, level->row, level->width);
+    int err = writePNGRow(level->writer, level->row);
+    if(err)
+        return err;
+    if(n + 1 < pyramid->num_levels)
+        return feedPyramidLevel(pyramid, n + 1, level->row);
+    return 0;
+}
+
+int pushPyramidRow(pyramid_t *pyramid, png_byte *row) {
+    if(pyramid->num_levels == 0)
+        return 0;
+    return feedPyramidLevel(pyramid, 0, row);
+}
+
+// Flush the unpaired last row of each odd-height level, from the top down so
+// that each level has received all of its rows before it is closed
+int finishPyramid(pyramid_t *pyramid) {
+    for(int n = 0; n < pyramid->num_levels; n++) {
+        pyramidlevel_t *level = &(pyramid->levels[n]);
+        int above_width = n ? pyramid->levels[n - 1].width : pyramid->width;
+        if(level->rows_in % 2) {
+            level->rows_in++;
+            reduceRGBARows(level->pending, level->pending, above_width, level->row, level->width);
+            int err = writePNGRow(level->writer, level->row);
+            if(err)
+                return err;
+            if(n + 1 < pyramid->num_levels) {
+                err = feedPyramidLevel(pyramid, n + 1, level->row);
+                if(err)
+                    return err;
+            }
+        }
+        
+        int err = closePNGWriter(level->writer);
+        level->writer = NULL;
+        if(err)
+            return err;
+    }
+    
+    return 0;
+}
+
+void freePyramid(pyramid_t *pyramid) {
+    if(pyramid->levels) {
+        for(int i = 0; i < pyramid->num_levels; i++) {
+            pyramidlevel_t *level = &(pyramid->levels[i]);
+            if(level->writer)
+                closePNGWriter(level->writer);
+            free(level->filename);
+            free(level->pending);
+            free(level->row);
+        }
+        free(pyramid->levels);
+    }
+    free(pyramid);
+}
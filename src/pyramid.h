@@ -0,0 +1,43 @@
+#ifndef PYRAMID_H
+#define PYRAMID_H
+
+#include <png.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "globals.h"
+#include "pngwriter.h"
+
+#define PYRAMID_MAX_LEVELS                          16
+
+// One level of an overview pyramid. Level n is 1/2^n the size of the full
+// image; each of its pixels averages a 2x2 block of the level above, or fewer
+// pixels along an odd right or bottom edge.
+struct pyramid_level {
+    char *filename;
+    pngwriter_t *writer;
+    int width;
+    int height;
+    int rows_in;            // Rows received from the level above
+    png_byte *pending;      // First row of a pair from the level above
+    png_byte *row;
+};
+typedef struct pyramid_level pyramidlevel_t;
+
+// Builds every level of the pyramid from the rows of the full image as they
+// are written, so the image only needs to be produced once
+struct pyramid {
+    int width;              // Full image
+    int height;
+    int num_levels;
+    pyramidlevel_t *levels;
+};
+typedef struct pyramid pyramid_t;
+
+int initPyramid(pyramid_t **pyramid, char *outfile, int width, int height, int num_levels);
+int pushPyramidRow(pyramid_t *pyramid, png_byte *row);
+int finishPyramid(pyramid_t *pyramid);
+void freePyramid(pyramid_t *pyramid);
+char *getPyramidLevelName(char *outfile, int level);
+void reduceRGBARows(png_byte *top, png_byte *bottom, int above_width, png_byte *out, int width);
+
+#endif
@@ -0,0 +1,337 @@
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "globals.h"
+#include "resample.h"
+
+// Output pixels whose valid source samples carry less weight than this are
+// left as no data
+#define RESAMPLE_MIN_WEIGHT                         0.001f
+
+static double getKernelRadius(int kernel) {
+    switch(kernel) {
+        case RESAMPLE_BILINEAR:
+            return 1.0;
+        case RESAMPLE_LANCZOS:
+            return 3.0;
+        default:
+            return 0.5;
+    }
+}
+
+static double evalKernel(int kernel, double x) {
+    x = fabs(x);
+    switch(kernel) {
+        case RESAMPLE_BILINEAR:
+            return (x < 1.0) ? 1.0 - x : 0.0;
+        case RESAMPLE_LANCZOS:
+            if(x < 1e-8)
+                return 1.0;
+            if(x >= 3.0)
+                return 0.0;
+            return (3.0 * sin(M_PI * x) * sin(M_PI * x / 3.0)) / (M_PI * M_PI * x * x);
+        default:
+            // Samples exactly on the edge of a box are shared with the next one
+            if(x < 0.5)
+                return 1.0;
+            return (x == 0.5) ? 0.5 : 0.0;
+    }
+}
+
+int initResampleAxis(resampleaxis_t **axis, int in_size, int out_size, int halo, int kernel) {
+    // When shrinking, the kernel is stretched so that it covers every source
+    // pixel falling within an output pixel
+    double ratio = (double)out_size / (double)in_size;
+    double stretch = (ratio < 1.0) ? 1.0 / ratio : 1.0;
+    double radius = getKernelRadius(kernel) * stretch;
+    int taps = (int)ceil(2.0 * radius) + 1;
+
+    *axis = calloc(1, sizeof(resampleaxis_t));
+    if(!*axis)
+        return ANAX_ERR_NO_MEMORY;
+    (*axis)->out_size = out_size;
+    (*axis)->taps = taps;
+    (*axis)->first = calloc(out_size, sizeof(int));
+    (*axis)->count = calloc(out_size, sizeof(int));
+    (*axis)->weights = calloc((size_t)out_size * taps, sizeof(float));
+    if(!(*axis)->first || !(*axis)->count || !(*axis)->weights) {
+        freeResampleAxis(*axis);
+        *axis = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+
+    for(int o = 0; o < out_size; o++) {
+        // Same pixel-center convention as scaleGeotransform
+        double center = ((o + 0.5) / ratio) - 0.5;
+        int lo = (int)ceil(center - radius);
+        int hi = (int)floor(center + radius);
+        if(lo < -halo)
+            lo = -halo;
+        if(hi > in_size + halo - 1)
+            hi = in_size + halo - 1;
+        if(hi - lo + 1 > taps)
+            hi = lo + taps - 1;
+
+        float *w = (*axis)->weights + ((size_t)o * taps);
+        double total = 0.0;
+        for(int i = lo; i <= hi; i++) {
+            double v = evalKernel(kernel, (i - center) / stretch);
+            w[i - lo] = (float)v;
+            total += v;
+        }
+        if(total != 0.0) {
+            for(int i = lo; i <= hi; i++)
+                w[i - lo] = (float)(w[i - lo] / total);
+        }
+        (*axis)->first[o] = lo;
+        (*axis)->count[o] = hi - lo + 1;
+    }
+
+    return 0;
+}
+
+void freeResampleAxis(resampleaxis_t *axis) {
+    if(!axis)
+        return;
+    free(axis->first);
+    free(axis->count);
+    free(axis->weights);
+    free(axis);
+}
+
+#ifdef __SSE2__
+// Widens the low or high four of eight 16-bit lanes to float
+static inline __m128 widenLow4(__m128i v, __m128i ext) {
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, ext));
+}
+
+static inline __m128 widenHigh4(__m128i v, __m128i ext) {
+    return _mm_cvtepi32_ps(_mm_unpackhi_epi16(v, ext));
+}
+#endif
+
+// Filters count source rows down to one. elev, water and relief point at the
+// first source column of each row (water and relief may be NULL), and acc
+// receives four rows of num_cols values: the weighted elevation, the total
+// weight of the valid samples, and the weighted water and relief. Samples with
+// no data carry no weight.
+static void filterRows(const int16_t **elev, const uint8_t **water, const uint8_t **relief, const float *weights, int count, int num_cols, float *acc) {
+    float *sum = acc;
+    float *total = acc + num_cols;
+    float *wsum = acc + (2 * num_cols);
+    float *rsum = acc + (3 * num_cols);
+    int c = 0;
+
+    // Each block of columns is summed over all rows in registers
+#ifdef __SSE2__
+    __m128i nodata = _mm_set1_epi16(RESAMPLE_NODATA);
+    __m128i zero = _mm_setzero_si128();
+    for(; c + 8 <= num_cols; c += 8) {
+        __m128 s_lo = _mm_setzero_ps(), s_hi = _mm_setzero_ps();
+        __m128 t_lo = _mm_setzero_ps(), t_hi = _mm_setzero_ps();
+        __m128 w_lo = _mm_setzero_ps(), w_hi = _mm_setzero_ps();
+        __m128 r_lo = _mm_setzero_ps(), r_hi = _mm_setzero_ps();
+        for(int k = 0; k < count; k++) {
+            __m128 vweight = _mm_set1_ps(weights[k]);
+            __m128i e = _mm_loadu_si128((const __m128i *)(elev[k] + c));
+            __m128i invalid = _mm_cmpeq_epi16(e, nodata);
+            __m128 v_lo = _mm_andnot_ps(_mm_castsi128_ps(_mm_unpacklo_epi16(invalid, invalid)), vweight);
+            __m128 v_hi = _mm_andnot_ps(_mm_castsi128_ps(_mm_unpackhi_epi16(invalid, invalid)), vweight);
+            __m128i sign = _mm_srai_epi16(e, 15);
+            s_lo = _mm_add_ps(s_lo, _mm_mul_ps(v_lo, widenLow4(e, sign)));
+            s_hi = _mm_add_ps(s_hi, _mm_mul_ps(v_hi, widenHigh4(e, sign)));
+            t_lo = _mm_add_ps(t_lo, v_lo);
+            t_hi = _mm_add_ps(t_hi, v_hi);
+            if(water) {
+                __m128i w = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(water[k] + c)), zero);
+                w_lo = _mm_add_ps(w_lo, _mm_mul_ps(v_lo, widenLow4(w, zero)));
+                w_hi = _mm_add_ps(w_hi, _mm_mul_ps(v_hi, widenHigh4(w, zero)));
+            }
+            if(relief) {
+                __m128i r = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(relief[k] + c)), zero);
+                r_lo = _mm_add_ps(r_lo, _mm_mul_ps(v_lo, widenLow4(r, zero)));
+                r_hi = _mm_add_ps(r_hi, _mm_mul_ps(v_hi, widenHigh4(r, zero)));
+            }
+        }
+        _mm_storeu_ps(sum + c, s_lo);
+        _mm_storeu_ps(sum + c + 4, s_hi);
+        _mm_storeu_ps(total + c, t_lo);
+        _mm_storeu_ps(total + c + 4, t_hi);
+        _mm_storeu_ps(wsum + c, w_lo);
+        _mm_storeu_ps(wsum + c + 4, w_hi);
+        _mm_storeu_ps(rsum + c, r_lo);
+        _mm_storeu_ps(rsum + c + 4, r_hi);
+    }
+#endif
+
+    for(; c < num_cols; c++) {
+        float s = 0.0f, t = 0.0f, w = 0.0f, r = 0.0f;
+        for(int k = 0; k < count; k++) {
+            float v = (elev[k][c] != RESAMPLE_NODATA) ? weights[k] : 0.0f;
+            s += v * elev[k][c];
+            t += v;
+            if(water)
+                w += v * water[k][c];
+            if(relief)
+                r += v * relief[k][c];
+        }
+        sum[c] = s;
+        total[c] = t;
+        wsum[c] = w;
+        rsum[c] = r;
+    }
+}
+
+static void filterColumn(const float *acc, int num_cols, const resampleaxis_t *cols, int c, float *out) {
+    // Filters the four rows of acc horizontally to output column c; acc starts
+    // at the first source column of the output row
+    const float *w = cols->weights + ((size_t)c * cols->taps);
+    const float *p = acc + (cols->first[c] - cols->first[0]);
+    float s = 0.0f, t = 0.0f, wa = 0.0f, re = 0.0f;
+    for(int k = 0; k < cols->count[c]; k++) {
+        s += w[k] * p[k];
+        t += w[k] * p[num_cols + k];
+        wa += w[k] * p[(2 * num_cols) + k];
+        re += w[k] * p[(3 * num_cols) + k];
+    }
+    out[0] = s;
+    out[1] = t;
+    out[2] = wa;
+    out[3] = re;
+}
+
+void *resampleBand(void *argt) {
+    resampleband_t *band = (resampleband_t *)argt;
+    geotiffmap_t *src = band->src;
+    geotiffmap_t *dst = band->dst;
+    resampleaxis_t *rows = band->rows;
+    resampleaxis_t *cols = band->cols;
+    int width = cols->out_size;
+    int src_halo = src->elevation->halo;
+    int halo = dst->elevation->halo;
+
+    // Each output row is filtered vertically into a single row covering the
+    // source columns the output spans, which is then filtered horizontally.
+    // Going in this order keeps the wide pass over contiguous source rows.
+    int first_col = cols->first[0];
+    int num_cols = cols->first[width - 1] + cols->count[width - 1] - first_col;
+    float *acc = malloc((size_t)4 * num_cols * sizeof(float));
+    const int16_t **src_elev = malloc(rows->taps * sizeof(int16_t *));
+    const uint8_t **src_water = malloc(rows->taps * sizeof(uint8_t *));
+    const uint8_t **src_relief = malloc(rows->taps * sizeof(uint8_t *));
+    if(!acc || !src_elev || !src_water || !src_relief) {
+        free(acc);
+        free(src_elev);
+        free(src_water);
+        free(src_relief);
+        band->err = ANAX_ERR_NO_MEMORY;
+        return NULL;
+    }
+
+    for(int o = band->first_row; o < band->last_row; o++) {
+        for(int k = 0; k < rows->count[o]; k++) {
+            int r = rows->first[o] + k + src_halo;
+            src_elev[k] = MAPBUF_ROW(src->elevation, int16_t, r) + src_halo + first_col;
+            if(src->water)
+                src_water[k] = MAPBUF_ROW(src->water, uint8_t, r) + src_halo + first_col;
+            if(src->relief)
+                src_relief[k] = MAPBUF_ROW(src->relief, uint8_t, r) + src_halo + first_col;
+        }
+        filterRows(src_elev, src->water ? src_water : NULL, src->relief ? src_relief : NULL, rows->weights + ((size_t)o * rows->taps), rows->count[o], num_cols, acc);
+
+        int16_t *elev = MAPBUF_ROW(dst->elevation, int16_t, o + halo) + halo;
+        uint8_t *water = dst->water ? MAPBUF_ROW(dst->water, uint8_t, o + halo) + halo : NULL;
+        uint8_t *relief = dst->relief ? MAPBUF_ROW(dst->relief, uint8_t, o + halo) + halo : NULL;
+        for(int c = 0; c < width; c++) {
+            float f[4];
+            filterColumn(acc, num_cols, cols, c, f);
+            if(f[1] < RESAMPLE_MIN_WEIGHT) {
+                elev[c] = RESAMPLE_NODATA;
+                if(water)
+                    water[c] = 0;
+                if(relief)
+                    relief[c] = 255;
+                continue;
+            }
+
+            long e = lrintf(f[0] / f[1]);
+            elev[c] = (int16_t)((e < INT16_MIN) ? INT16_MIN : ((e > INT16_MAX) ? INT16_MAX : e));
+
+            // A pixel is water if most of what it covers is
+            if(water)
+                water[c] = (f[2] / f[1] >= 0.5f) ? 1 : 0;
+            if(relief) {
+                long r = lrintf(f[3] / f[1]);
+                relief[c] = (uint8_t)((r < 0) ? 0 : ((r > 255) ? 255 : r));
+            }
+        }
+    }
+
+    free(acc);
+    free(src_elev);
+    free(src_water);
+    free(src_relief);
+    return NULL;
+}
+
+static int getResampleBands(int rows) {
+    // Only split tall maps, and into no more bands than there are cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_bands = rows / RESAMPLE_BAND_MIN_ROWS;
+    if(cores > 0 && num_bands > cores)
+        num_bands = (int)cores;
+    if(num_bands > RESAMPLE_MAX_THREADS)
+        num_bands = RESAMPLE_MAX_THREADS;
+    return (num_bands < 1) ? 1 : num_bands;
+}
+
+int resampleMap(geotiffmap_t *src, geotiffmap_t *dst, int kernel) {
+    // Weights are computed once per axis; the source halo is used so that
+    // pixels along the edges see their neighbors in adjacent tiles
+    resampleaxis_t *rows = NULL;
+    resampleaxis_t *cols = NULL;
+    int halo = src->elevation->halo;
+    int err = initResampleAxis(&rows, src->height, dst->height, halo, kernel);
+    if(!err)
+        err = initResampleAxis(&cols, src->width, dst->width, halo, kernel);
+    if(err) {
+        freeResampleAxis(rows);
+        return err;
+    }
+
+    // The calling thread takes the first band
+    resampleband_t bands[RESAMPLE_MAX_THREADS];
+    pthread_t threads[RESAMPLE_MAX_THREADS];
+    int spawned[RESAMPLE_MAX_THREADS] = {0};
+    int num_bands = getResampleBands(dst->height);
+    for(int b = 0; b < num_bands; b++) {
+        bands[b].src = src;
+        bands[b].dst = dst;
+        bands[b].rows = rows;
+        bands[b].cols = cols;
+        bands[b].first_row = (int)(((long)dst->height * b) / num_bands);
+        bands[b].last_row = (int)(((long)dst->height * (b + 1)) / num_bands);
+        bands[b].err = 0;
+    }
+    for(int b = 1; b < num_bands; b++) {
+        if(pthread_create(&(threads[b]), NULL, resampleBand, &(bands[b])) == 0)
+            spawned[b] = 1;
+        else
+            resampleBand(&(bands[b]));
+    }
+    resampleBand(&(bands[0]));
+    for(int b = 0; b < num_bands; b++) {
+        if(spawned[b])
+            pthread_join(threads[b], NULL);
+        if(bands[b].err)
+            err = bands[b].err;
+    }
+
+    freeResampleAxis(rows);
+    freeResampleAxis(cols);
+    return err;
+}
@@ -0,0 +1,46 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libanax.h"
+
+#define RESAMPLE_BOX                                0
+#define RESAMPLE_BILINEAR                           1
+#define RESAMPLE_LANCZOS                            2
+
+#define RESAMPLE_NODATA                             -9999
+#define RESAMPLE_MAX_THREADS                        64
+#define RESAMPLE_BAND_MIN_ROWS                      64
+
+// The weights taking one axis of a map to one axis of its resampled copy.
+// Output index o is the weighted sum of the count[o] source indices starting
+// at first[o], whose weights are weights[o * taps] onward. Source indices are
+// relative to the interior of the map and may reach into the halo.
+struct resample_axis {
+    int out_size;
+    int taps;
+    int *first;
+    int *count;
+    float *weights;
+};
+typedef struct resample_axis resampleaxis_t;
+
+// One row band of a resampling pass
+struct resample_band {
+    geotiffmap_t *src;
+    geotiffmap_t *dst;
+    resampleaxis_t *rows;
+    resampleaxis_t *cols;
+    int first_row;
+    int last_row;
+    int err;
+};
+typedef struct resample_band resampleband_t;
+
+int initResampleAxis(resampleaxis_t **axis, int in_size, int out_size, int halo, int kernel);
+void freeResampleAxis(resampleaxis_t *axis);
+int resampleMap(geotiffmap_t *src, geotiffmap_t *dst, int kernel);
+void *resampleBand(void *argt);
+
+#endif
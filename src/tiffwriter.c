@@ -0,0 +1,492 @@
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "globals.h"
+#include "pyramid.h"
+#include "tiffwriter.h"
+
+#define TIFF_SHORT                                  3
+#define TIFF_LONG                                   4
+#define TIFF_DOUBLE                                 12
+#define TIFF_LONG8                                  16
+
+// Georeferencing of the full image, in GeoTIFF's terms
+struct tiff_geo {
+    double pixel_scale[3];
+    double tiepoint[6];
+    uint16_t keys[16];
+    int num_keys;
+};
+typedef struct tiff_geo tiffgeo_t;
+
+// An IFD being serialized at a known file offset. Values too big for an
+// entry go in the area after the entries. With no buffer, only the size is
+// worked out.
+struct tiff_ifd {
+    uint8_t *buf;
+    uint64_t base;
+    size_t entry_pos;
+    size_t extra_pos;
+};
+typedef struct tiff_ifd tiffifd_t;
+
+static void putLE(uint8_t *buf, uint64_t value, int bytes) {
+    for(int i = 0; i < bytes; i++)
+        buf[i] = (value >> (8 * i)) & 0xff;
+}
+
+static int getTypeSize(int type) {
+    return (type == TIFF_SHORT) ? 2 : ((type == TIFF_LONG) ? 4 : 8);
+}
+
+// Add an entry of count values, each either an integer from ints or a
+// double from doubles
+static void addTIFFEntry(tiffifd_t *ifd, int tag, int type, uint64_t count, const uint64_t *ints, const double *doubles) {
+    int size = getTypeSize(type);
+    uint64_t bytes = count * size;
+    size_t pos = ifd->entry_pos;
+    ifd->entry_pos += 20;
+    if(bytes > 8) {
+        pos = ifd->extra_pos;
+        ifd->extra_pos += (bytes + 7) & ~(uint64_t)7;
+    }
+    if(!ifd->buf)
+        return;
+
+    uint8_t *entry = ifd->buf + ifd->entry_pos - 20;
+    putLE(entry, tag, 2);
+    putLE(entry + 2, type, 2);
+    putLE(entry + 4, count, 8);
+    uint8_t *values = entry + 12;
+    if(bytes > 8) {
+        putLE(entry + 12, ifd->base + pos, 8);
+        values = ifd->buf + pos;
+    }
+    for(uint64_t i = 0; i < count; i++) {
+        if(doubles) {
+            uint64_t bits;
+            memcpy(&bits, &(doubles[i]), 8);
+            putLE(values + (i * size), bits, size);
+        } else {
+            putLE(values + (i * size), ints ? ints[i] : 0, size);
+        }
+    }
+}
+
+// Serialize the IFD of one level. Returns its size in bytes.
+static size_t buildTIFFDirectory(tiffwriter_t *writer, int level, tiffgeo_t *geo, uint64_t next_ifd, uint8_t *buf) {
+    tifflevel_t *lvl = &(writer->levels[level]);
+    uint64_t num_blocks = (uint64_t)lvl->blocks_across * lvl->blocks_down;
+    int num_entries = level ? 14 : 17;
+    tiffifd_t ifd;
+    ifd.buf = buf;
+    ifd.base = lvl->ifd_offset;
+    ifd.entry_pos = 8;
+    ifd.extra_pos = 8 + (num_entries * 20) + 8;
+    if(buf)
+        putLE(buf, num_entries, 8);
+
+    uint64_t subfile = level ? 1 : 0;
+    uint64_t width = lvl->width;
+    uint64_t height = lvl->height;
+    uint64_t bits[4] = {8, 8, 8, 8};
+    uint64_t compression = 1;
+    uint64_t photometric = 2;       // RGB
+    uint64_t samples = 4;
+    uint64_t planar = 1;            // Contiguous
+    uint64_t block = TIFFWRITER_BLOCK;
+    uint64_t extra = 2;             // Unassociated alpha
+    uint64_t format[4] = {1, 1, 1, 1};
+    addTIFFEntry(&ifd, 254, TIFF_LONG, 1, &subfile, NULL);
+    addTIFFEntry(&ifd, 256, TIFF_LONG, 1, &width, NULL);
+    addTIFFEntry(&ifd, 257, TIFF_LONG, 1, &height, NULL);
+    addTIFFEntry(&ifd, 258, TIFF_SHORT, 4, bits, NULL);
+    addTIFFEntry(&ifd, 259, TIFF_SHORT, 1, &compression, NULL);
+    addTIFFEntry(&ifd, 262, TIFF_SHORT, 1, &photometric, NULL);
+    addTIFFEntry(&ifd, 277, TIFF_SHORT, 1, &samples, NULL);
+    addTIFFEntry(&ifd, 284, TIFF_SHORT, 1, &planar, NULL);
+    addTIFFEntry(&ifd, 322, TIFF_LONG, 1, &block, NULL);
+    addTIFFEntry(&ifd, 323, TIFF_LONG, 1, &block, NULL);
+
+    // Block offsets and sizes
+    uint64_t *offsets = NULL;
+    uint64_t *counts = NULL;
+    if(buf) {
+        offsets = malloc(num_blocks * sizeof(uint64_t));
+        counts = malloc(num_blocks * sizeof(uint64_t));
+        if(!offsets || !counts) {
+            free(offsets);
+            free(counts);
+            return 0;
+        }
+        for(uint64_t i = 0; i < num_blocks; i++) {
+            offsets[i] = lvl->data_offset + (i * writer->block_bytes);
+            counts[i] = writer->block_bytes;
+        }
+    }
+    addTIFFEntry(&ifd, 324, TIFF_LONG8, num_blocks, offsets, NULL);
+    addTIFFEntry(&ifd, 325, TIFF_LONG8, num_blocks, counts, NULL);
+    free(offsets);
+    free(counts);
+
+    addTIFFEntry(&ifd, 338, TIFF_SHORT, 1, &extra, NULL);
+    addTIFFEntry(&ifd, 339, TIFF_SHORT, 4, format, NULL);
+    if(!level) {
+        uint64_t keys[16];
+        for(int i = 0; i < geo->num_keys; i++)
+            keys[i] = geo->keys[i];
+        addTIFFEntry(&ifd, 33550, TIFF_DOUBLE, 3, NULL, geo->pixel_scale);
+        addTIFFEntry(&ifd, 33922, TIFF_DOUBLE, 6, NULL, geo->tiepoint);
+        addTIFFEntry(&ifd, 34735, TIFF_SHORT, geo->num_keys, keys, NULL);
+    }
+    if(buf)
+        putLE(buf + ifd.entry_pos, next_ifd, 8);
+
+    return ifd.extra_pos;
+}
+
+// Georeference the full image from its top-left tile. Tile corners are
+// pixel centers, and the tiepoint is the outer corner of the first pixel.
+static void getTIFFGeo(tilelist_t *tilelist, int projection, tiffgeo_t *geo) {
+    tile_t *tile = &(tilelist->tiles[0]);
+    for(int i = 0; i < tilelist->num_tiles; i++) {
+        if(tilelist->tiles[i].top_row == 0 && tilelist->tiles[i].left_col == 0)
+            tile = &(tilelist->tiles[i]);
+    }
+
+    double west = tile->west;
+    double east = tile->east;
+    double north = tile->north;
+    double south = tile->south;
+    int num_keys = 3;
+    uint16_t keys[16] = {1, 1, 0, 3,
+                         1024, 0, 1, 2,         // Geographic
+                         1025, 0, 1, 1,         // Pixel is area
+                         2048, 0, 1, 4326};     // WGS 84
+    if(projection == PROJ_MERCATOR) {
+        // Spherical Mercator, in meters
+        west *= (M_PI / 180.0) * TIFFWRITER_EARTH_RADIUS;
+        east *= (M_PI / 180.0) * TIFFWRITER_EARTH_RADIUS;
+        north = TIFFWRITER_EARTH_RADIUS * log(tan((M_PI / 4.0) + (north * (M_PI / 360.0))));
+        south = TIFFWRITER_EARTH_RADIUS * log(tan((M_PI / 4.0) + (south * (M_PI / 360.0))));
+        keys[4] = 1024; keys[7] = 1;            // Projected
+        keys[12] = 3072; keys[15] = 3857;       // Web Mercator
+    }
+
+    geo->pixel_scale[0] = (east - west) / (tile->img_width - 1);
+    geo->pixel_scale[1] = (north - south) / (tile->img_height - 1);
+    geo->pixel_scale[2] = 0.0;
+    geo->tiepoint[0] = 0.0;
+    geo->tiepoint[1] = 0.0;
+    geo->tiepoint[2] = 0.0;
+    geo->tiepoint[3] = west - (geo->pixel_scale[0] / 2.0);
+    geo->tiepoint[4] = north + (geo->pixel_scale[1] / 2.0);
+    geo->tiepoint[5] = 0.0;
+    geo->num_keys = 4 * (num_keys + 1);
+    memcpy(geo->keys, keys, sizeof(keys));
+}
+
+static int writeTIFFBytes(int fd, void *buf, size_t size, uint64_t offset) {
+    while(size) {
+        ssize_t n = pwrite(fd, buf, size, (off_t)offset);
+        if(n <= 0)
+            return ANAX_ERR_COULD_NOT_WRITE;
+        buf = (uint8_t *)buf + n;
+        size -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Reads the rows of a rendered tile in order, whether it is bare RGBA or a PNG
+struct tiff_source {
+    tile_t *tile;
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+};
+typedef struct tiff_source tiffsource_t;
+
+static int readTIFFSourceRows(tiffsource_t *src, png_byte *buf, int rows) {
+    size_t rowbytes = (size_t)src->tile->img_width * 4;
+    if(src->tile->raw) {
+        if(fread(buf, rowbytes, rows, src->fp) != rows)
+            return ANAX_ERR_FILE_DOES_NOT_EXIST;
+        return 0;
+    }
+    if(setjmp(png_jmpbuf(src->png_ptr)))
+        return ANAX_ERR_PNG_STRUCT_FAILURE;
+    for(int r = 0; r < rows; r++)
+        png_read_row(src->png_ptr, buf + (r * rowbytes), NULL);
+    return 0;
+}
+
+// Copy one rendered tile into the blocks it covers, a band of block rows at
+// a time. Where the tile spans a whole block, the band is a single write.
+static int writeTIFFSource(tiffwriter_t *writer, tile_t *tile) {
+    tifflevel_t *lvl = &(writer->levels[0]);
+    size_t rowbytes = (size_t)tile->img_width * 4;
+    size_t block_rowbytes = TIFFWRITER_BLOCK * 4;
+    tiffsource_t src;
+    memset(&src, 0, sizeof(tiffsource_t));
+    src.tile = tile;
+    src.fp = fopen(tile->name, "r");
+    if(!src.fp)
+        return ANAX_ERR_FILE_DOES_NOT_EXIST;
+    if(!tile->raw) {
+        src.png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if(src.png_ptr)
+            src.info_ptr = png_create_info_struct(src.png_ptr);
+        if(!src.info_ptr || setjmp(png_jmpbuf(src.png_ptr))) {
+            if(src.png_ptr)
+                png_destroy_read_struct(&(src.png_ptr), &(src.info_ptr), NULL);
+            fclose(src.fp);
+            return ANAX_ERR_PNG_STRUCT_FAILURE;
+        }
+        png_init_io(src.png_ptr, src.fp);
+        png_read_info(src.png_ptr, src.info_ptr);
+    }
+
+    int err = 0;
+    png_byte *band = malloc(rowbytes * TIFFWRITER_BLOCK);
+    png_byte *block = malloc(block_rowbytes * TIFFWRITER_BLOCK);
+    if(!band || !block)
+        err = ANAX_ERR_NO_MEMORY;
+    for(int y = tile->top_row; y <= tile->bottom_row && !err; ) {
+        int by = y / TIFFWRITER_BLOCK;
+        int block_row = y % TIFFWRITER_BLOCK;
+        int rows = TIFFWRITER_BLOCK - block_row;
+        if(y + rows > tile->bottom_row + 1)
+            rows = tile->bottom_row + 1 - y;
+        err = readTIFFSourceRows(&src, band, rows);
+
+        for(int bx = tile->left_col / TIFFWRITER_BLOCK; bx <= tile->right_col / TIFFWRITER_BLOCK && !err; bx++) {
+            int c0 = (bx * TIFFWRITER_BLOCK > tile->left_col) ? bx * TIFFWRITER_BLOCK : tile->left_col;
+            int c1 = ((bx + 1) * TIFFWRITER_BLOCK < tile->right_col + 1) ? (bx + 1) * TIFFWRITER_BLOCK : tile->right_col + 1;
+            size_t src_offset = (size_t)(c0 - tile->left_col) * 4;
+            uint64_t offset = lvl->data_offset + ((((uint64_t)by * lvl->blocks_across) + bx) * writer->block_bytes) +
+                              ((((uint64_t)block_row * TIFFWRITER_BLOCK) + (c0 - (bx * TIFFWRITER_BLOCK))) * 4);
+            if(c1 - c0 == TIFFWRITER_BLOCK) {
+                for(int r = 0; r < rows; r++)
+                    memcpy(block + (r * block_rowbytes), band + (r * rowbytes) + src_offset, block_rowbytes);
+                err = writeTIFFBytes(writer->fd, block, rows * block_rowbytes, offset);
+            } else {
+                for(int r = 0; r < rows && !err; r++)
+                    err = writeTIFFBytes(writer->fd, band + (r * rowbytes) + src_offset, (size_t)(c1 - c0) * 4, offset + (r * block_rowbytes));
+            }
+        }
+        y += rows;
+    }
+
+    free(band);
+    free(block);
+    if(src.png_ptr)
+        png_destroy_read_struct(&(src.png_ptr), &(src.info_ptr), NULL);
+    fclose(src.fp);
+    return err;
+}
+
+// Take rendered tiles until none are left
+void *writeTIFFTiles(void *argt) {
+    tiffwriter_t *writer = (tiffwriter_t *)argt;
+    while(1) {
+        pthread_mutex_lock(&(writer->lock));
+        long i = writer->next++;
+        int stop = writer->err;
+        pthread_mutex_unlock(&(writer->lock));
+        if(stop || i >= writer->tilelist->num_tiles)
+            break;
+
+        int err = writeTIFFSource(writer, &(writer->tilelist->tiles[i]));
+        pthread_mutex_lock(&(writer->lock));
+        if(err)
+            writer->err = err;
+        writer->done++;
+        if(writer->uilist) {
+            updateFinalUIState(&(writer->uilist->final), (writer->done * 100) / writer->tilelist->num_tiles);
+            updateFinalView(&(writer->uilist->final));
+        }
+        pthread_mutex_unlock(&(writer->lock));
+    }
+    return NULL;
+}
+
+// Build one block of an overview from the 2x2 blocks under it
+static int writeTIFFOverviewBlock(tiffwriter_t *writer, long n, png_byte *region, png_byte *out) {
+    tifflevel_t *lvl = &(writer->levels[writer->level]);
+    tifflevel_t *above = &(writer->levels[writer->level - 1]);
+    int bx = n % lvl->blocks_across;
+    int by = n / lvl->blocks_across;
+    size_t block_rowbytes = TIFFWRITER_BLOCK * 4;
+    size_t region_rowbytes = 2 * block_rowbytes;
+
+    // Gather the blocks above into one region twice the size of a block
+    memset(region, 0, region_rowbytes * 2 * TIFFWRITER_BLOCK);
+    for(int dy = 0; dy < 2; dy++) {
+        for(int dx = 0; dx < 2; dx++) {
+            int ax = (2 * bx) + dx;
+            int ay = (2 * by) + dy;
+            if(ax >= above->blocks_across || ay >= above->blocks_down)
+                continue;
+            uint64_t offset = above->data_offset + ((((uint64_t)ay * above->blocks_across) + ax) * writer->block_bytes);
+            for(int r = 0; r < TIFFWRITER_BLOCK; r++) {
+                png_byte *dst = region + (((dy * TIFFWRITER_BLOCK) + r) * region_rowbytes) + (dx * block_rowbytes);
+                if(pread(writer->fd, dst, block_rowbytes, (off_t)(offset + (r * block_rowbytes))) != block_rowbytes)
+                    return ANAX_ERR_FILE_DOES_NOT_EXIST;
+            }
+        }
+    }
+
+    // Only the part of the region inside the image is averaged; odd edges
+    // average the pixels that exist
+    int valid_width = above->width - (2 * bx * TIFFWRITER_BLOCK);
+    int valid_height = above->height - (2 * by * TIFFWRITER_BLOCK);
+    valid_width = (valid_width > 2 * TIFFWRITER_BLOCK) ? 2 * TIFFWRITER_BLOCK : valid_width;
+    valid_height = (valid_height > 2 * TIFFWRITER_BLOCK) ? 2 * TIFFWRITER_BLOCK : valid_height;
+    memset(out, 0, block_rowbytes * TIFFWRITER_BLOCK);
+    for(int r = 0; r < (valid_height + 1) / 2; r++) {
+        int bottom = ((2 * r) + 1 < valid_height) ? (2 * r) + 1 : 2 * r;
+        reduceRGBARows(region + ((2 * r) * region_rowbytes), region + (bottom * region_rowbytes), valid_width, out + (r * block_rowbytes), (valid_width + 1) / 2);
+    }
+
+    uint64_t offset = lvl->data_offset + ((((uint64_t)by * lvl->blocks_across) + bx) * writer->block_bytes);
+    return writeTIFFBytes(writer->fd, out, writer->block_bytes, offset);
+}
+
+// Take blocks of the current overview until none are left
+void *writeTIFFOverview(void *argt) {
+    tiffwriter_t *writer = (tiffwriter_t *)argt;
+    tifflevel_t *lvl = &(writer->levels[writer->level]);
+    long num_blocks = (long)lvl->blocks_across * lvl->blocks_down;
+    png_byte *region = malloc(4 * writer->block_bytes);
+    png_byte *out = malloc(writer->block_bytes);
+    int err = (!region || !out) ? ANAX_ERR_NO_MEMORY : 0;
+
+    while(!err) {
+        pthread_mutex_lock(&(writer->lock));
+        long n = writer->next++;
+        int stop = writer->err;
+        pthread_mutex_unlock(&(writer->lock));
+        if(stop || n >= num_blocks)
+            break;
+        err = writeTIFFOverviewBlock(writer, n, region, out);
+    }
+    if(err) {
+        pthread_mutex_lock(&(writer->lock));
+        writer->err = err;
+        pthread_mutex_unlock(&(writer->lock));
+    }
+
+    free(region);
+    free(out);
+    return NULL;
+}
+
+// Run func on up to num_threads threads, the calling thread among them
+static int runTIFFPass(tiffwriter_t *writer, void *(*func)(void *), long num_items, int num_threads) {
+    pthread_t threads[TIFFWRITER_MAX_THREADS];
+    int spawned[TIFFWRITER_MAX_THREADS] = {0};
+    if(num_threads > num_items)
+        num_threads = (num_items > 0) ? (int)num_items : 1;
+
+    writer->next = 0;
+    for(int t = 1; t < num_threads; t++) {
+        if(pthread_create(&(threads[t]), NULL, func, writer) == 0)
+            spawned[t] = 1;
+    }
+    func(writer);
+    for(int t = 1; t < num_threads; t++) {
+        if(spawned[t])
+            pthread_join(threads[t], NULL);
+    }
+
+    return writer->err;
+}
+
+// Write the rendered tiles of tilelist as a tiled BigTIFF. Each tile's
+// pixels go straight to the blocks they fall in, so tiles are copied in any
+// order, on as many threads as there are cores, and no pass over the whole
+// image is needed. num_overviews internal overviews are then built from the
+// blocks already written.
+int writeTiledTIFF(tilelist_t *tilelist, char *outfile, int projection, int num_overviews, uilist_t *uilist) {
+    if(tilelist->num_tiles == 0)
+        return ANAX_ERR_NO_MAP;
+
+    int width;
+    int height;
+    int err = layoutTiles(tilelist, &width, &height);
+    if(err)
+        return err;
+
+    tiffwriter_t writer;
+    memset(&writer, 0, sizeof(tiffwriter_t));
+    writer.tilelist = tilelist;
+    writer.uilist = uilist;
+    writer.block_bytes = (uint64_t)TIFFWRITER_BLOCK * TIFFWRITER_BLOCK * 4;
+
+    // Overviews stop once one fits in a single block
+    for(int i = 0; i < TIFFWRITER_MAX_LEVELS && i <= num_overviews; i++) {
+        tifflevel_t *lvl = &(writer.levels[i]);
+        lvl->width = i ? (writer.levels[i - 1].width + 1) / 2 : width;
+        lvl->height = i ? (writer.levels[i - 1].height + 1) / 2 : height;
+        lvl->blocks_across = (lvl->width + TIFFWRITER_BLOCK - 1) / TIFFWRITER_BLOCK;
+        lvl->blocks_down = (lvl->height + TIFFWRITER_BLOCK - 1) / TIFFWRITER_BLOCK;
+        writer.num_levels++;
+        if(lvl->blocks_across == 1 && lvl->blocks_down == 1)
+            break;
+    }
+
+    // Every IFD comes first, then the data from the smallest level up
+    tiffgeo_t geo;
+    getTIFFGeo(tilelist, projection, &geo);
+    uint64_t offset = 16;
+    for(int i = 0; i < writer.num_levels; i++) {
+        writer.levels[i].ifd_offset = offset;
+        offset += buildTIFFDirectory(&writer, i, &geo, 0, NULL);
+    }
+    offset = (offset + 4095) & ~(uint64_t)4095;
+    for(int i = writer.num_levels - 1; i >= 0; i--) {
+        writer.levels[i].data_offset = offset;
+        offset += (uint64_t)writer.levels[i].blocks_across * writer.levels[i].blocks_down * writer.block_bytes;
+    }
+
+    writer.fd = open(outfile, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if(writer.fd < 0)
+        return ANAX_ERR_COULD_NOT_WRITE;
+    pthread_mutex_init(&(writer.lock), NULL);
+
+    // Blocks no tile reaches are left as holes, which read back as
+    // transparent
+    if(ftruncate(writer.fd, (off_t)offset))
+        err = ANAX_ERR_COULD_NOT_WRITE;
+    uint8_t header[16] = {'I', 'I', 43, 0, 8, 0, 0, 0};
+    putLE(header + 8, writer.levels[0].ifd_offset, 8);
+    if(!err)
+        err = writeTIFFBytes(writer.fd, header, 16, 0);
+    for(int i = 0; i < writer.num_levels && !err; i++) {
+        uint64_t next_ifd = (i + 1 < writer.num_levels) ? writer.levels[i + 1].ifd_offset : 0;
+        size_t size = buildTIFFDirectory(&writer, i, &geo, next_ifd, NULL);
+        uint8_t *buf = calloc(size, 1);
+        if(!buf || buildTIFFDirectory(&writer, i, &geo, next_ifd, buf) != size)
+            err = ANAX_ERR_NO_MEMORY;
+        else
+            err = writeTIFFBytes(writer.fd, buf, size, writer.levels[i].ifd_offset);
+        free(buf);
+    }
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (cores < 1) ? 1 : ((cores > TIFFWRITER_MAX_THREADS) ? TIFFWRITER_MAX_THREADS : (int)cores);
+    if(!err)
+        err = runTIFFPass(&writer, writeTIFFTiles, tilelist->num_tiles, num_threads);
+    for(int i = 1; i < writer.num_levels && !err; i++) {
+        writer.level = i;
+        err = runTIFFPass(&writer, writeTIFFOverview, (long)writer.levels[i].blocks_across * writer.levels[i].blocks_down, num_threads);
+    }
+
+    if(close(writer.fd) && !err)
+        err = ANAX_ERR_COULD_NOT_WRITE;
+    pthread_mutex_destroy(&(writer.lock));
+    return err;
+}
@@ -0,0 +1,50 @@
+#ifndef TIFFWRITER_H
+#define TIFFWRITER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libanax.h"
+
+#define TIFFWRITER_BLOCK                            256
+#define TIFFWRITER_MAX_LEVELS                       16
+#define TIFFWRITER_MAX_THREADS                      64
+#define TIFFWRITER_EARTH_RADIUS                     6378137.0
+
+// One resolution of the image: the full mosaic, or an overview at 1/2^n of
+// its size. Blocks are stored uncompressed, row-major, so every block's
+// offset is known before any pixel is written.
+struct tiff_level {
+    int width;
+    int height;
+    int blocks_across;
+    int blocks_down;
+    uint64_t ifd_offset;
+    uint64_t data_offset;
+};
+typedef struct tiff_level tifflevel_t;
+
+// A tiled RGBA BigTIFF laid out as a cloud-optimized GeoTIFF: every IFD
+// first, then the pixel data from the smallest overview to the full image
+struct tiff_writer {
+    int fd;
+    tilelist_t *tilelist;
+    int num_levels;
+    tifflevel_t levels[TIFFWRITER_MAX_LEVELS];
+    uint64_t block_bytes;
+    
+    // Work shared out between threads: source tiles for the full image,
+    // then blocks of each overview in turn
+    int level;
+    long next;
+    int done;
+    int err;
+    uilist_t *uilist;
+    pthread_mutex_t lock;
+};
+typedef struct tiff_writer tiffwriter_t;
+
+int writeTiledTIFF(tilelist_t *tilelist, char *outfile, int projection, int num_overviews, uilist_t *uilist);
+void *writeTIFFTiles(void *argt);
+void *writeTIFFOverview(void *argt);
+
+#endif
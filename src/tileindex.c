@@ -0,0 +1,232 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tileindex.h"
+
+int initTileIndex(tileindex_t **index) {
+    *index = calloc(1, sizeof(tileindex_t));
+    if(!*index)
+        return ANAX_ERR_NO_MEMORY;
+    pthread_mutex_init(&((*index)->lock), NULL);
+    
+    return 0;
+}
+
+void freeTileIndex(tileindex_t *index) {
+    if(!index)
+        return;
+    for(int i = 0; i < TILEINDEX_BUCKETS; i++) {
+        tileindex_entry_t *entry = index->buckets[i];
+        while(entry) {
+            tileindex_entry_t *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    pthread_mutex_destroy(&(index->lock));
+    free(index);
+}
+
+static unsigned int hashCell(int cell_x, int cell_y) {
+    unsigned int h = ((unsigned int)cell_x * 73856093u) ^ ((unsigned int)cell_y * 19349663u);
+    return h % TILEINDEX_BUCKETS;
+}
+
+static int getCellX(tileindex_t *index, double lon) {
+    return (int)floor((lon - index->origin_lon) / index->cell_width);
+}
+
+static int getCellY(tileindex_t *index, double lat) {
+    return (int)floor((lat - index->origin_lat) / index->cell_height);
+}
+
+static int compareExtents(const void *a, const void *b) {
+    double da = *(const double *)a;
+    double db = *(const double *)b;
+    return (da > db) - (da < db);
+}
+
+// Add a tile to every cell its bounds overlap. The caller holds the lock.
+static int insertTileCells(tileindex_t *index, anaxjob_t *job, int node, int slot) {
+    int x0 = getCellX(index, job->left_lon);
+    int x1 = getCellX(index, job->right_lon);
+    int y0 = getCellY(index, job->bottom_lat);
+    int y1 = getCellY(index, job->top_lat);
+    for(int y = y0; y <= y1; y++) {
+        for(int x = x0; x <= x1; x++) {
+            tileindex_entry_t *entry = malloc(sizeof(tileindex_entry_t));
+            if(!entry)
+                return ANAX_ERR_NO_MEMORY;
+            entry->job = job;
+            entry->node = node;
+            entry->slot = slot;
+            entry->cell_x = x;
+            entry->cell_y = y;
+            unsigned int bucket = hashCell(x, y);
+            entry->next = index->buckets[bucket];
+            index->buckets[bucket] = entry;
+        }
+    }
+    
+    return 0;
+}
+
+// Size the grid cells to the median of the given tile extents, so that mixed
+// tile sizes (decimated or projected tiles, or a small first tile) still keep
+// a lookup to a single bucket. Tiles already inserted are moved onto the new
+// grid. The extents are sorted in place.
+int sizeTileIndex(tileindex_t *index, double *widths, double *heights, int num_tiles) {
+    if(num_tiles <= 0)
+        return 0;
+    qsort(widths, num_tiles, sizeof(double), compareExtents);
+    qsort(heights, num_tiles, sizeof(double), compareExtents);
+    
+    pthread_mutex_lock(&(index->lock));
+    
+    // Keep one entry per tile, the one in the cell of its southwest corner
+    tileindex_entry_t *tiles = NULL;
+    for(int i = 0; i < TILEINDEX_BUCKETS; i++) {
+        tileindex_entry_t *entry = index->buckets[i];
+        while(entry) {
+            tileindex_entry_t *next = entry->next;
+            if(entry->cell_x == getCellX(index, entry->job->left_lon) && entry->cell_y == getCellY(index, entry->job->bottom_lat)) {
+                entry->next = tiles;
+                tiles = entry;
+            } else {
+                free(entry);
+            }
+            entry = next;
+        }
+        index->buckets[i] = NULL;
+    }
+    
+    index->cell_width = (widths[num_tiles / 2] > 0) ? widths[num_tiles / 2] : 1.0;
+    index->cell_height = (heights[num_tiles / 2] > 0) ? heights[num_tiles / 2] : 1.0;
+    index->sized = 1;
+    
+    int err = 0;
+    while(tiles) {
+        tileindex_entry_t *next = tiles->next;
+        if(!err)
+            err = insertTileCells(index, tiles->job, tiles->node, tiles->slot);
+        free(tiles);
+        tiles = next;
+    }
+    
+    pthread_mutex_unlock(&(index->lock));
+    return err;
+}
+
+// Size the grid to the bounds of a list of jobs (see sizeTileIndex)
+int sizeTileIndexToJobs(tileindex_t *index, anaxjob_t *jobs, int num_jobs) {
+    double *widths = malloc((num_jobs > 0 ? num_jobs : 1) * sizeof(double));
+    double *heights = malloc((num_jobs > 0 ? num_jobs : 1) * sizeof(double));
+    int err = ANAX_ERR_NO_MEMORY;
+    if(widths && heights) {
+        for(int i = 0; i < num_jobs; i++) {
+            widths[i] = jobs[i].right_lon - jobs[i].left_lon;
+            heights[i] = jobs[i].top_lat - jobs[i].bottom_lat;
+        }
+        err = sizeTileIndex(index, widths, heights, num_jobs);
+    }
+    free(widths);
+    free(heights);
+    
+    return err;
+}
+
+int insertTileIndex(tileindex_t *index, anaxjob_t *job, int node, int slot) {
+    pthread_mutex_lock(&(index->lock));
+    
+    // Without a size set by sizeTileIndex, size the grid after the first tile
+    if(index->num_entries == 0) {
+        if(!index->sized) {
+            index->cell_width = job->right_lon - job->left_lon;
+            index->cell_height = job->top_lat - job->bottom_lat;
+            if(index->cell_width <= 0)
+                index->cell_width = 1.0;
+            if(index->cell_height <= 0)
+                index->cell_height = 1.0;
+        }
+        index->origin_lon = job->left_lon;
+        index->origin_lat = job->bottom_lat;
+    }
+    
+    int err = insertTileCells(index, job, node, slot);
+    if(!err)
+        index->num_entries++;
+    
+    pthread_mutex_unlock(&(index->lock));
+    return err;
+}
+
+// Find a tile other than 'exclude' whose bounds strictly contain the point.
+// With 'local' set only local tiles are considered, otherwise only remote ones.
+tileindex_entry_t *queryTileIndex(tileindex_t *index, double lat, double lon, anaxjob_t *exclude, int local) {
+    tileindex_entry_t *found = NULL;
+    
+    pthread_mutex_lock(&(index->lock));
+    if(index->num_entries > 0) {
+        int x = getCellX(index, lon);
+        int y = getCellY(index, lat);
+        for(tileindex_entry_t *entry = index->buckets[hashCell(x, y)]; entry; entry = entry->next) {
+            if(entry->cell_x != x || entry->cell_y != y || entry->job == exclude)
+                continue;
+            if((entry->node == TILEINDEX_LOCAL) != (local != 0))
+                continue;
+            if(lat > entry->job->bottom_lat && lat < entry->job->top_lat &&
+               lon > entry->job->left_lon && lon < entry->job->right_lon) {
+                found = entry;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&(index->lock));
+    
+    return found;
+}
+
+// Look up the tiles that supply each of the eight halo regions of a job, by
+// probing the midpoint of each region. Results are indexed by ANAX_MAP_* - 1
+// and are NULL where there is no neighbor.
+int findNeighbors(tileindex_t *index, anaxjob_t *job, int local, tileindex_entry_t *neighbors[8]) {
+    frame_coords_t *frame = &(job->frame_coordinates);
+    neighbors[ANAX_MAP_NORTH - 1] = queryTileIndex(index, frame->north_lat, frame->mid_lon, job, local);
+    neighbors[ANAX_MAP_SOUTH - 1] = queryTileIndex(index, frame->south_lat, frame->mid_lon, job, local);
+    neighbors[ANAX_MAP_WEST - 1] = queryTileIndex(index, frame->mid_lat, frame->west_lon, job, local);
+    neighbors[ANAX_MAP_EAST - 1] = queryTileIndex(index, frame->mid_lat, frame->east_lon, job, local);
+    neighbors[ANAX_MAP_NORTHWEST - 1] = queryTileIndex(index, frame->north_lat, frame->west_lon, job, local);
+    neighbors[ANAX_MAP_NORTHEAST - 1] = queryTileIndex(index, frame->north_lat, frame->east_lon, job, local);
+    neighbors[ANAX_MAP_SOUTHWEST - 1] = queryTileIndex(index, frame->south_lat, frame->west_lon, job, local);
+    neighbors[ANAX_MAP_SOUTHEAST - 1] = queryTileIndex(index, frame->south_lat, frame->east_lon, job, local);
+    
+    return 0;
+}
+
+int getOppositeDirection(int direction) {
+    switch(direction) {
+        case ANAX_MAP_NORTH:        return ANAX_MAP_SOUTH;
+        case ANAX_MAP_SOUTH:        return ANAX_MAP_NORTH;
+        case ANAX_MAP_WEST:         return ANAX_MAP_EAST;
+        case ANAX_MAP_EAST:         return ANAX_MAP_WEST;
+        case ANAX_MAP_NORTHWEST:    return ANAX_MAP_SOUTHEAST;
+        case ANAX_MAP_NORTHEAST:    return ANAX_MAP_SOUTHWEST;
+        case ANAX_MAP_SOUTHWEST:    return ANAX_MAP_NORTHEAST;
+        case ANAX_MAP_SOUTHEAST:    return ANAX_MAP_NORTHWEST;
+    }
+    return 0;
+}
+
+int *getFrameFlag(frame_coords_t *frame, int direction) {
+    switch(direction) {
+        case ANAX_MAP_NORTH:        return &(frame->N_set);
+        case ANAX_MAP_SOUTH:        return &(frame->S_set);
+        case ANAX_MAP_WEST:         return &(frame->W_set);
+        case ANAX_MAP_EAST:         return &(frame->E_set);
+        case ANAX_MAP_NORTHWEST:    return &(frame->NW_set);
+        case ANAX_MAP_NORTHEAST:    return &(frame->NE_set);
+        case ANAX_MAP_SOUTHWEST:    return &(frame->SW_set);
+        case ANAX_MAP_SOUTHEAST:    return &(frame->SE_set);
+    }
+    return NULL;
+}
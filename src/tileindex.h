@@ -0,0 +1,48 @@
+#ifndef TILEINDEX_H
+#define TILEINDEX_H
+
+#include <pthread.h>
+#include "globals.h"
+
+#define TILEINDEX_BUCKETS                           4096
+#define TILEINDEX_LOCAL                             -1
+
+// One tile's footprint in one grid cell. Tiles spanning several cells have an
+// entry in each.
+struct tile_index_entry {
+    anaxjob_t *job;
+    int node;               // Owning node, or TILEINDEX_LOCAL
+    int slot;               // Position in that node's job array
+    int cell_x;
+    int cell_y;
+    struct tile_index_entry *next;
+};
+typedef struct tile_index_entry tileindex_entry_t;
+
+// Uniform grid hash over tile bounds. The cell size is the median tile extent
+// (see sizeTileIndex), or that of the first tile inserted if it is not set, so
+// each cell holds a small constant number of tiles and a point lookup touches
+// a single bucket.
+struct tile_index {
+    double cell_width;
+    double cell_height;
+    double origin_lon;
+    double origin_lat;
+    int num_entries;        // Tiles, not cells
+    int sized;
+    tileindex_entry_t *buckets[TILEINDEX_BUCKETS];
+    pthread_mutex_t lock;
+};
+typedef struct tile_index tileindex_t;
+
+int initTileIndex(tileindex_t **index);
+void freeTileIndex(tileindex_t *index);
+int sizeTileIndex(tileindex_t *index, double *widths, double *heights, int num_tiles);
+int sizeTileIndexToJobs(tileindex_t *index, anaxjob_t *jobs, int num_jobs);
+int insertTileIndex(tileindex_t *index, anaxjob_t *job, int node, int slot);
+tileindex_entry_t *queryTileIndex(tileindex_t *index, double lat, double lon, anaxjob_t *exclude, int local);
+int findNeighbors(tileindex_t *index, anaxjob_t *job, int local, tileindex_entry_t *neighbors[8]);
+int getOppositeDirection(int direction);
+int *getFrameFlag(frame_coords_t *frame, int direction);
+
+#endif
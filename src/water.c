@@ -0,0 +1,489 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "globals.h"
+#include "water.h"
+
+int32_t getRegionRoot(waterlabels_t *labels, int32_t p) {
+    // Find the root, halving the path on the way
+    int32_t *parent = labels->parent;
+    while(parent[p] >= 0) {
+        int32_t q = parent[p];
+        if(parent[q] < 0)
+            return q;
+        parent[p] = parent[q];
+        p = parent[q];
+    }
+    return p;
+}
+
+int32_t peekRegionRoot(const waterlabels_t *labels, int32_t p) {
+    // As getRegionRoot, but without modifying the labels so that it is safe to
+    // call from several threads at once
+    while(labels->parent[p] >= 0)
+        p = labels->parent[p];
+    return p;
+}
+
+void joinRegions(waterlabels_t *labels, int32_t a, int32_t b) {
+    int32_t ra = getRegionRoot(labels, a);
+    int32_t rb = getRegionRoot(labels, b);
+    if(ra == rb)
+        return;
+
+    // Hang the smaller region off the larger one; roots store negated areas
+    if(labels->parent[ra] > labels->parent[rb]) {
+        int32_t tmp = ra;
+        ra = rb;
+        rb = tmp;
+    }
+    labels->parent[ra] += labels->parent[rb];
+    labels->parent[rb] = ra;
+}
+
+static void joinRow(geotiffmap_t *map, waterlabels_t *labels, int i, int west, int above) {
+    int cols = labels->cols;
+    int16_t *row = MAPBUF_ROW(map->elevation, int16_t, labels->first_row + i) + labels->first_col;
+    int16_t *up = above ? MAPBUF_ROW(map->elevation, int16_t, labels->first_row + i - 1) + labels->first_col : NULL;
+    int32_t p = (int32_t)i * cols;
+    for(int j = 0; j < cols; j++, p++) {
+        int16_t e = row[j];
+        if(west && j > 0 && row[j - 1] == e)
+            joinRegions(labels, p, p - 1);
+        if(up) {
+            // If the pixel above matches, its own neighbors in that row have
+            // already been joined to it
+            if(up[j] == e) {
+                joinRegions(labels, p, p - cols);
+            } else {
+                if(j > 0 && up[j - 1] == e)
+                    joinRegions(labels, p, p - cols - 1);
+                if(j < cols - 1 && up[j + 1] == e)
+                    joinRegions(labels, p, p - cols + 1);
+            }
+        }
+    }
+}
+
+static void runBands(waterband_t *bands, int num_bands, void *(*func)(void *)) {
+    // The calling thread takes the first band
+    pthread_t threads[WATER_MAX_THREADS];
+    int spawned[WATER_MAX_THREADS] = {0};
+    for(int b = 1; b < num_bands; b++) {
+        if(pthread_create(&(threads[b]), NULL, func, &(bands[b])) == 0)
+            spawned[b] = 1;
+        else
+            func(&(bands[b]));
+    }
+    func(&(bands[0]));
+    for(int b = 1; b < num_bands; b++) {
+        if(spawned[b])
+            pthread_join(threads[b], NULL);
+    }
+}
+
+static void setBands(waterband_t *bands, int num_bands, geotiffmap_t *map, waterlabels_t *labels, int min_area) {
+    for(int b = 0; b < num_bands; b++) {
+        bands[b].map = map;
+        bands[b].labels = labels;
+        bands[b].first_row = (int)(((long)labels->rows * b) / num_bands);
+        bands[b].last_row = (int)(((long)labels->rows * (b + 1)) / num_bands);
+        bands[b].min_area = min_area;
+    }
+}
+
+int getWaterBands(int rows) {
+    // Only split tall maps, and into no more bands than there are cores
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_bands = rows / WATER_BAND_MIN_ROWS;
+    if(cores > 0 && num_bands > cores)
+        num_bands = (int)cores;
+    if(num_bands > WATER_MAX_THREADS)
+        num_bands = WATER_MAX_THREADS;
+    return (num_bands < 1) ? 1 : num_bands;
+}
+
+int labelFlatRegions(geotiffmap_t *map, int halo, waterlabels_t **labels) {
+    int rows = map->height + (2 * halo);
+    int cols = map->width + (2 * halo);
+    if((long long)rows * cols > INT32_MAX)
+        return ANAX_ERR_NO_MEMORY;
+
+    *labels = malloc(sizeof(waterlabels_t));
+    if(!*labels)
+        return ANAX_ERR_NO_MEMORY;
+    (*labels)->rows = rows;
+    (*labels)->cols = cols;
+    (*labels)->first_row = MAPFRAME - halo;
+    (*labels)->first_col = MAPFRAME - halo;
+    (*labels)->parent = malloc((size_t)rows * cols * sizeof(int32_t));
+    if(!(*labels)->parent) {
+        free(*labels);
+        *labels = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+
+    // Label each band independently, then join every band's first row to the
+    // last row of the band above it
+    waterband_t bands[WATER_MAX_THREADS];
+    int num_bands = getWaterBands(rows);
+    setBands(bands, num_bands, map, *labels, 0);
+    runBands(bands, num_bands, labelBand);
+    for(int b = 1; b < num_bands; b++)
+        joinRow(map, *labels, bands[b].first_row, 0, 1);
+
+    return 0;
+}
+
+int flagWater(geotiffmap_t *map, waterlabels_t *labels, int min_area) {
+    waterband_t bands[WATER_MAX_THREADS];
+    int num_bands = getWaterBands(labels->rows);
+    setBands(bands, num_bands, map, labels, min_area);
+    runBands(bands, num_bands, flagWaterBand);
+    return 0;
+}
+
+void freeWaterLabels(waterlabels_t *labels) {
+    if(!labels)
+        return;
+    free(labels->parent);
+    free(labels);
+}
+
+void *labelBand(void *argt) {
+    waterband_t *band = (waterband_t *)argt;
+    waterlabels_t *labels = band->labels;
+    for(int i = band->first_row; i < band->last_row; i++) {
+        int32_t *parent = labels->parent + ((int32_t)i * labels->cols);
+        for(int j = 0; j < labels->cols; j++)
+            parent[j] = -1;
+        joinRow(band->map, labels, i, 1, i > band->first_row);
+    }
+    return NULL;
+}
+
+void *flagWaterBand(void *argt) {
+    waterband_t *band = (waterband_t *)argt;
+    waterlabels_t *labels = band->labels;
+    for(int i = band->first_row; i < band->last_row; i++) {
+        uint8_t *water = MAPBUF_ROW(band->map->water, uint8_t, labels->first_row + i) + labels->first_col;
+        int32_t p = (int32_t)i * labels->cols;
+        int32_t last_root = -1;
+        int is_water = 0;
+        for(int j = 0; j < labels->cols; j++, p++) {
+            // Runs of pixels in one region are common, so only look the area
+            // up when the root changes
+            int32_t root = peekRegionRoot(labels, p);
+            if(root != last_root) {
+                is_water = (-labels->parent[root] >= band->min_area);
+                last_root = root;
+            }
+            water[j] = is_water;
+        }
+    }
+    return NULL;
+}
+
+// Looks up, and adds if necessary, the boundary region whose root is the given
+// label. slots is an open-addressed table of region numbers, capacity a power
+// of two comfortably larger than the number of edge pixels.
+static int32_t getBoundaryRegion(waterboundary_t *boundary, int32_t *slots, int capacity, waterlabels_t *labels, int32_t root, int16_t elevation) {
+    uint32_t h = ((uint32_t)root * 2654435761u) & (capacity - 1);
+    while(slots[h] != -1) {
+        if(boundary->regions[slots[h]].pixel == root)
+            return slots[h];
+        h = (h + 1) & (capacity - 1);
+    }
+    int32_t region = boundary->num_regions++;
+    boundary->regions[region].pixel = root;
+    boundary->regions[region].elevation = elevation;
+    boundary->regions[region].area = -labels->parent[root];
+    slots[h] = region;
+    return region;
+}
+
+int exportWaterBoundary(geotiffmap_t *map, waterboundary_t **boundary) {
+    waterlabels_t *labels;
+    int err = labelFlatRegions(map, 0, &labels);
+    if(err)
+        return err;
+
+    int height = map->height;
+    int width = map->width;
+    int perimeter = 2 * (height + width);
+    int capacity = 1;
+    while(capacity < 2 * perimeter)
+        capacity <<= 1;
+    int32_t *slots = malloc(capacity * sizeof(int32_t));
+    *boundary = calloc(1, sizeof(waterboundary_t));
+    if(!slots || !*boundary) {
+        free(slots);
+        free(*boundary);
+        freeWaterLabels(labels);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    memset(slots, 0xff, capacity * sizeof(int32_t));
+    (*boundary)->height = height;
+    (*boundary)->width = width;
+    (*boundary)->regions = malloc(perimeter * sizeof(waterregion_t));
+    for(int e = 0; e < 4; e++)
+        (*boundary)->edges[e] = malloc(((e < WATER_EDGE_W) ? width : height) * sizeof(int32_t));
+    if(!(*boundary)->regions || !(*boundary)->edges[0] || !(*boundary)->edges[1] || !(*boundary)->edges[2] || !(*boundary)->edges[3]) {
+        free(slots);
+        freeWaterBoundary(*boundary);
+        *boundary = NULL;
+        freeWaterLabels(labels);
+        return ANAX_ERR_NO_MEMORY;
+    }
+
+    // Walk each edge, giving every region that reaches it a number
+    for(int e = 0; e < 4; e++) {
+        int length = (e < WATER_EDGE_W) ? width : height;
+        for(int k = 0; k < length; k++) {
+            int row = (e == WATER_EDGE_N) ? 0 : ((e == WATER_EDGE_S) ? height - 1 : k);
+            int col = (e == WATER_EDGE_W) ? 0 : ((e == WATER_EDGE_E) ? width - 1 : k);
+            int16_t elevation = MAPBUF_ROW(map->elevation, int16_t, labels->first_row + row)[labels->first_col + col];
+            int32_t root = getRegionRoot(labels, ((int32_t)row * width) + col);
+            (*boundary)->edges[e][k] = getBoundaryRegion(*boundary, slots, capacity, labels, root, elevation);
+        }
+    }
+
+    free(slots);
+    freeWaterLabels(labels);
+    return 0;
+}
+
+int applyWaterBoundary(waterlabels_t *labels, waterboundary_t *boundary) {
+    // The boundary must come from the same block of the same map
+    if(labels->rows != boundary->height || labels->cols != boundary->width)
+        return ANAX_ERR_INVALID_INVOCATION;
+
+    // Give each edge region its area across all tiles
+    for(int r = 0; r < boundary->num_regions; r++) {
+        int32_t root = getRegionRoot(labels, boundary->regions[r].pixel);
+        int64_t area = boundary->regions[r].area;
+        labels->parent[root] = -(int32_t)((area > INT32_MAX) ? INT32_MAX : area);
+    }
+    
+    return 0;
+}
+
+// Joins the regions of two edges that face each other. Pixel k of one edge
+// touches pixels k - 1 to k + 1 of the other.
+static void joinEdges(waterlabels_t *merged, waterboundary_t *a, int32_t *edge_a, int length_a, waterboundary_t *b, int32_t *edge_b, int length_b) {
+    for(int k = 0; k < length_a; k++) {
+        waterregion_t *ra = &(a->regions[edge_a[k]]);
+        for(int kk = k - 1; kk <= k + 1; kk++) {
+            if(kk < 0 || kk >= length_b)
+                continue;
+            if(b->regions[edge_b[kk]].elevation == ra->elevation)
+                joinRegions(merged, a->offset + edge_a[k], b->offset + edge_b[kk]);
+        }
+    }
+}
+
+static void joinCorners(waterlabels_t *merged, waterboundary_t *a, int32_t region_a, waterboundary_t *b, int32_t region_b) {
+    if(a->regions[region_a].elevation == b->regions[region_b].elevation)
+        joinRegions(merged, a->offset + region_a, b->offset + region_b);
+}
+
+int mergeWaterBoundaries(tileindex_t *index, anaxjob_t **jobs, int num_jobs) {
+    // Number the regions of all tiles consecutively
+    int64_t total = 0;
+    for(int t = 0; t < num_jobs; t++) {
+        waterboundary_t *boundary = jobs[t]->water_boundary;
+        if(!boundary)
+            continue;
+        boundary->offset = (int32_t)total;
+        total += boundary->num_regions;
+    }
+    if(total > INT32_MAX)
+        return ANAX_ERR_NO_MEMORY;
+
+    waterlabels_t merged;
+    merged.rows = 1;
+    merged.cols = (int)total;
+    merged.first_row = 0;
+    merged.first_col = 0;
+    merged.parent = malloc((total > 0 ? total : 1) * sizeof(int32_t));
+    int64_t *areas = calloc((total > 0 ? total : 1), sizeof(int64_t));
+    if(!merged.parent || !areas) {
+        free(merged.parent);
+        free(areas);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    for(int32_t r = 0; r < total; r++)
+        merged.parent[r] = -1;
+
+    // Join regions of equal elevation across every pair of touching edges.
+    // Every node that runs this over the same tiles reaches the same result,
+    // whichever order the pairs are visited in.
+    for(int t = 0; t < num_jobs; t++) {
+        waterboundary_t *a = jobs[t]->water_boundary;
+        if(!a)
+            continue;
+        tileindex_entry_t *local[8];
+        tileindex_entry_t *remote[8];
+        findNeighbors(index, jobs[t], 1, local);
+        findNeighbors(index, jobs[t], 0, remote);
+        for(int direction = ANAX_MAP_NORTH; direction <= ANAX_MAP_SOUTHEAST; direction++) {
+            tileindex_entry_t *entry = local[direction - 1] ? local[direction - 1] : remote[direction - 1];
+            waterboundary_t *b = entry ? entry->job->water_boundary : NULL;
+            if(!b)
+                continue;
+            switch(direction) {
+                case ANAX_MAP_NORTH:
+                    joinEdges(&merged, a, a->edges[WATER_EDGE_N], a->width, b, b->edges[WATER_EDGE_S], b->width);
+                    break;
+                case ANAX_MAP_SOUTH:
+                    joinEdges(&merged, a, a->edges[WATER_EDGE_S], a->width, b, b->edges[WATER_EDGE_N], b->width);
+                    break;
+                case ANAX_MAP_WEST:
+                    joinEdges(&merged, a, a->edges[WATER_EDGE_W], a->height, b, b->edges[WATER_EDGE_E], b->height);
+                    break;
+                case ANAX_MAP_EAST:
+                    joinEdges(&merged, a, a->edges[WATER_EDGE_E], a->height, b, b->edges[WATER_EDGE_W], b->height);
+                    break;
+                case ANAX_MAP_NORTHWEST:
+                    joinCorners(&merged, a, a->edges[WATER_EDGE_N][0], b, b->edges[WATER_EDGE_S][b->width - 1]);
+                    break;
+                case ANAX_MAP_NORTHEAST:
+                    joinCorners(&merged, a, a->edges[WATER_EDGE_N][a->width - 1], b, b->edges[WATER_EDGE_S][0]);
+                    break;
+                case ANAX_MAP_SOUTHWEST:
+                    joinCorners(&merged, a, a->edges[WATER_EDGE_S][0], b, b->edges[WATER_EDGE_N][b->width - 1]);
+                    break;
+                case ANAX_MAP_SOUTHEAST:
+                    joinCorners(&merged, a, a->edges[WATER_EDGE_S][a->width - 1], b, b->edges[WATER_EDGE_N][0]);
+                    break;
+            }
+        }
+    }
+
+    // Total the area of each merged region and hand it back to its parts
+    for(int t = 0; t < num_jobs; t++) {
+        waterboundary_t *boundary = jobs[t]->water_boundary;
+        if(!boundary)
+            continue;
+        for(int r = 0; r < boundary->num_regions; r++)
+            areas[getRegionRoot(&merged, boundary->offset + r)] += boundary->regions[r].area;
+    }
+    for(int t = 0; t < num_jobs; t++) {
+        waterboundary_t *boundary = jobs[t]->water_boundary;
+        if(!boundary)
+            continue;
+        for(int r = 0; r < boundary->num_regions; r++)
+            boundary->regions[r].area = areas[getRegionRoot(&merged, boundary->offset + r)];
+    }
+
+    free(merged.parent);
+    free(areas);
+    return 0;
+}
+
+int packWaterBoundary(waterboundary_t *boundary, uint8_t **buf, size_t *size) {
+    // Count the runs along each edge
+    packedboundary_t hdr;
+    hdr.height = boundary->height;
+    hdr.width = boundary->width;
+    hdr.num_regions = boundary->num_regions;
+    size_t total_runs = 0;
+    for(int e = 0; e < 4; e++) {
+        int length = (e < WATER_EDGE_W) ? boundary->width : boundary->height;
+        hdr.num_runs[e] = 0;
+        for(int k = 0; k < length; k++) {
+            if(k == 0 || boundary->edges[e][k] != boundary->edges[e][k - 1])
+                hdr.num_runs[e]++;
+        }
+        total_runs += hdr.num_runs[e];
+    }
+
+    *size = sizeof(packedboundary_t) + (boundary->num_regions * sizeof(packedregion_t)) + (total_runs * sizeof(packedrun_t));
+    *buf = calloc(*size, sizeof(uint8_t));
+    if(!*buf)
+        return ANAX_ERR_NO_MEMORY;
+    memcpy(*buf, &hdr, sizeof(packedboundary_t));
+    packedregion_t *regions = (packedregion_t *)(*buf + sizeof(packedboundary_t));
+    for(int r = 0; r < boundary->num_regions; r++) {
+        regions[r].area = boundary->regions[r].area;
+        regions[r].elevation = boundary->regions[r].elevation;
+    }
+    packedrun_t *run = (packedrun_t *)(regions + boundary->num_regions);
+    for(int e = 0; e < 4; e++) {
+        int length = (e < WATER_EDGE_W) ? boundary->width : boundary->height;
+        for(int k = 0; k < length; k++) {
+            if(k > 0 && boundary->edges[e][k] == boundary->edges[e][k - 1]) {
+                run[-1].length++;
+            } else {
+                run->length = 1;
+                run->region = boundary->edges[e][k];
+                run++;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+int unpackWaterBoundary(uint8_t *buf, size_t size, waterboundary_t **boundary) {
+    packedboundary_t hdr;
+    if(size < sizeof(packedboundary_t))
+        return ANAX_ERR_INVALID_HEADER;
+    memcpy(&hdr, buf, sizeof(packedboundary_t));
+    size_t total_runs = (size_t)hdr.num_runs[0] + hdr.num_runs[1] + hdr.num_runs[2] + hdr.num_runs[3];
+    if(size != sizeof(packedboundary_t) + (hdr.num_regions * sizeof(packedregion_t)) + (total_runs * sizeof(packedrun_t)))
+        return ANAX_ERR_INVALID_HEADER;
+
+    *boundary = calloc(1, sizeof(waterboundary_t));
+    if(!*boundary)
+        return ANAX_ERR_NO_MEMORY;
+    (*boundary)->height = hdr.height;
+    (*boundary)->width = hdr.width;
+    (*boundary)->num_regions = hdr.num_regions;
+    (*boundary)->regions = malloc((hdr.num_regions > 0 ? hdr.num_regions : 1) * sizeof(waterregion_t));
+    for(int e = 0; e < 4; e++)
+        (*boundary)->edges[e] = malloc(((e < WATER_EDGE_W) ? hdr.width : hdr.height) * sizeof(int32_t));
+    if(!(*boundary)->regions || !(*boundary)->edges[0] || !(*boundary)->edges[1] || !(*boundary)->edges[2] || !(*boundary)->edges[3]) {
+        freeWaterBoundary(*boundary);
+        *boundary = NULL;
+        return ANAX_ERR_NO_MEMORY;
+    }
+
+    // Regions from another node have no pixel in any local labeling
+    packedregion_t *regions = (packedregion_t *)(buf + sizeof(packedboundary_t));
+    for(uint32_t r = 0; r < hdr.num_regions; r++) {
+        (*boundary)->regions[r].pixel = -1;
+        (*boundary)->regions[r].elevation = regions[r].elevation;
+        (*boundary)->regions[r].area = regions[r].area;
+    }
+    packedrun_t *run = (packedrun_t *)(regions + hdr.num_regions);
+    for(int e = 0; e < 4; e++) {
+        uint32_t length = (e < WATER_EDGE_W) ? hdr.width : hdr.height;
+        uint32_t k = 0;
+        for(uint32_t n = 0; n < hdr.num_runs[e]; n++, run++) {
+            if(run->region < 0 || (uint32_t)run->region >= hdr.num_regions || run->length > length - k) {
+                freeWaterBoundary(*boundary);
+                *boundary = NULL;
+                return ANAX_ERR_INVALID_HEADER;
+            }
+            for(uint32_t i = 0; i < run->length; i++)
+                (*boundary)->edges[e][k++] = run->region;
+        }
+        if(k != length) {
+            freeWaterBoundary(*boundary);
+            *boundary = NULL;
+            return ANAX_ERR_INVALID_HEADER;
+        }
+    }
+    
+    return 0;
+}
+
+void freeWaterBoundary(waterboundary_t *boundary) {
+    if(!boundary)
+        return;
+    free(boundary->regions);
+    for(int e = 0; e < 4; e++)
+        free(boundary->edges[e]);
+    free(boundary);
+}
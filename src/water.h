@@ -0,0 +1,107 @@
+#ifndef WATER_H
+#define WATER_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "libanax.h"
+#include "tileindex.h"
+
+#define WATER_MIN_AREA_DEFAULT                      100
+#define WATER_MAX_THREADS                           64
+#define WATER_BAND_MIN_ROWS                         512
+
+#define WATER_EDGE_N                                0
+#define WATER_EDGE_S                                1
+#define WATER_EDGE_W                                2
+#define WATER_EDGE_E                                3
+
+// Labels the 8-connected regions of equal elevation in a block of a map's
+// elevation plane, which starts at plane row first_row and column first_col.
+// Pixels are numbered row-major over the block; parent[p] is the index of
+// another pixel in p's region, or, if p is the root of its region, the
+// region's area in pixels negated.
+struct water_labels {
+    int rows;
+    int cols;
+    int first_row;
+    int first_col;
+    int32_t *parent;
+};
+typedef struct water_labels waterlabels_t;
+
+// One row band of a labeling pass
+struct water_band {
+    geotiffmap_t *map;
+    waterlabels_t *labels;
+    int first_row;
+    int last_row;
+    int min_area;
+};
+typedef struct water_band waterband_t;
+
+// A flat region that touches the edge of a tile. area covers only the tile's
+// own pixels until mergeWaterBoundaries replaces it with the area of the
+// region across all tiles it extends into.
+struct water_region {
+    int32_t pixel;          // Any pixel of the region, as a label index
+    int16_t elevation;
+    uint8_t fill[2];
+    int64_t area;
+};
+typedef struct water_region waterregion_t;
+
+// The flat regions along the edges of a tile, labeled without the halo so that
+// every pixel is counted by exactly one tile. edges[WATER_EDGE_*] give the
+// region of each pixel along the top and bottom rows (width entries, west to
+// east) and the left and right columns (height entries, north to south).
+struct water_boundary {
+    int height;
+    int width;
+    int num_regions;
+    waterregion_t *regions;
+    int32_t *edges[4];
+    int32_t offset;         // First region's index during a merge
+};
+typedef struct water_boundary waterboundary_t;
+
+// Wire format of a boundary: the header, then num_regions packed regions, then
+// for each edge in WATER_EDGE_* order its runs of pixels in the same region
+struct packed_water_boundary {
+    uint32_t height;
+    uint32_t width;
+    uint32_t num_regions;
+    uint32_t num_runs[4];
+    uint32_t fill;
+};
+typedef struct packed_water_boundary packedboundary_t;
+
+struct packed_water_region {
+    int64_t area;
+    int16_t elevation;
+    uint8_t fill[6];
+};
+typedef struct packed_water_region packedregion_t;
+
+struct packed_water_run {
+    uint32_t length;
+    int32_t region;
+};
+typedef struct packed_water_run packedrun_t;
+
+int32_t getRegionRoot(waterlabels_t *labels, int32_t p);
+int32_t peekRegionRoot(const waterlabels_t *labels, int32_t p);
+void joinRegions(waterlabels_t *labels, int32_t a, int32_t b);
+int getWaterBands(int rows);
+int labelFlatRegions(geotiffmap_t *map, int halo, waterlabels_t **labels);
+int flagWater(geotiffmap_t *map, waterlabels_t *labels, int min_area);
+void freeWaterLabels(waterlabels_t *labels);
+int exportWaterBoundary(geotiffmap_t *map, waterboundary_t **boundary);
+int applyWaterBoundary(waterlabels_t *labels, waterboundary_t *boundary);
+int mergeWaterBoundaries(tileindex_t *index, anaxjob_t **jobs, int num_jobs);
+int packWaterBoundary(waterboundary_t *boundary, uint8_t **buf, size_t *size);
+int unpackWaterBoundary(uint8_t *buf, size_t size, waterboundary_t **boundary);
+void freeWaterBoundary(waterboundary_t *boundary);
+void *labelBand(void *argt);
+void *flagWaterBand(void *argt);
+
+#endif
@@ -0,0 +1,625 @@
+#include <errno.h>
+#include <math.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "globals.h"
+#include "pyramid.h"
+#include "xyztiles.h"
+
+// A PNG being encoded into memory
+struct xyz_png {
+    png_byte *data;
+    size_t size;
+    size_t capacity;
+    int err;
+};
+typedef struct xyz_png xyzpng_t;
+
+static double projectLatitude(int projection, double lat) {
+    if(projection == PROJ_MERCATOR) {
+        double phi = lat * (M_PI / 180.0);
+        return log((1.0 + sin(phi)) / cos(phi));
+    }
+    return lat;
+}
+
+static double unprojectLatitude(int projection, double y) {
+    if(projection == PROJ_MERCATOR)
+        return atan(sinh(y)) * (180.0 / M_PI);
+    return y;
+}
+
+// Fractional tile coordinates of a longitude or latitude at the given zoom
+static double longitudeToTileX(double lon, int zoom) {
+    return ((lon + 180.0) / 360.0) * ldexp(1.0, zoom);
+}
+
+static double latitudeToTileY(double lat, int zoom) {
+    lat = fmax(fmin(lat, XYZ_MAX_LATITUDE), -XYZ_MAX_LATITUDE);
+    return ((1.0 - (projectLatitude(PROJ_MERCATOR, lat) / M_PI)) / 2.0) * ldexp(1.0, zoom);
+}
+
+static double tileXToLongitude(double x, int zoom) {
+    return ((x / ldexp(1.0, zoom)) * 360.0) - 180.0;
+}
+
+static double tileYToLatitude(double y, int zoom) {
+    return unprojectLatitude(PROJ_MERCATOR, M_PI * (1.0 - (2.0 * y / ldexp(1.0, zoom))));
+}
+
+// Half a pixel of a source in x and y; samples that far beyond its outermost
+// pixel centers still belong to it
+static double getSourceHalfWidth(xyzsource_t *src) {
+    return (src->tile->east - src->tile->west) / (2.0 * (src->tile->img_width - 1));
+}
+
+static double getSourceHalfHeight(xyzsource_t *src) {
+    return (src->north_y - src->south_y) / (2.0 * (src->tile->img_height - 1));
+}
+
+static int loadXYZSource(xyzsource_t *src) {
+    pthread_mutex_lock(&(src->lock));
+    if(src->loaded || src->err) {
+        pthread_mutex_unlock(&(src->lock));
+        return src->err;
+    }
+
+    FILE *fp = fopen(src->tile->name, "r");
+    png_structp png_ptr = NULL;
+    png_infop info_ptr = NULL;
+    if(!fp) {
+        src->err = ANAX_ERR_FILE_DOES_NOT_EXIST;
+        pthread_mutex_unlock(&(src->lock));
+        return src->err;
+    }
+    if(!src->tile->raw) {
+        png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if(png_ptr)
+            info_ptr = png_create_info_struct(png_ptr);
+    }
+    src->rgba = malloc((size_t)src->tile->img_width * src->tile->img_height * 4);
+    if(src->tile->raw && src->rgba) {
+        size_t pixels = (size_t)src->tile->img_width * src->tile->img_height;
+        if(fread(src->rgba, 4, pixels, fp) == pixels)
+            src->loaded = 1;
+        else
+            src->err = ANAX_ERR_FILE_DOES_NOT_EXIST;
+    } else if(!png_ptr || !info_ptr || !src->rgba) {
+        src->err = src->rgba ? ANAX_ERR_PNG_STRUCT_FAILURE : ANAX_ERR_NO_MEMORY;
+    } else if(setjmp(png_jmpbuf(png_ptr))) {
+        src->err = ANAX_ERR_PNG_STRUCT_FAILURE;
+    } else {
+        png_init_io(png_ptr, fp);
+        png_read_info(png_ptr, info_ptr);
+        if(png_get_image_width(png_ptr, info_ptr) != src->tile->img_width ||
+           png_get_image_height(png_ptr, info_ptr) != src->tile->img_height ||
+           png_get_rowbytes(png_ptr, info_ptr) != (size_t)src->tile->img_width * 4) {
+            src->err = ANAX_ERR_PNG_STRUCT_FAILURE;
+        } else {
+            for(int r = 0; r < src->tile->img_height; r++)
+                png_read_row(png_ptr, src->rgba + ((size_t)r * src->tile->img_width * 4), NULL);
+            src->loaded = 1;
+        }
+    }
+    if(png_ptr)
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    fclose(fp);
+    if(src->err) {
+        free(src->rgba);
+        src->rgba = NULL;
+    }
+
+    pthread_mutex_unlock(&(src->lock));
+    return src->err;
+}
+
+// Bilinearly sample a source at a fractional row and column
+static void sampleXYZSource(xyzsource_t *src, double row, double col, png_byte *out) {
+    int width = src->tile->img_width;
+    int height = src->tile->img_height;
+    row = fmax(fmin(row, height - 1), 0.0);
+    col = fmax(fmin(col, width - 1), 0.0);
+    int r0 = (int)row;
+    int c0 = (int)col;
+    int r1 = (r0 + 1 < height) ? r0 + 1 : r0;
+    int c1 = (c0 + 1 < width) ? c0 + 1 : c0;
+    double fr = row - r0;
+    double fc = col - c0;
+
+    png_byte *p00 = src->rgba + (((size_t)r0 * width + c0) * 4);
+    png_byte *p01 = src->rgba + (((size_t)r0 * width + c1) * 4);
+    png_byte *p10 = src->rgba + (((size_t)r1 * width + c0) * 4);
+    png_byte *p11 = src->rgba + (((size_t)r1 * width + c1) * 4);
+    for(int ch = 0; ch < 4; ch++) {
+        double top = p00[ch] + (fc * (p01[ch] - p00[ch]));
+        double bottom = p10[ch] + (fc * (p11[ch] - p10[ch]));
+        out[ch] = (png_byte)lrint(top + (fr * (bottom - top)));
+    }
+}
+
+// Render tile (x, y) of the base zoom level from the sources that overlap it
+static int renderXYZTile(xyzwriter_t *writer, int x, int y, png_byte *rgba, int *candidates, double *rows) {
+    int size = writer->tile_size;
+    int zoom = writer->levels[0].zoom;
+    double west = tileXToLongitude(x, zoom);
+    double east = tileXToLongitude(x + 1, zoom);
+    double north = tileYToLatitude(y, zoom);
+    double south = tileYToLatitude(y + 1, zoom);
+
+    int num_candidates = 0;
+    for(int i = 0; i < writer->num_active; i++) {
+        xyzsource_t *src = writer->active[i];
+        double half_lon = getSourceHalfWidth(src);
+        double half_y = getSourceHalfHeight(src);
+        if(src->tile->west - half_lon > east || src->tile->east + half_lon < west ||
+           src->south_y - half_y > projectLatitude(writer->projection, north) ||
+           src->north_y + half_y < projectLatitude(writer->projection, south))
+            continue;
+        int err = loadXYZSource(src);
+        if(err)
+            return err;
+        candidates[num_candidates++] = src - writer->sources;
+    }
+
+    memset(rgba, 0, (size_t)size * size * 4);
+    for(int j = 0; j < size; j++) {
+        double lat = tileYToLatitude(y + ((j + 0.5) / size), zoom);
+        double py = projectLatitude(writer->projection, lat);
+        for(int c = 0; c < num_candidates; c++) {
+            xyzsource_t *src = &(writer->sources[candidates[c]]);
+            rows[c] = ((src->north_y - py) / (src->north_y - src->south_y)) * (src->tile->img_height - 1);
+        }
+
+        png_byte *out = rgba + ((size_t)j * size * 4);
+        for(int i = 0; i < size; i++, out += 4) {
+            double lon = tileXToLongitude(x + ((i + 0.5) / size), zoom);
+            for(int c = 0; c < num_candidates; c++) {
+                xyzsource_t *src = &(writer->sources[candidates[c]]);
+                double col = ((lon - src->tile->west) / (src->tile->east - src->tile->west)) * (src->tile->img_width - 1);
+                if(rows[c] < -0.5 || rows[c] > src->tile->img_height - 0.5 ||
+                   col < -0.5 || col > src->tile->img_width - 0.5)
+                    continue;
+                sampleXYZSource(src, rows[c], col, out);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static int compareSourcesFirstRow(const void *a, const void *b) {
+    return (*(xyzsource_t * const *)a)->first_row - (*(xyzsource_t * const *)b)->first_row;
+}
+
+static int compareSourcesIndex(const void *a, const void *b) {
+    xyzsource_t *sa = *(xyzsource_t * const *)a;
+    xyzsource_t *sb = *(xyzsource_t * const *)b;
+    return (sa > sb) - (sa < sb);
+}
+
+// Bring the sources that may touch base row y into the active list, keeping
+// the order of the tile list so overlaps resolve the same way in every row
+static void activateXYZSources(xyzwriter_t *writer, int y) {
+    int added = 0;
+    while(writer->next_order < writer->num_sources && writer->order[writer->next_order]->first_row <= y) {
+        xyzsource_t *src = writer->order[writer->next_order++];
+        if(src->last_row >= y) {
+            writer->active[writer->num_active++] = src;
+            added = 1;
+        }
+    }
+    if(added)
+        qsort(writer->active, writer->num_active, sizeof(xyzsource_t *), compareSourcesIndex);
+}
+
+// Drop the sources no later row needs, releasing their pixels
+static void retireXYZSources(xyzwriter_t *writer, int y) {
+    int kept = 0;
+    for(int i = 0; i < writer->num_active; i++) {
+        xyzsource_t *src = writer->active[i];
+        if(src->last_row > y) {
+            writer->active[kept++] = src;
+            continue;
+        }
+        free(src->rgba);
+        src->rgba = NULL;
+        src->loaded = 0;
+    }
+    writer->num_active = kept;
+}
+
+// Build tile (x, y) of a zoom level by averaging the four tiles under it
+static void reduceXYZTile(xyzwriter_t *writer, int level, int x, int y, png_byte *rgba) {
+    xyzlevel_t *children = &(writer->levels[level - 1]);
+    int size = writer->tile_size;
+    int half = size / 2;
+    size_t tile_bytes = (size_t)size * size * 4;
+
+    for(int qy = 0; qy < 2; qy++) {
+        for(int qx = 0; qx < 2; qx++) {
+            int cx = (2 * x) + qx;
+            int cy = (2 * y) + qy;
+            png_byte *child = NULL;
+            if(cx >= children->first_x && cx <= children->last_x &&
+               cy >= children->first_y && cy <= children->last_y)
+                child = children->rows[cy & 1] + ((cx - children->first_x) * tile_bytes);
+
+            for(int r = 0; r < half; r++) {
+                png_byte *out = rgba + ((((size_t)((qy * half) + r) * size) + (qx * half)) * 4);
+                if(child)
+                    reduceRGBARows(child + ((size_t)(2 * r) * size * 4), child + ((size_t)((2 * r) + 1) * size * 4), size, out, half);
+                else
+                    memset(out, 0, half * 4);
+            }
+        }
+    }
+}
+
+static void writeXYZPNGData(png_structp png_ptr, png_bytep data, png_size_t length) {
+    xyzpng_t *png = png_get_io_ptr(png_ptr);
+    if(png->err)
+        return;
+    if(png->size + length > png->capacity) {
+        size_t capacity = (png->capacity * 2 > png->size + length) ? png->capacity * 2 : png->size + length;
+        png_byte *data_new = realloc(png->data, capacity);
+        if(!data_new) {
+            png->err = ANAX_ERR_NO_MEMORY;
+            return;
+        }
+        png->data = data_new;
+        png->capacity = capacity;
+    }
+    memcpy(png->data + png->size, data, length);
+    png->size += length;
+}
+
+static void flushXYZPNGData(png_structp png_ptr) {
+}
+
+static int encodeXYZTile(xyzwriter_t *writer, png_byte *rgba, xyzpng_t *png) {
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = NULL;
+    if(!png_ptr)
+        return ANAX_ERR_PNG_STRUCT_FAILURE;
+    info_ptr = png_create_info_struct(png_ptr);
+    if(!info_ptr) {
+        png_destroy_write_struct(&png_ptr, (png_infopp) NULL);
+        return ANAX_ERR_PNG_STRUCT_FAILURE;
+    }
+    if(setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        return ANAX_ERR_PNG_STRUCT_FAILURE;
+    }
+
+    png_set_write_fn(png_ptr, png, writeXYZPNGData, flushXYZPNGData);
+    png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
+    png_set_IHDR(png_ptr, info_ptr, writer->tile_size, writer->tile_size, 8,
+                 PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    for(int r = 0; r < writer->tile_size; r++)
+        png_write_row(png_ptr, rgba + ((size_t)r * writer->tile_size * 4));
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+
+    return png->err;
+}
+
+// Save a tile as OUTPATH/z/x/y.png, or as a row of the container. Tiles with
+// nothing in them are left out.
+static int saveXYZTile(xyzwriter_t *writer, int zoom, int x, int y, png_byte *rgba) {
+    size_t tile_bytes = (size_t)writer->tile_size * writer->tile_size * 4;
+    size_t i;
+    for(i = 3; i < tile_bytes && rgba[i] == 0; i += 4);
+    if(i >= tile_bytes)
+        return 0;
+
+    xyzpng_t png = {NULL, 0, 0, 0};
+    int err = encodeXYZTile(writer, rgba, &png);
+    if(!err && writer->db) {
+        // The container numbers rows from the south, as in TMS
+        pthread_mutex_lock(&(writer->lock));
+        sqlite3_bind_int(writer->insert, 1, zoom);
+        sqlite3_bind_int(writer->insert, 2, x);
+        sqlite3_bind_int(writer->insert, 3, (1 << zoom) - 1 - y);
+        sqlite3_bind_blob(writer->insert, 4, png.data, (int)png.size, SQLITE_STATIC);
+        if(sqlite3_step(writer->insert) != SQLITE_DONE)
+            err = ANAX_ERR_COULD_NOT_WRITE;
+        sqlite3_reset(writer->insert);
+        pthread_mutex_unlock(&(writer->lock));
+    } else if(!err) {
+        char *path = calloc(strlen(writer->outpath) + 64, sizeof(char));
+        FILE *fp = NULL;
+        if(!path) {
+            err = ANAX_ERR_NO_MEMORY;
+        } else {
+            // Other threads may be creating the same directories
+            sprintf(path, "%s/%i", writer->outpath, zoom);
+            mkdir(path, 0755);
+            sprintf(path, "%s/%i/%i", writer->outpath, zoom, x);
+            mkdir(path, 0755);
+            sprintf(path, "%s/%i/%i/%i.png", writer->outpath, zoom, x, y);
+            fp = fopen(path, "w");
+        }
+        if(!err && (!fp || fwrite(png.data, 1, png.size, fp) != png.size))
+            err = ANAX_ERR_COULD_NOT_WRITE;
+        if(fp)
+            fclose(fp);
+        free(path);
+    }
+    free(png.data);
+
+    return err;
+}
+
+// Produce tiles from the current row of the current level until none are left
+void *writeXYZRow(void *argt) {
+    xyzwriter_t *writer = (xyzwriter_t *)argt;
+    xyzlevel_t *level = &(writer->levels[writer->level]);
+    size_t tile_bytes = (size_t)writer->tile_size * writer->tile_size * 4;
+    png_byte *scratch = NULL;
+    int *candidates = malloc(writer->num_sources * sizeof(int));
+    double *rows = malloc(writer->num_sources * sizeof(double));
+    if(!level->rows[0])
+        scratch = malloc(tile_bytes);
+    if(!candidates || !rows || (!level->rows[0] && !scratch)) {
+        pthread_mutex_lock(&(writer->lock));
+        writer->err = ANAX_ERR_NO_MEMORY;
+        pthread_mutex_unlock(&(writer->lock));
+    }
+
+    while(1) {
+        pthread_mutex_lock(&(writer->lock));
+        int x = writer->next_x++;
+        int stop = writer->err;
+        pthread_mutex_unlock(&(writer->lock));
+        if(stop || x > level->last_x)
+            break;
+
+        png_byte *rgba = scratch;
+        if(level->rows[0])
+            rgba = level->rows[writer->row & 1] + ((x - level->first_x) * tile_bytes);
+        int err = 0;
+        if(writer->level == 0)
+            err = renderXYZTile(writer, x, writer->row, rgba, candidates, rows);
+        else
+            reduceXYZTile(writer, writer->level, x, writer->row, rgba);
+        if(!err)
+            err = saveXYZTile(writer, level->zoom, x, writer->row, rgba);
+        if(err) {
+            pthread_mutex_lock(&(writer->lock));
+            writer->err = err;
+            pthread_mutex_unlock(&(writer->lock));
+        }
+    }
+
+    free(scratch);
+    free(candidates);
+    free(rows);
+    return NULL;
+}
+
+// Write one row of tiles of a level, one tile per thread at a time. The
+// calling thread takes a share.
+static int runXYZRow(xyzwriter_t *writer, int level, int row, int num_threads) {
+    pthread_t threads[XYZ_MAX_THREADS];
+    int spawned[XYZ_MAX_THREADS] = {0};
+    int width = writer->levels[level].last_x - writer->levels[level].first_x + 1;
+    if(num_threads > width)
+        num_threads = width;
+
+    writer->level = level;
+    writer->row = row;
+    writer->next_x = writer->levels[level].first_x;
+    for(int t = 1; t < num_threads; t++) {
+        if(pthread_create(&(threads[t]), NULL, writeXYZRow, writer) == 0)
+            spawned[t] = 1;
+    }
+    writeXYZRow(writer);
+    for(int t = 1; t < num_threads; t++) {
+        if(spawned[t])
+            pthread_join(threads[t], NULL);
+    }
+
+    return writer->err;
+}
+
+static int openMBTiles(xyzwriter_t *writer) {
+    unlink(writer->outpath);
+    if(sqlite3_open(writer->outpath, &(writer->db)) != SQLITE_OK)
+        return ANAX_ERR_COULD_NOT_WRITE;
+    if(sqlite3_exec(writer->db,
+                    "CREATE TABLE metadata (name TEXT, value TEXT);"
+                    "CREATE TABLE tiles (zoom_level INTEGER, tile_column INTEGER, tile_row INTEGER, tile_data BLOB);"
+                    "CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row);"
+                    "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+        return ANAX_ERR_COULD_NOT_WRITE;
+    if(sqlite3_prepare_v2(writer->db, "INSERT OR REPLACE INTO tiles VALUES (?, ?, ?, ?);", -1, &(writer->insert), NULL) != SQLITE_OK)
+        return ANAX_ERR_COULD_NOT_WRITE;
+
+    return 0;
+}
+
+static int closeMBTiles(xyzwriter_t *writer, double west, double south, double east, double north, int err) {
+    if(!writer->db)
+        return err;
+    if(writer->insert)
+        sqlite3_finalize(writer->insert);
+
+    if(!err) {
+        char *name = strrchr(writer->outpath, '/');
+        name = name ? name + 1 : writer->outpath;
+        char *sql = sqlite3_mprintf(
+            "INSERT INTO metadata VALUES ('name', %Q);"
+            "INSERT INTO metadata VALUES ('format', 'png');"
+            "INSERT INTO metadata VALUES ('type', 'baselayer');"
+            "INSERT INTO metadata VALUES ('minzoom', '%d');"
+            "INSERT INTO metadata VALUES ('maxzoom', '%d');"
+            "INSERT INTO metadata VALUES ('bounds', '%f,%f,%f,%f');"
+            "COMMIT;",
+            name, writer->levels[writer->num_levels - 1].zoom, writer->levels[0].zoom,
+            west, south, east, north);
+        if(!sql || sqlite3_exec(writer->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+            err = ANAX_ERR_COULD_NOT_WRITE;
+        sqlite3_free(sql);
+    }
+    if(sqlite3_close(writer->db) != SQLITE_OK && !err)
+        err = ANAX_ERR_COULD_NOT_WRITE;
+
+    return err;
+}
+
+static void freeXYZWriter(xyzwriter_t *writer) {
+    for(int i = 0; i < writer->num_sources; i++) {
+        free(writer->sources[i].rgba);
+        pthread_mutex_destroy(&(writer->sources[i].lock));
+    }
+    for(int i = 0; i < writer->num_levels; i++) {
+        free(writer->levels[i].rows[0]);
+        free(writer->levels[i].rows[1]);
+    }
+    free(writer->sources);
+    free(writer->order);
+    free(writer->active);
+    free(writer->levels);
+    pthread_mutex_destroy(&(writer->lock));
+}
+
+// Cut the rendered tiles of tilelist into z/x/y web map tiles of tile_size
+// pixels. The base zoom level is the one closest to the resolution of the
+// rendered tiles, rounded up; num_levels more zoom levels are built from it.
+// outpath is a directory, or a single container if it ends in .mbtiles.
+int writeXYZTiles(tilelist_t *tilelist, char *outpath, int projection, int tile_size, int num_levels, uilist_t *uilist) {
+    if(tilelist->num_tiles == 0)
+        return ANAX_ERR_NO_MAP;
+
+    xyzwriter_t writer;
+    memset(&writer, 0, sizeof(xyzwriter_t));
+    writer.projection = projection;
+    writer.tile_size = tile_size;
+    writer.outpath = outpath;
+    pthread_mutex_init(&(writer.lock), NULL);
+
+    // Find the extent of the rendered tiles, out to the edges of their pixels
+    writer.sources = calloc(tilelist->num_tiles, sizeof(xyzsource_t));
+    writer.order = malloc(tilelist->num_tiles * sizeof(xyzsource_t *));
+    writer.active = malloc(tilelist->num_tiles * sizeof(xyzsource_t *));
+    if(!writer.sources || !writer.order || !writer.active) {
+        freeXYZWriter(&writer);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    writer.num_sources = tilelist->num_tiles;
+    double west = DBL_MAX;
+    double east = -DBL_MAX;
+    double north = -DBL_MAX;
+    double south = DBL_MAX;
+    double finest = DBL_MAX;
+    for(int i = 0; i < writer.num_sources; i++) {
+        xyzsource_t *src = &(writer.sources[i]);
+        src->tile = &(tilelist->tiles[i]);
+        src->north_y = projectLatitude(projection, src->tile->north);
+        src->south_y = projectLatitude(projection, src->tile->south);
+        pthread_mutex_init(&(src->lock), NULL);
+
+        double half_lon = getSourceHalfWidth(src);
+        double half_y = getSourceHalfHeight(src);
+        west = fmin(west, src->tile->west - half_lon);
+        east = fmax(east, src->tile->east + half_lon);
+        north = fmax(north, unprojectLatitude(projection, src->north_y + half_y));
+        south = fmin(south, unprojectLatitude(projection, src->south_y - half_y));
+        finest = fmin(finest, 2.0 * half_lon);
+    }
+    west = fmax(west, -180.0);
+    east = fmin(east, 180.0);
+    north = fmin(north, XYZ_MAX_LATITUDE);
+    south = fmax(south, -XYZ_MAX_LATITUDE);
+
+    int zoom = (int)ceil(log2(360.0 / (tile_size * finest)) - 0.01);
+    zoom = (zoom < 0) ? 0 : ((zoom > XYZ_MAX_ZOOM) ? XYZ_MAX_ZOOM : zoom);
+    num_levels = (num_levels + 1 > zoom + 1) ? zoom + 1 : num_levels + 1;
+    writer.levels = calloc(num_levels, sizeof(xyzlevel_t));
+    if(!writer.levels) {
+        freeXYZWriter(&writer);
+        return ANAX_ERR_NO_MEMORY;
+    }
+    writer.num_levels = num_levels;
+
+    int last = (1 << zoom) - 1;
+    writer.levels[0].zoom = zoom;
+    writer.levels[0].first_x = (int)fmax(floor(longitudeToTileX(west, zoom)), 0);
+    writer.levels[0].last_x = (int)fmin(floor(longitudeToTileX(east, zoom) - 1e-9), last);
+    writer.levels[0].first_y = (int)fmax(floor(latitudeToTileY(north, zoom)), 0);
+    writer.levels[0].last_y = (int)fmin(floor(latitudeToTileY(south, zoom) - 1e-9), last);
+    for(int i = 0; i < writer.num_sources; i++) {
+        xyzsource_t *src = &(writer.sources[i]);
+        double edge = unprojectLatitude(projection, src->south_y - getSourceHalfHeight(src));
+        src->last_row = (int)fmin(floor(latitudeToTileY(edge, zoom) - 1e-9), last);
+        // A row early, so an edge on a tile boundary is never missed
+        edge = unprojectLatitude(projection, src->north_y + getSourceHalfHeight(src));
+        src->first_row = (int)fmax(floor(latitudeToTileY(edge, zoom)) - 1, 0);
+        writer.order[i] = src;
+    }
+    qsort(writer.order, writer.num_sources, sizeof(xyzsource_t *), compareSourcesFirstRow);
+    for(int i = 1; i < num_levels; i++) {
+        writer.levels[i].zoom = zoom - i;
+        writer.levels[i].first_x = writer.levels[i - 1].first_x >> 1;
+        writer.levels[i].last_x = writer.levels[i - 1].last_x >> 1;
+        writer.levels[i].first_y = writer.levels[i - 1].first_y >> 1;
+        writer.levels[i].last_y = writer.levels[i - 1].last_y >> 1;
+    }
+
+    // Each level but the last keeps two rows of tiles for the next one out
+    size_t tile_bytes = (size_t)tile_size * tile_size * 4;
+    for(int i = 0; i < num_levels - 1; i++) {
+        size_t row_bytes = (writer.levels[i].last_x - writer.levels[i].first_x + 1) * tile_bytes;
+        writer.levels[i].rows[0] = calloc(row_bytes, 1);
+        writer.levels[i].rows[1] = calloc(row_bytes, 1);
+        if(!writer.levels[i].rows[0] || !writer.levels[i].rows[1]) {
+            freeXYZWriter(&writer);
+            return ANAX_ERR_NO_MEMORY;
+        }
+    }
+
+    int err = 0;
+    int len = strlen(outpath);
+    if(len > 8 && !strcmp(outpath + len - 8, ".mbtiles"))
+        err = openMBTiles(&writer);
+    else if(mkdir(outpath, 0755) && errno != EEXIST)
+        err = ANAX_ERR_COULD_NOT_WRITE;
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (cores < 1) ? 1 : ((cores > XYZ_MAX_THREADS) ? XYZ_MAX_THREADS : (int)cores);
+    xyzlevel_t *base = &(writer.levels[0]);
+    for(int y = base->first_y; y <= base->last_y && !err; y++) {
+        activateXYZSources(&writer, y);
+        err = runXYZRow(&writer, 0, y, num_threads);
+        retireXYZSources(&writer, y);
+
+        // Every second row, and the last, completes a row of the next level
+        // out, which in turn may complete one further out
+        int level = 0;
+        int row = y;
+        while(!err && level + 1 < num_levels && ((row & 1) || row == writer.levels[level].last_y)) {
+            err = runXYZRow(&writer, level + 1, row >> 1, num_threads);
+            size_t row_bytes = (writer.levels[level].last_x - writer.levels[level].first_x + 1) * tile_bytes;
+            memset(writer.levels[level].rows[0], 0, row_bytes);
+            memset(writer.levels[level].rows[1], 0, row_bytes);
+            level++;
+            row >>= 1;
+        }
+
+        if(uilist) {
+            updateFinalUIState(&(uilist->final), ((y - base->first_y + 1) * 100) / (base->last_y - base->first_y + 1));
+            updateFinalView(&(uilist->final));
+        }
+    }
+
+    err = closeMBTiles(&writer, west, south, east, north, err);
+    freeXYZWriter(&writer);
+    return err;
+}
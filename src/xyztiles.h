@@ -0,0 +1,68 @@
+#ifndef XYZTILES_H
+#define XYZTILES_H
+
+#include <png.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include "libanax.h"
+
+#define XYZ_MAX_THREADS                             64
+#define XYZ_MAX_ZOOM                                24
+#define XYZ_MAX_LATITUDE                            85.0511287798
+
+// One rendered job image, decoded the first time an output tile needs it and
+// released once the output has moved south of it. Rows and columns are
+// linear in x and y, where y is latitude or, for PROJ_MERCATOR, Mercator y.
+struct xyz_source {
+    tile_t *tile;
+    png_byte *rgba;
+    int loaded;
+    int err;
+    double north_y;         // y of the center of the first row
+    double south_y;         // y of the center of the last row
+    int first_row;          // First row of base zoom tiles that may touch it
+    int last_row;           // Last row of base zoom tiles that touches it
+    pthread_mutex_t lock;
+};
+typedef struct xyz_source xyzsource_t;
+
+// The range of tiles being written at one zoom level. Levels that feed the
+// next zoom level out keep their last two tile rows.
+struct xyz_level {
+    int zoom;
+    int first_x;
+    int last_x;
+    int first_y;
+    int last_y;
+    png_byte *rows[2];      // Tile rows with odd and even y, tile-major
+};
+typedef struct xyz_level xyzlevel_t;
+
+struct xyz_writer {
+    int projection;
+    int tile_size;
+    char *outpath;
+    sqlite3 *db;            // Set when writing a container rather than a tree
+    sqlite3_stmt *insert;
+    int num_sources;
+    xyzsource_t *sources;
+    xyzsource_t **order;    // Sources from the first row they touch down
+    int next_order;
+    xyzsource_t **active;   // Sources touching the current base row, in order
+    int num_active;
+    int num_levels;
+    xyzlevel_t *levels;     // levels[0] is rendered from the sources
+    
+    // The tile row being worked on
+    int level;
+    int row;
+    int next_x;
+    int err;
+    pthread_mutex_t lock;
+};
+typedef struct xyz_writer xyzwriter_t;
+
+int writeXYZTiles(tilelist_t *tilelist, char *outpath, int projection, int tile_size, int num_levels, uilist_t *uilist);
+void *writeXYZRow(void *argt);
+
+#endif